@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Комментарии одного пользователя, записанные подряд в куски памяти, каждый
+// с '\n' на конце. Куски только дописываются и никогда не переезжают, поэтому
+// ответ может ссылаться на них, пока жива арена. Дописывание не трогает уже
+// выданные байты, так что читать их можно и после того, как снята блокировка.
+class CommentArena {
+public:
+  void Add(std::string_view comment);
+
+  size_t Size() const {
+    return index.size();
+  }
+
+  // Комментарий с номером i без завершающего '\n'
+  std::string_view At(size_t i) const {
+    const Location& location = index[i];
+    return std::string_view(
+      chunks[location.chunk].data.get() + location.begin,
+      location.end - location.begin - 1
+    );
+  }
+
+  // Передаёт в callback куски памяти с комментариями [offset, offset + limit);
+  // соседние комментарии из одного куска склеиваются в один фрагмент
+  template <typename Callback>
+  void Page(size_t offset, size_t limit, Callback callback) const;
+
+private:
+  // Куски растут вдвое, чтобы пользователи с парой комментариев не занимали много
+  static constexpr size_t kFirstChunkSize = 256;
+  static constexpr size_t kMaxChunkSize = 64 * 1024;
+
+  struct Chunk {
+    std::unique_ptr<char[]> data;
+    size_t capacity;
+    size_t size;
+  };
+
+  struct Location {
+    uint32_t chunk;
+    uint32_t begin;
+    uint32_t end;
+  };
+
+  std::vector<Chunk> chunks;
+  std::vector<Location> index;
+};
+
+template <typename Callback>
+void CommentArena::Page(size_t offset, size_t limit, Callback callback) const {
+  offset = std::min(offset, Size());
+  const size_t last = offset + std::min(limit, Size() - offset);
+  const Location* run = nullptr;
+  uint32_t run_end = 0;
+  for (size_t i = offset; i < last; ++i) {
+    const Location& location = index[i];
+    if (run && location.chunk == run->chunk && location.begin == run_end) {
+      run_end = location.end;
+      continue;
+    }
+    if (run) {
+      callback(std::string_view(chunks[run->chunk].data.get() + run->begin, run_end - run->begin));
+    }
+    run = &location;
+    run_end = location.end;
+  }
+  if (run) {
+    callback(std::string_view(chunks[run->chunk].data.get() + run->begin, run_end - run->begin));
+  }
+}
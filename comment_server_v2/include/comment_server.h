@@ -0,0 +1,169 @@
+#pragma once
+
+#include "comment_arena.h"
+#include "http.h"
+#include "metrics.h"
+#include "router.h"
+#include "wal.h"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+std::pair<size_t, std::string_view> ParseIdAndContent(std::string_view body);
+
+struct LastCommentInfo {
+  size_t user_id, consecutive_count;
+};
+
+struct JournalOptions {
+  // Журнал хранится в path + ".journal", снимок -- в path + ".snapshot"
+  std::string path;
+  WalOptions wal;
+  // После стольких записей в журнал фоновый поток сохраняет состояние
+  // в снимок и обрезает журнал, чтобы время восстановления оставалось
+  // ограниченным
+  size_t checkpoint_every = 100'000;
+};
+
+// ServeRequest можно вызывать из нескольких потоков. Состояние пользователей
+// разложено по шардам по user_id, у каждого шарда свой мьютекс; общий
+// для всех счётчик подряд идущих комментариев защищён отдельной блокировкой.
+//
+// С журналом новые пользователи, комментарии и баны пишутся в него под
+// мьютексом шарда, а ответ возвращается только после того, как группа
+// с записями этого запроса сброшена на диск. Запрос, который прочитал
+// шард, ждёт и последней записи об этом шарде: иначе он мог бы показать
+// изменение, которое пропадёт при сбое. Остальные запросы сброса не ждут.
+class CommentServer {
+private:
+  static const size_t kShardCount = 64;
+
+  struct UserState {
+    CommentArena comments;
+    bool banned = false;
+  };
+
+  struct Shard {
+    std::mutex m;
+    // Пользователь с id лежит в шарде id % kShardCount под номером id / kShardCount
+    std::vector<UserState> users;
+    // Номер последней записи журнала об изменении в шарде
+    uint64_t journaled_lsn = 0;
+  };
+
+  std::atomic<size_t> user_count = 0;
+  std::array<Shard, kShardCount> shards;
+
+  std::mutex last_comment_mutex;
+  std::optional<LastCommentInfo> last_comment;
+
+  const std::string captcha = "What's the answer for The Ultimate Question of Life, "
+                   "the Universe, and Everything?";
+
+  Shard& ShardFor(size_t user_id) {
+    return shards[user_id % kShardCount];
+  }
+  // Вызывать под мьютексом шарда; nullptr для несуществующего пользователя
+  UserState* FindUser(Shard& shard, size_t user_id);
+
+  using Handler = HttpResponse (CommentServer::*)(const HttpRequestView&);
+  static constexpr size_t kRouteCount = 6;
+  static const RouteTable<Handler, kRouteCount>& Routes();
+
+  RequestMetrics metrics;
+
+  HttpResponse AddUser(const HttpRequestView& req);
+  HttpResponse AddComment(const HttpRequestView& req);
+  HttpResponse CheckCaptcha(const HttpRequestView& req);
+  HttpResponse UserComments(const HttpRequestView& req);
+  HttpResponse Captcha(const HttpRequestView& req);
+  HttpResponse Metrics(const HttpRequestView& req);
+
+  // Различает серверы в списке ещё не сброшенных записей потока
+  const uint64_t id;
+  std::optional<JournalOptions> journal_options;
+  std::unique_ptr<WriteAheadLog> journal;
+  std::atomic<size_t> journal_records = 0;
+
+  // Снимки делаются по одному
+  std::mutex checkpoint_mutex;
+  // Фоновый поток снимков и запросы к нему
+  std::mutex checkpointer_mutex;
+  std::condition_variable checkpointer_cv;
+  bool checkpoint_requested = false;
+  bool stopping = false;
+  std::string checkpoint_error;
+  std::thread checkpointer;
+
+  // Пользователь в снимке. Комментарии указывают прямо в арены, которые
+  // только дописываются, поэтому их можно читать без блокировки шарда
+  struct UserImage {
+    bool banned = false;
+    std::vector<std::string_view> comments;
+  };
+
+  // Вызывать под мьютексом шарда, к которому относится запись. Номер записи
+  // запоминается за текущим потоком, и WaitDurable ждёт именно его
+  void Journal(Shard& shard, const std::string& entry);
+  // Вызывать под мьютексом шарда перед чтением из него: WaitDurable
+  // дождётся и последней записи об этом шарде
+  void DependOn(const Shard& shard);
+  void RememberUnconfirmedLsn(uint64_t lsn);
+  // Номер последней записи потока в журнал, которую он ещё не дождался, или 0
+  uint64_t TakeUnconfirmedLsn();
+  // Применяет запись журнала; повторное применение ничего не меняет
+  void Apply(std::string_view entry);
+  void LoadSnapshot(const std::string& path);
+  std::vector<UserImage> CaptureUsers();
+  static void SaveSnapshot(const std::string& path, const std::vector<UserImage>& users);
+  // Делает снимок, если с прошлого в журнал попало хотя бы min_records записей
+  void RunCheckpoint(size_t min_records);
+  void RequestCheckpoint();
+  void CheckpointLoop();
+
+public:
+  CommentServer();
+  // Восстанавливает состояние из снимка и журнала и дальше пишет в журнал
+  explicit CommentServer(JournalOptions options);
+  CommentServer(const CommentServer&) = delete;
+  CommentServer& operator=(const CommentServer&) = delete;
+  ~CommentServer();
+
+  // Наибольшее число комментариев в ответе /user_comments; дальше -- через offset
+  static constexpr size_t kMaxCommentsPage = 1000;
+
+  // Тело ответа /user_comments ссылается на память сервера: ответ нужно
+  // отправить, пока сервер жив
+  HttpResponse ServeRequest(const HttpRequestView& req);
+
+  // Для фронтендов, которые отправляют ответы пачками: ответ, полученный
+  // отсюда, можно отдавать клиенту только после следующего WaitDurable
+  // в том же потоке
+  HttpResponse ServeRequestDeferred(const HttpRequestView& req);
+  // Ждёт, пока окажутся на диске изменения, сделанные этим потоком
+  // в ServeRequestDeferred
+  void WaitDurable();
+
+  // Сохраняет снимок и выбрасывает из журнала вошедшие в него записи.
+  // Шарды блокируются по одному и только на время копирования ссылок
+  // на комментарии, файл пишется без блокировок
+  void Checkpoint();
+  // Почему не удался последний фоновый снимок; пусто, если удался. Запросы
+  // об ошибке не узнают: журнал остаётся целым, снимок повторится позже
+  std::string CheckpointError();
+
+  uint64_t JournalSyncCount() const {
+    return journal ? journal->SyncCount() : 0;
+  }
+};
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/uio.h>
+
+struct HttpRequest {
+  std::string method, path, body;
+  std::map<std::string, std::string> get_params;
+};
+
+// Невладеющее представление запроса. Строки указывают в буфер соединения
+// (или в HttpRequest, из которого представление построено) и действительны,
+// пока жив этот буфер.
+struct HttpRequestView {
+  std::string_view method, path, query, body;
+  bool keep_alive = true;
+
+  HttpRequestView() = default;
+  HttpRequestView(const HttpRequest& req);
+
+  // Значение параметра из строки запроса (или из HttpRequest::get_params)
+  std::optional<std::string_view> GetParam(std::string_view name) const;
+
+private:
+  const std::map<std::string, std::string>* get_params = nullptr;
+};
+
+// Разбирает HTTP/1.x запросы прямо в буфере соединения, не копируя данные.
+// Буфер может содержать неполный запрос или несколько запросов подряд.
+class HttpRequestParser {
+public:
+  enum class Status {
+    Complete,
+    Incomplete,
+    Error,
+  };
+
+  // Разбирает запрос в начале buffer. При Complete заполняет request,
+  // а Consumed() возвращает длину запроса в байтах. При Incomplete буфер
+  // нужно дополнить и вызвать Parse снова с тем же началом.
+  Status Parse(std::string_view buffer, HttpRequestView& request);
+
+  size_t Consumed() const {
+    return consumed;
+  }
+
+private:
+  // Позиция, до которой конец заголовков уже искали
+  size_t scanned = 0;
+  size_t consumed = 0;
+};
+
+enum class HttpCode {
+  Ok = 200,
+  NotFound = 404,
+  Found = 302,
+  BadRequest = 400,
+  InternalServerError = 500,
+};
+
+std::ostream& operator<< (std::ostream& output, const HttpCode& code);
+
+struct HttpHeader {
+  std::string name, value;
+};
+
+std::ostream& operator<<(std::ostream& output, const HttpHeader& h);
+bool operator==(const HttpHeader& lhs, const HttpHeader& rhs);
+
+class HttpResponse {
+public:
+  explicit HttpResponse(HttpCode code) : code(code) {};
+
+  HttpResponse& AddHeader(std::string name, std::string value);
+  HttpResponse& SetContent(std::string a_content);
+  // Дописывает к телу кусок чужой памяти без копирования: она должна
+  // оставаться неизменной, пока ответ не отправлен
+  HttpResponse& AddContentView(std::string_view part);
+  HttpResponse& SetCode(HttpCode a_code);
+
+  HttpCode Code() const {
+    return code;
+  }
+  const std::vector<HttpHeader>& Headers() const {
+    return headers;
+  }
+  const std::string& Content() const {
+    return content;
+  }
+  // Тело ответа -- Content(), за которым идут ContentViews()
+  const std::vector<std::string_view>& ContentViews() const {
+    return content_views;
+  }
+  size_t ContentSize() const {
+    return content_size;
+  }
+
+  friend std::ostream& operator<< (std::ostream& output, const HttpResponse& resp);
+
+private:
+  HttpCode code;
+  std::vector<HttpHeader> headers;
+  std::string content;
+  std::vector<std::string_view> content_views;
+  size_t content_size = 0;
+};
+
+// Готовая строка статуса вместе с версией протокола и переводом строки
+std::string_view StatusLine(HttpCode code);
+
+// Сериализует ответ для отправки через writev. Строка статуса и заголовки
+// пишутся в буфер, который переиспользуется между ответами, а тело не
+// копируется: последний фрагмент указывает прямо в HttpResponse. В отличие
+// от operator<<, строки оканчиваются CRLF и Content-Length пишется всегда,
+// как того требует HTTP/1.1 с постоянными соединениями.
+class HttpResponseSerializer {
+public:
+  // Фрагменты действительны до следующего вызова Serialize, пока жив resp
+  const std::vector<iovec>& Serialize(const HttpResponse& resp);
+
+  size_t TotalSize() const {
+    return total_size;
+  }
+
+private:
+  std::string head;
+  std::vector<iovec> fragments;
+  size_t total_size = 0;
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "http.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct ClientResponse {
+  int code = 0;
+  // Без Content-Length
+  std::vector<HttpHeader> headers;
+  std::string content;
+};
+
+// Текст HTTP/1.1 запроса с телом и Content-Length
+std::string MakeRequest(std::string_view method, std::string_view target, std::string_view body = {});
+
+// Блокирующий клиент для проверки и нагрузки сервера через 127.0.0.1
+class LoopbackClient {
+public:
+  explicit LoopbackClient(uint16_t port);
+  LoopbackClient(const LoopbackClient&) = delete;
+  LoopbackClient& operator=(const LoopbackClient&) = delete;
+  ~LoopbackClient();
+
+  void Send(std::string_view data);
+  // Возвращает false, если сервер закрыл соединение
+  bool Receive(ClientResponse& response);
+
+private:
+  int fd;
+  std::string buffer;
+  size_t buffer_start = 0;
+
+  bool ReadMore();
+};
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "http.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Часы для замеров задержек. Чтение steady_clock стоит десятки наносекунд,
+// поэтому на x86 читаем счётчик тактов, а в наносекунды переводим только в отчёте
+struct CycleClock {
+  static uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+  }
+};
+
+// Лог-линейные корзины задержек (в тактах CycleClock): каждая степень двойки
+// делится на 8 равных частей, так что ошибка оценки не больше 12.5%
+struct LatencyBuckets {
+  static constexpr size_t kSubBits = 3;
+  static constexpr size_t kSubBuckets = 1 << kSubBits;
+  // Всё, что дольше 2^36 тактов (десятки секунд), попадает в последнюю корзину
+  static constexpr size_t kMaxBits = 36;
+  static constexpr size_t kCount = (kMaxBits - kSubBits + 1) * kSubBuckets;
+
+  static size_t Index(uint64_t ticks) {
+    if (ticks < kSubBuckets) {
+      return ticks;
+    }
+    const size_t msb = 63 - __builtin_clzll(ticks);
+    const size_t shift = msb - kSubBits;
+    const size_t index = (shift + 1) * kSubBuckets + ((ticks >> shift) & (kSubBuckets - 1));
+    return index < kCount ? index : kCount - 1;
+  }
+  // Наименьшее значение, попадающее в корзину
+  static uint64_t LowerBound(size_t index);
+};
+
+// Счётчики запросов по маршрутам и кодам ответа и гистограммы задержек.
+// Каждый поток пишет в свой набор счётчиков без блокировок и атомарных
+// read-modify-write; Report складывает наборы всех потоков. Track
+// встраивается в вызывающий код. Запросы и коды считаются все, а время
+// замеряется у каждого kSampleEvery-го запроса маршрута: чтение CycleClock
+// (rdtsc под виртуализацией -- около 20 нс) дороже всего остального учёта.
+class RequestMetrics {
+public:
+  // Маршруты нумеруются с 0; номер route_names.size() -- запросы мимо маршрутов
+  explicit RequestMetrics(std::vector<std::string> route_names);
+
+  // Middleware: вызывает handler, считает запрос и код ответа, а у части
+  // запросов ещё и записывает время работы handler в гистограмму
+  template <typename Handler>
+  HttpResponse Track(size_t route, Handler&& handler) {
+    ThreadCounters& counters = Local();
+    route = route < route_names.size() ? route : route_names.size();
+    Counter* row = &counters.routes[route * kRouteStride];
+    uint32_t& until_sample = counters.until_sample[route];
+    if (until_sample > 0) {
+      --until_sample;
+      HttpResponse response = handler();
+      Count(counters, row, response.Code());
+      return response;
+    }
+    until_sample = kSampleEvery - 1;
+    const uint64_t start = CycleClock::Now();
+    HttpResponse response = handler();
+    Increment(row[1 + LatencyBuckets::Index(CycleClock::Now() - start)]);
+    Count(counters, row, response.Code());
+    return response;
+  }
+
+  // Текстовый отчёт в формате Prometheus
+  std::string Report() const;
+
+private:
+  static constexpr std::array<HttpCode, 4> kCodes = {
+    HttpCode::Ok, HttpCode::Found, HttpCode::BadRequest, HttpCode::NotFound,
+  };
+
+  // Замеряется первый запрос маршрута в потоке и затем каждый kSampleEvery-й
+  static constexpr uint32_t kSampleEvery = 8;
+
+  using Counter = std::atomic<uint64_t>;
+
+  struct alignas(64) ThreadCounters {
+    // Для каждого маршрута: число запросов, затем корзины задержек
+    std::vector<Counter> routes;
+    // Последний счётчик -- коды не из kCodes, в отчёт он не попадает
+    std::array<Counter, kCodes.size() + 1> codes = {};
+    // Сколько запросов маршрута пропустить до следующего замера; только для
+    // потока-владельца
+    std::vector<uint32_t> until_sample;
+
+    explicit ThreadCounters(size_t route_count);
+  };
+
+  // Набор счётчиков, которым поток пользовался последним. Ключ -- id, а не
+  // адрес, чтобы не спутать с уже удалённым объектом по тому же адресу.
+  // Слот инициализируется нулями, а id выдаются начиная с 1.
+  struct LocalSlot {
+    uint64_t id;
+    ThreadCounters* counters;
+  };
+  inline static thread_local LocalSlot local_slot;
+
+  static constexpr size_t kRouteStride = 1 + LatencyBuckets::kCount;
+
+  const uint64_t id;
+  const std::vector<std::string> route_names;
+  // Точка отсчёта, по которой в отчёте вычисляется длина такта
+  const uint64_t created_ticks;
+  const std::chrono::steady_clock::time_point created_at;
+
+  mutable std::mutex m;
+  std::unordered_map<std::thread::id, std::unique_ptr<ThreadCounters>> threads;
+
+  ThreadCounters& Local() {
+    if (local_slot.id == id) {
+      return *local_slot.counters;
+    }
+    return AttachThread();
+  }
+  ThreadCounters& AttachThread();
+
+  static size_t CodeIndex(HttpCode code) {
+    switch (code) {
+      case HttpCode::Ok:
+        return 0;
+      case HttpCode::Found:
+        return 1;
+      case HttpCode::BadRequest:
+        return 2;
+      case HttpCode::NotFound:
+        return 3;
+      case HttpCode::InternalServerError:
+        break;
+    }
+    return kCodes.size();
+  }
+
+  static void Count(ThreadCounters& counters, Counter* row, HttpCode code) {
+    Increment(row[0]);
+    Increment(counters.codes[CodeIndex(code)]);
+  }
+
+  // Поток пишет в счётчики единолично, так что хватает обычных load/store
+  static void Increment(Counter& counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+};
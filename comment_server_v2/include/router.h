@@ -0,0 +1,128 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+
+template <typename Handler>
+struct Route {
+  std::string_view method;
+  std::string_view path;
+  Handler handler;
+};
+
+// Таблица маршрутов с совершенным хешированием, которая строится при компиляции.
+// Соль хеша подбирается так, чтобы все пары (метод, путь) попали в разные
+// ячейки, поэтому поиск -- это один проход хеша по строке и одно сравнение.
+template <typename Handler, size_t N>
+class RouteTable {
+public:
+  static_assert(N > 0 && N < 255, "RouteTable holds 1..254 routes");
+
+  constexpr explicit RouteTable(const std::array<Route<Handler>, N>& routes)
+    : routes(routes)
+  {
+    for (size_t i = 0; i < N; ++i) {
+      for (size_t j = 0; j < i; ++j) {
+        if (routes[i].method == routes[j].method && routes[i].path == routes[j].path) {
+          throw std::logic_error("RouteTable: duplicate route");
+        }
+      }
+    }
+    for (uint64_t candidate = 1; candidate < kMaxSeed; ++candidate) {
+      if (TryFill(candidate)) {
+        seed = candidate;
+        return;
+      }
+    }
+    // Вычисление в constexpr-контексте превращается в ошибку компиляции
+    throw std::logic_error("RouteTable: no perfect seed");
+  }
+
+  // Номер маршрута или Size(), если такого нет
+  size_t FindIndex(std::string_view method, std::string_view path) const {
+    const uint8_t slot = slots[Hash(seed, method, path) & (kSlotCount - 1)];
+    if (slot == 0) {
+      return N;
+    }
+    const Route<Handler>& route = routes[slot - 1];
+    if (route.path != path || route.method != method) {
+      return N;
+    }
+    return slot - 1;
+  }
+
+  const Handler* Find(std::string_view method, std::string_view path) const {
+    const size_t index = FindIndex(method, path);
+    return index < N ? &routes[index].handler : nullptr;
+  }
+
+  const Route<Handler>& operator[](size_t index) const {
+    return routes[index];
+  }
+
+  static constexpr size_t Size() {
+    return N;
+  }
+
+  static constexpr size_t SlotCount() {
+    return kSlotCount;
+  }
+
+private:
+  static constexpr size_t BitCeil(size_t value) {
+    size_t result = 1;
+    while (result < value) {
+      result *= 2;
+    }
+    return result;
+  }
+
+  // Для случайной соли вероятность обойтись без коллизий ~exp(-N^2 / 2M),
+  // так что при M ~ N^2 / 2 подходящая соль находится за пару попыток
+  static constexpr size_t kSlotCount = BitCeil(N * N / 2 > 2 * N ? N * N / 2 : 2 * N);
+  static constexpr uint64_t kMaxSeed = 1 << 10;
+
+  static constexpr uint64_t Hash(uint64_t seed, std::string_view method, std::string_view path) {
+    // FNV-1a с солью в качестве начального значения
+    uint64_t h = 14695981039346656037ull ^ (seed * 0x9E3779B97F4A7C15ull);
+    for (char c : method) {
+      h = (h ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    }
+    h = (h ^ ' ') * 1099511628211ull;
+    for (char c : path) {
+      h = (h ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    }
+    return h ^ (h >> 29);
+  }
+
+  constexpr bool TryFill(uint64_t candidate) {
+    for (auto& slot : slots) {
+      slot = 0;
+    }
+    for (size_t i = 0; i < N; ++i) {
+      uint8_t& slot = slots[Hash(candidate, routes[i].method, routes[i].path) & (kSlotCount - 1)];
+      if (slot != 0) {
+        return false;
+      }
+      slot = static_cast<uint8_t>(i + 1);
+    }
+    return true;
+  }
+
+  std::array<Route<Handler>, N> routes;
+  // Номер маршрута плюс один, 0 -- пустая ячейка
+  std::array<uint8_t, kSlotCount> slots = {};
+  uint64_t seed = 0;
+};
+
+template <typename Handler, size_t N>
+constexpr RouteTable<Handler, N> MakeRouteTable(const Route<Handler> (&routes)[N]) {
+  std::array<Route<Handler>, N> result = {};
+  for (size_t i = 0; i < N; ++i) {
+    result[i] = routes[i];
+  }
+  return RouteTable<Handler, N>(result);
+}
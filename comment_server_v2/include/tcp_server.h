@@ -0,0 +1,59 @@
+#pragma once
+
+#include "http.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct TcpServerOptions {
+  std::string address = "127.0.0.1";
+  // 0 -- выбрать свободный порт; узнать его можно через Port()
+  uint16_t port = 0;
+  // При нескольких потоках обработчик вызывается конкурентно
+  size_t threads = 1;
+  // Вызывается после обработки всех пришедших запросов соединения перед
+  // отправкой ответов на них, например чтобы дождаться сброса журнала
+  std::function<void()> before_write;
+};
+
+// HTTP/1.1 сервер на epoll в режиме edge-triggered. Соединения постоянные,
+// запросы можно слать конвейером: ответы уходят в порядке запросов. У каждого
+// соединения свой буфер чтения и очередь ответов, которые отправляются
+// через sendmsg без копирования тел.
+//
+// Каждый поток крутит свой цикл событий со своим слушающим сокетом на общем
+// порту (SO_REUSEPORT), так что соединение целиком живёт в одном потоке.
+//
+// Исключение из обработчика или before_write превращается в ответ 500,
+// после которого соединение закрывается. Пока очередь ответов соединения
+// слишком велика, новые запросы из него не читаются.
+class TcpServer {
+public:
+  using Handler = std::function<HttpResponse(const HttpRequestView&)>;
+
+  TcpServer(Handler handler, TcpServerOptions options = {});
+  TcpServer(const TcpServer&) = delete;
+  TcpServer& operator=(const TcpServer&) = delete;
+  ~TcpServer();
+
+  uint16_t Port() const {
+    return port;
+  }
+
+  // Обслуживает соединения, пока не вызван Stop. Один из потоков -- текущий
+  void Run();
+  // Можно вызывать из любого потока
+  void Stop();
+
+private:
+  class EventLoop;
+
+  Handler handler;
+  std::function<void()> before_write;
+  int stop_fd = -1;
+  uint16_t port = 0;
+  std::vector<std::unique_ptr<EventLoop>> loops;
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+struct WalOptions {
+  // Сколько лидер группы ждёт присоединения других писателей перед fdatasync.
+  // Ноль означает, что группу образуют только те, кто пришёл во время
+  // предыдущего fdatasync.
+  std::chrono::microseconds commit_delay{0};
+  // Группа сбрасывается, не дожидаясь commit_delay, как только накопилось
+  // столько байт
+  size_t max_batch_bytes = 1 << 20;
+};
+
+// Место в журнале сразу после записи с номером lsn; offset отсчитывается
+// от начала журнала за всё время его жизни, а не от начала файла
+struct LogPosition {
+  uint64_t lsn = 0;
+  uint64_t offset = 0;
+};
+
+// Сбрасывает на диск каталог файла, чтобы пережило сбой его создание
+// или переименование
+void SyncDirectory(const std::string& file_path);
+
+// Журнал упреждающей записи с групповой фиксацией. Каждая запись хранится
+// как [размер][crc32][данные]; повреждённый хвост при Replay отрезается.
+class WriteAheadLog {
+public:
+  explicit WriteAheadLog(const std::string& path, WalOptions options = {});
+  WriteAheadLog(const WriteAheadLog&) = delete;
+  WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+  ~WriteAheadLog();
+
+  // Вызывает handler для каждой целой записи журнала по порядку
+  void Replay(const std::function<void(std::string_view)>& handler);
+
+  // Добавляет запись в текущую группу и возвращает её номер
+  uint64_t Append(std::string_view payload);
+  // Возвращает управление, когда запись с номером lsn и все предыдущие
+  // оказались на диске
+  void WaitDurable(uint64_t lsn);
+  // Позиция после последней добавленной записи
+  LogPosition AppendedPosition() const;
+
+  // Выбрасывает из файла записи до position включительно; вызывается, когда
+  // они уже попали в снимок. Более поздние записи переписываются в новый
+  // файл, который атомарно заменяет старый. Append при этом не блокируется,
+  // а сброс групп на диск ждёт окончания замены.
+  void DiscardBefore(LogPosition position);
+
+  uint64_t SyncCount() const;
+
+private:
+  const std::string path;
+  const WalOptions options;
+  int fd;
+
+  mutable std::mutex m;
+  std::condition_variable durable_cv;
+  std::condition_variable batch_full_cv;
+  std::string pending;
+  uint64_t appended_lsn = 0;
+  uint64_t durable_lsn = 0;
+  uint64_t appended_offset = 0;
+  uint64_t durable_offset = 0;
+  // Смещение начала файла: столько байт журнала уже выброшено
+  uint64_t file_start = 0;
+  uint64_t sync_count = 0;
+  bool flushing = false;
+  bool failed = false;
+
+  void WriteAndSync(int target, const std::string& batch);
+};
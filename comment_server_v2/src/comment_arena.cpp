@@ -0,0 +1,29 @@
+#include "comment_arena.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+void CommentArena::Add(string_view comment) {
+  const size_t size = comment.size() + 1;
+  if (chunks.empty() || chunks.back().capacity - chunks.back().size < size) {
+    size_t capacity = chunks.empty()
+        ? kFirstChunkSize
+        : min(chunks.back().capacity * 2, kMaxChunkSize);
+    // Длинный комментарий получает кусок под себя: комментарий не разрывается
+    capacity = max(capacity, size);
+    chunks.push_back({make_unique<char[]>(capacity), capacity, 0});
+  }
+
+  Chunk& chunk = chunks.back();
+  char* dest = chunk.data.get() + chunk.size;
+  memcpy(dest, comment.data(), comment.size());
+  dest[comment.size()] = '\n';
+  index.push_back({
+    static_cast<uint32_t>(chunks.size() - 1),
+    static_cast<uint32_t>(chunk.size),
+    static_cast<uint32_t>(chunk.size + size)
+  });
+  chunk.size += size;
+}
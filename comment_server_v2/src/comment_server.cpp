@@ -0,0 +1,587 @@
+#include "comment_server.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+template<typename T>
+T FromString(string_view s) {
+  T x = 0;
+  from_chars(s.data(), s.data() + s.size(), x);
+  return x;
+}
+
+// Целое без знака на всю строку; nullopt для пустой строки, мусора
+// и переполнения
+optional<size_t> ParseSize(string_view s) {
+  size_t x = 0;
+  const auto [end, error] = from_chars(s.data(), s.data() + s.size(), x);
+  if (error != errc() || end != s.data() + s.size()) {
+    return nullopt;
+  }
+  return x;
+}
+
+const char kAddUserOp = 'U';
+const char kCommentOp = 'C';
+const char kBanOp = 'B';
+const char kUnbanOp = 'b';
+
+void WriteUint64(string& out, uint64_t value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteString(string& out, string_view s) {
+  WriteUint64(out, s.size());
+  out += s;
+}
+
+class EntryReader {
+public:
+  explicit EntryReader(string_view data) : data(data) {
+  }
+
+  uint64_t ReadUint64() {
+    uint64_t value;
+    memcpy(&value, Take(sizeof(value)).data(), sizeof(value));
+    return value;
+  }
+
+  string_view ReadString() {
+    return Take(ReadUint64());
+  }
+
+  char ReadOp() {
+    return Take(1)[0];
+  }
+
+  bool Empty() const {
+    return data.empty();
+  }
+
+private:
+  string_view data;
+
+  string_view Take(size_t size) {
+    if (size > data.size()) {
+      throw runtime_error("Malformed journal entry");
+    }
+    string_view result = data.substr(0, size);
+    data.remove_prefix(size);
+    return result;
+  }
+};
+
+string EncodeAddUser(size_t user_id) {
+  string entry(1, kAddUserOp);
+  WriteUint64(entry, user_id);
+  return entry;
+}
+
+// Номер комментария делает запись идемпотентной: если журнал не успели
+// обрезать после снимка, уже сохранённые комментарии не задвоятся
+string EncodeComment(size_t user_id, size_t position, string_view comment) {
+  string entry(1, kCommentOp);
+  WriteUint64(entry, user_id);
+  WriteUint64(entry, position);
+  WriteString(entry, comment);
+  return entry;
+}
+
+string EncodeBan(char op, size_t user_id) {
+  string entry(1, op);
+  WriteUint64(entry, user_id);
+  return entry;
+}
+
+const uint64_t kSnapshotMagic = 0x31504E5343;  // "CSNP1"
+
+// Пишет файл кусками, сбрасывая буфер по мере заполнения
+class FileWriter {
+public:
+  explicit FileWriter(const string& path)
+    : path(path)
+    , fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))
+  {
+    if (fd < 0) {
+      throw runtime_error("Cannot create " + path + ": " + strerror(errno));
+    }
+  }
+
+  ~FileWriter() {
+    close(fd);
+  }
+
+  string& Buffer() {
+    if (buffer.size() >= kFlushSize) {
+      Flush();
+    }
+    return buffer;
+  }
+
+  // Дописывает остаток буфера и fsync-ает файл
+  void Sync() {
+    Flush();
+    if (fsync(fd) != 0) {
+      throw runtime_error("Cannot sync " + path + ": " + strerror(errno));
+    }
+  }
+
+private:
+  static const size_t kFlushSize = 1 << 20;
+
+  const string path;
+  const int fd;
+  string buffer;
+
+  void Flush() {
+    const char* data = buffer.data();
+    size_t left = buffer.size();
+    while (left > 0) {
+      ssize_t written = write(fd, data, left);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw runtime_error("Cannot write " + path + ": " + strerror(errno));
+      }
+      data += written;
+      left -= written;
+    }
+    buffer.clear();
+  }
+};
+
+atomic<uint64_t> next_server_id = 1;
+
+// Номера последних записей, которые поток добавил в журналы серверов и ещё
+// не дождался; обычно здесь не больше одного элемента
+struct UnconfirmedLsn {
+  uint64_t server;
+  uint64_t lsn;
+};
+thread_local vector<UnconfirmedLsn> unconfirmed_lsns;
+
+template <typename Table>
+vector<string> RouteNames(const Table& routes) {
+  vector<string> names;
+  for (size_t i = 0; i < routes.Size(); ++i) {
+    names.push_back(string(routes[i].method) + " " + string(routes[i].path));
+  }
+  return names;
+}
+
+}
+
+pair<size_t, string_view> ParseIdAndContent(string_view body) {
+  size_t pos = body.find(' ');
+  if (pos == string_view::npos) {
+    return {FromString<size_t>(body), {}};
+  }
+  return {FromString<size_t>(body.substr(0, pos)), body.substr(pos + 1)};
+}
+
+CommentServer::UserState* CommentServer::FindUser(Shard& shard, size_t user_id) {
+  const size_t index = user_id / kShardCount;
+  return index < shard.users.size() ? &shard.users[index] : nullptr;
+}
+
+CommentServer::CommentServer()
+  : metrics(RouteNames(Routes()))
+  , id(next_server_id++)
+{
+}
+
+const RouteTable<CommentServer::Handler, CommentServer::kRouteCount>& CommentServer::Routes() {
+  static constexpr auto routes = MakeRouteTable<Handler>({
+    {"POST", "/add_user", &CommentServer::AddUser},
+    {"POST", "/add_comment", &CommentServer::AddComment},
+    {"POST", "/checkcaptcha", &CommentServer::CheckCaptcha},
+    {"GET", "/user_comments", &CommentServer::UserComments},
+    {"GET", "/captcha", &CommentServer::Captcha},
+    {"GET", "/metrics", &CommentServer::Metrics},
+  });
+  return routes;
+}
+
+CommentServer::CommentServer(JournalOptions options)
+  : CommentServer()
+{
+  const string snapshot_path = options.path + ".snapshot";
+  if (access(snapshot_path.c_str(), F_OK) == 0) {
+    LoadSnapshot(snapshot_path);
+  }
+  journal = make_unique<WriteAheadLog>(options.path + ".journal", options.wal);
+  journal->Replay([this](string_view entry) {
+    Apply(entry);
+    ++journal_records;
+  });
+  journal_options = move(options);
+  checkpointer = thread([this] { CheckpointLoop(); });
+}
+
+CommentServer::~CommentServer() {
+  if (checkpointer.joinable()) {
+    {
+      lock_guard<mutex> guard(checkpointer_mutex);
+      stopping = true;
+    }
+    checkpointer_cv.notify_one();
+    checkpointer.join();
+  }
+}
+
+HttpResponse CommentServer::ServeRequest(const HttpRequestView& req) {
+  HttpResponse resp = ServeRequestDeferred(req);
+  WaitDurable();
+  return resp;
+}
+
+void CommentServer::WaitDurable() {
+  if (!journal) {
+    return;
+  }
+  if (const uint64_t lsn = TakeUnconfirmedLsn()) {
+    journal->WaitDurable(lsn);
+  }
+  if (journal_records.load() >= journal_options->checkpoint_every) {
+    RequestCheckpoint();
+  }
+}
+
+void CommentServer::Journal(Shard& shard, const string& entry) {
+  const uint64_t lsn = journal->Append(entry);
+  ++journal_records;
+  shard.journaled_lsn = lsn;
+  RememberUnconfirmedLsn(lsn);
+}
+
+void CommentServer::DependOn(const Shard& shard) {
+  if (journal && shard.journaled_lsn > 0) {
+    RememberUnconfirmedLsn(shard.journaled_lsn);
+  }
+}
+
+void CommentServer::RememberUnconfirmedLsn(uint64_t lsn) {
+  // Группы сбрасываются по порядку, так что достаточно помнить наибольший
+  for (UnconfirmedLsn& unconfirmed : unconfirmed_lsns) {
+    if (unconfirmed.server == id) {
+      unconfirmed.lsn = max(unconfirmed.lsn, lsn);
+      return;
+    }
+  }
+  unconfirmed_lsns.push_back({id, lsn});
+}
+
+uint64_t CommentServer::TakeUnconfirmedLsn() {
+  for (UnconfirmedLsn& unconfirmed : unconfirmed_lsns) {
+    if (unconfirmed.server == id) {
+      const uint64_t lsn = unconfirmed.lsn;
+      unconfirmed = unconfirmed_lsns.back();
+      unconfirmed_lsns.pop_back();
+      return lsn;
+    }
+  }
+  return 0;
+}
+
+HttpResponse CommentServer::ServeRequestDeferred(const HttpRequestView& req) {
+  const size_t route = Routes().FindIndex(req.method, req.path);
+  return metrics.Track(route, [&] {
+    if (route == kRouteCount) {
+      return HttpResponse(HttpCode::NotFound);
+    }
+    return (this->*Routes()[route].handler)(req);
+  });
+}
+
+HttpResponse CommentServer::AddUser(const HttpRequestView&) {
+  const size_t user_id = user_count++;
+  {
+    Shard& shard = ShardFor(user_id);
+    lock_guard<mutex> guard(shard.m);
+    // Соседние id могли выдать другим потокам, и они ещё не успели их добавить
+    const size_t index = user_id / kShardCount;
+    if (shard.users.size() <= index) {
+      shard.users.resize(index + 1);
+    }
+    if (journal) {
+      Journal(shard, EncodeAddUser(user_id));
+    }
+  }
+  HttpResponse resp(HttpCode::Ok);
+  resp.SetContent(to_string(user_id));
+  return resp;
+}
+
+HttpResponse CommentServer::AddComment(const HttpRequestView& req) {
+  auto [user_id, comment] = ParseIdAndContent(req.body);
+
+  bool ban = false;
+  {
+    lock_guard<mutex> guard(last_comment_mutex);
+    if (!last_comment || last_comment->user_id != user_id) {
+      last_comment = LastCommentInfo {user_id, 1};
+    } else if (++last_comment->consecutive_count > 3) {
+      ban = true;
+    }
+  }
+
+  Shard& shard = ShardFor(user_id);
+  lock_guard<mutex> guard(shard.m);
+  DependOn(shard);
+  UserState* user = FindUser(shard, user_id);
+  if (!user) {
+    return HttpResponse(HttpCode::NotFound);
+  }
+  if (ban && !user->banned) {
+    user->banned = true;
+    if (journal) {
+      Journal(shard, EncodeBan(kBanOp, user_id));
+    }
+  }
+  if (!user->banned) {
+    if (journal) {
+      Journal(shard, EncodeComment(user_id, user->comments.Size(), comment));
+    }
+    user->comments.Add(comment);
+    return HttpResponse(HttpCode::Ok);
+  } else {
+    return HttpResponse(HttpCode::Found).AddHeader("Location", "/captcha");
+  }
+}
+
+HttpResponse CommentServer::CheckCaptcha(const HttpRequestView& req) {
+  if (auto [id, response] = ParseIdAndContent(req.body); response == "42") {
+    {
+      Shard& shard = ShardFor(id);
+      lock_guard<mutex> guard(shard.m);
+      DependOn(shard);
+      UserState* user = FindUser(shard, id);
+      if (user && user->banned) {
+        user->banned = false;
+        if (journal) {
+          Journal(shard, EncodeBan(kUnbanOp, id));
+        }
+      }
+    }
+    lock_guard<mutex> guard(last_comment_mutex);
+    if (last_comment && last_comment->user_id == id) {
+      last_comment.reset();
+    }
+    return HttpResponse(HttpCode::Ok);
+  }
+  else {
+    return HttpResponse(HttpCode::Found).AddHeader("Location", "/captcha");
+  }
+}
+
+HttpResponse CommentServer::UserComments(const HttpRequestView& req) {
+  // Без user_id или с нечисловым параметром отвечаем 400, а не читаем
+  // пользователя 0
+  auto param = [&req](string_view name, optional<size_t> absent) {
+    const optional<string_view> value = req.GetParam(name);
+    return value ? ParseSize(*value) : absent;
+  };
+  const optional<size_t> user_id = param("user_id", nullopt);
+  const optional<size_t> offset = param("offset", 0);
+  const optional<size_t> limit = param("limit", kMaxCommentsPage);
+  if (!user_id || !offset || !limit) {
+    return HttpResponse(HttpCode::BadRequest);
+  }
+
+  HttpResponse resp(HttpCode::Ok);
+  Shard& shard = ShardFor(*user_id);
+  lock_guard<mutex> guard(shard.m);
+  DependOn(shard);
+  const UserState* user = FindUser(shard, *user_id);
+  if (!user) {
+    return HttpResponse(HttpCode::NotFound);
+  }
+  // Тело не копируется: фрагменты указывают прямо в арену пользователя
+  user->comments.Page(*offset, min(*limit, kMaxCommentsPage), [&resp](string_view part) {
+    resp.AddContentView(part);
+  });
+  return resp;
+}
+
+HttpResponse CommentServer::Captcha(const HttpRequestView&) {
+  HttpResponse resp(HttpCode::Ok);
+  resp.SetContent(captcha);
+  return resp;
+}
+
+HttpResponse CommentServer::Metrics(const HttpRequestView&) {
+  HttpResponse resp(HttpCode::Ok);
+  resp.SetContent(metrics.Report());
+  return resp;
+}
+
+void CommentServer::Apply(string_view entry) {
+  EntryReader reader(entry);
+  const char op = reader.ReadOp();
+  const size_t user_id = reader.ReadUint64();
+
+  Shard& shard = ShardFor(user_id);
+  lock_guard<mutex> guard(shard.m);
+  if (op == kAddUserOp) {
+    const size_t index = user_id / kShardCount;
+    if (shard.users.size() <= index) {
+      shard.users.resize(index + 1);
+    }
+    user_count = max(user_count.load(), user_id + 1);
+    return;
+  }
+
+  UserState* user = FindUser(shard, user_id);
+  if (!user) {
+    throw runtime_error("Journal refers to unknown user " + to_string(user_id));
+  }
+  if (op == kCommentOp) {
+    const size_t position = reader.ReadUint64();
+    const string_view comment = reader.ReadString();
+    if (position > user->comments.Size()) {
+      throw runtime_error("Gap in journaled comments of user " + to_string(user_id));
+    }
+    if (position == user->comments.Size()) {
+      user->comments.Add(comment);
+    }
+  } else if (op == kBanOp || op == kUnbanOp) {
+    user->banned = op == kBanOp;
+  } else {
+    throw runtime_error("Unknown journal entry type");
+  }
+}
+
+void CommentServer::Checkpoint() {
+  if (journal) {
+    RunCheckpoint(0);
+  }
+}
+
+// Снимок собирается по одному шарду и может содержать изменения, сделанные
+// после position. Это безопасно: записи журнала идемпотентны, так что
+// проигрывание хвоста после position поверх такого снимка приводит к тому
+// же состоянию. Всё, что не позже position, в снимок попадает точно: запись
+// в журнал и само изменение делаются под одной блокировкой шарда.
+void CommentServer::RunCheckpoint(size_t min_records) {
+  lock_guard<mutex> guard(checkpoint_mutex);
+  const size_t records = journal_records.load();
+  if (records < min_records) {
+    return;
+  }
+  const LogPosition position = journal->AppendedPosition();
+  SaveSnapshot(journal_options->path + ".snapshot", CaptureUsers());
+  journal->DiscardBefore(position);
+  journal_records -= records;
+}
+
+void CommentServer::RequestCheckpoint() {
+  lock_guard<mutex> guard(checkpointer_mutex);
+  checkpoint_requested = true;
+  checkpointer_cv.notify_one();
+}
+
+void CommentServer::CheckpointLoop() {
+  unique_lock<mutex> lock(checkpointer_mutex);
+  while (true) {
+    checkpointer_cv.wait(lock, [this] { return checkpoint_requested || stopping; });
+    // Запрошенный до остановки снимок всё же делаем
+    if (!checkpoint_requested) {
+      return;
+    }
+    checkpoint_requested = false;
+    lock.unlock();
+    string error;
+    try {
+      RunCheckpoint(journal_options->checkpoint_every);
+    } catch (const exception& e) {
+      error = e.what();
+    }
+    lock.lock();
+    checkpoint_error = move(error);
+  }
+}
+
+string CommentServer::CheckpointError() {
+  lock_guard<mutex> guard(checkpointer_mutex);
+  return checkpoint_error;
+}
+
+vector<CommentServer::UserImage> CommentServer::CaptureUsers() {
+  vector<UserImage> users;
+  for (size_t shard_index = 0; shard_index < kShardCount; ++shard_index) {
+    Shard& shard = shards[shard_index];
+    lock_guard<mutex> guard(shard.m);
+    for (size_t index = 0; index < shard.users.size(); ++index) {
+      const size_t user_id = index * kShardCount + shard_index;
+      if (users.size() <= user_id) {
+        users.resize(user_id + 1);
+      }
+      const UserState& user = shard.users[index];
+      users[user_id].banned = user.banned;
+      users[user_id].comments.reserve(user.comments.Size());
+      for (size_t i = 0; i < user.comments.Size(); ++i) {
+        users[user_id].comments.push_back(user.comments.At(i));
+      }
+    }
+  }
+  return users;
+}
+
+void CommentServer::SaveSnapshot(const string& path, const vector<UserImage>& users) {
+  const string tmp_path = path + ".tmp";
+  {
+    FileWriter writer(tmp_path);
+    WriteUint64(writer.Buffer(), kSnapshotMagic);
+    WriteUint64(writer.Buffer(), users.size());
+    for (const UserImage& user : users) {
+      WriteUint64(writer.Buffer(), user.banned);
+      WriteUint64(writer.Buffer(), user.comments.size());
+      for (string_view comment : user.comments) {
+        WriteString(writer.Buffer(), comment);
+      }
+    }
+    writer.Sync();
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    throw runtime_error("Cannot rename snapshot " + path + ": " + strerror(errno));
+  }
+  SyncDirectory(path);
+}
+
+void CommentServer::LoadSnapshot(const string& path) {
+  string content;
+  {
+    ifstream input(path, ios::binary);
+    content.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+  }
+
+  EntryReader reader(content);
+  if (reader.ReadUint64() != kSnapshotMagic) {
+    throw runtime_error("Not a comment server snapshot: " + path);
+  }
+  const size_t users = reader.ReadUint64();
+  for (size_t user_id = 0; user_id < users; ++user_id) {
+    Shard& shard = ShardFor(user_id);
+    shard.users.emplace_back();
+    UserState& user = shard.users.back();
+    user.banned = reader.ReadUint64() != 0;
+    const size_t comments = reader.ReadUint64();
+    for (size_t i = 0; i < comments; ++i) {
+      user.comments.Add(reader.ReadString());
+    }
+  }
+  user_count = users;
+}
@@ -1,13 +1,28 @@
+#include "comment_arena.h"
+#include "comment_server.h"
+#include "http.h"
+#include "loopback_client.h"
+#include "metrics.h"
+#include "router.h"
+#include "tcp_server.h"
 #include "test_runner.h"
 
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <cstdlib>
+#include <new>
 #include <vector>
 #include <string>
 #include <iostream>
 #include <sstream>
 #include <utility>
 #include <map>
-#include <optional>
-#include <unordered_set>
+#include <set>
+
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -20,159 +35,6 @@ pair<string, string> SplitBy(const string& what, const string& by) {
   }
 }
 
-template<typename T>
-T FromString(const string& s) {
-  T x;
-  istringstream is(s);
-  is >> x;
-  return x;
-}
-
-pair<size_t, string> ParseIdAndContent(const string& body) {
-  auto [id_string, content] = SplitBy(body, " ");
-  return {FromString<size_t>(id_string), content};
-}
-
-struct LastCommentInfo {
-  size_t user_id, consecutive_count;
-};
-
-struct HttpRequest {
-  string method, path, body;
-  map<string, string> get_params;
-};
-
-enum class HttpCode {
-  Ok = 200,
-  NotFound = 404,
-  Found = 302,
-};
-
-ostream& operator<< (ostream& output, const HttpCode& code) {
-  switch (code)
-  {
-    case HttpCode::Ok:
-      output << "200 OK";
-      break;
-    case HttpCode::Found:
-      output << "302 Found";
-      break;
-    case HttpCode::NotFound:
-      output << "404 Not found";
-      break;
-  }
-  return output;
-}
-
-struct HttpHeader {
-  string name, value;
-};
-
-ostream& operator<<(ostream& output, const HttpHeader& h) {
-  return output << h.name << ": " << h.value;
-}
-
-bool operator==(const HttpHeader& lhs, const HttpHeader& rhs) {
-  return lhs.name == rhs.name && lhs.value == rhs.value;
-}
-
-class HttpResponse {
-public:
-  explicit HttpResponse(HttpCode code) : code(code) {};
-
-  HttpResponse& AddHeader(string name, string value) {
-    headers.push_back(HttpHeader{move(name), move(value)});
-    return *this;
-  }
-  HttpResponse& SetContent(string a_content) {
-    content = move(a_content);
-    return *this;
-  }
-  HttpResponse& SetCode(HttpCode a_code) {
-    code = a_code;
-    return *this;
-  }
-  friend ostream& operator<< (ostream& output, const HttpResponse& resp) {
-    output << "HTTP/1.1 " << resp.code << '\n';
-    for (const HttpHeader& header : resp.headers) {
-      output << header << '\n';
-    }
-    if (!resp.content.empty()) {
-      output << "Content-Length: " << to_string(resp.content.size()) << '\n';
-    }
-    output << '\n' << resp.content;
-    return output;
-  }
-
-private:
-  HttpCode code;
-  vector<HttpHeader> headers;
-  string content;
-};
-
-class CommentServer {
-private:
-  vector<vector<string>> comments_;
-  std::optional<LastCommentInfo> last_comment;
-  unordered_set<size_t> banned_users;
-  const string captcha = "What's the answer for The Ultimate Question of Life, "
-                   "the Universe, and Everything?";
-
-public:
-  HttpResponse ServeRequest(const HttpRequest& req) {
-    HttpResponse resp(HttpCode::NotFound);
-    if (req.method == "POST") {
-      if (req.path == "/add_user") {
-        comments_.emplace_back();
-        string new_user_id = to_string(comments_.size() - 1);
-        return resp.SetCode(HttpCode::Ok).SetContent(new_user_id);
-      }
-      else if (req.path == "/add_comment") {
-        auto [user_id, comment] = ParseIdAndContent(req.body);
-
-        if (!last_comment || last_comment->user_id != user_id) {
-          last_comment = LastCommentInfo {user_id, 1};
-        } else if (++last_comment->consecutive_count > 3) {
-          banned_users.insert(user_id);
-        }
-
-        if (banned_users.count(user_id) == 0) {
-          comments_[user_id].push_back(string(comment));
-          return resp.SetCode(HttpCode::Ok);
-        } else {
-          return resp.SetCode(HttpCode::Found).AddHeader("Location", "/captcha");
-        }
-      }
-      else if (req.path == "/checkcaptcha") {
-        if (auto [id, response] = ParseIdAndContent(req.body); response == "42") {
-          banned_users.erase(id);
-          if (last_comment && last_comment->user_id == id) {
-            last_comment.reset();
-          }
-          return resp.SetCode(HttpCode::Ok);
-        }
-        else {
-          return resp.SetCode(HttpCode::Found).AddHeader("Location", "/captcha");
-        }
-      }
-    }
-    else if (req.method == "GET") {
-      if (req.path == "/user_comments") {
-        auto user_id = FromString<size_t>(req.get_params.at("user_id"));
-        string response;
-        for (const string& c : comments_[user_id]) {
-          response += c + '\n';
-        }
-        return resp.SetCode(HttpCode::Ok).SetContent(response);
-      } else if (req.path == "/captcha") {
-        return resp.SetCode(HttpCode::Ok).SetContent(captcha);
-      }
-    }
-    return resp; // 404 Not found
-  }
-};
-
-
 struct ParsedResponse {
   int code;
   vector<HttpHeader> headers;
@@ -262,7 +124,800 @@ void TestServer() {
   Test(cs, {"POST", "/add_uesr"}, not_found);
 }
 
+// Считаем выделения памяти, чтобы проверить, что разбор запросов их не делает
+atomic<size_t> allocation_count = 0;
+
+void* operator new(size_t size) {
+  ++allocation_count;
+  if (void* p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+void TestParseRequest() {
+  const string buffer =
+    "POST /add_comment HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "content-length: 9\r\n"
+    "\r\n"
+    "12 Hello!"
+    "GET /user_comments?user_id=12&limit=5 HTTP/1.1\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+  HttpRequestParser parser;
+  HttpRequestView req;
+  ASSERT(parser.Parse(buffer, req) == HttpRequestParser::Status::Complete);
+  ASSERT_EQUAL(req.method, "POST");
+  ASSERT_EQUAL(req.path, "/add_comment");
+  ASSERT_EQUAL(req.body, "12 Hello!");
+  ASSERT(req.keep_alive);
+
+  string_view rest = string_view(buffer).substr(parser.Consumed());
+  ASSERT(parser.Parse(rest, req) == HttpRequestParser::Status::Complete);
+  ASSERT_EQUAL(req.method, "GET");
+  ASSERT_EQUAL(req.path, "/user_comments");
+  ASSERT_EQUAL(req.GetParam("user_id").value_or("none"), "12");
+  ASSERT_EQUAL(req.GetParam("limit").value_or("none"), "5");
+  ASSERT(!req.GetParam("offset"));
+  ASSERT_EQUAL(req.body, "");
+  ASSERT(!req.keep_alive);
+  ASSERT_EQUAL(parser.Consumed(), rest.size());
+}
+
+void TestParseRequestIncrementally() {
+  const string request =
+    "POST /checkcaptcha HTTP/1.1\n"
+    "Content-Length: 4\n"
+    "\n"
+    "1 42";
+  HttpRequestParser parser;
+  HttpRequestView req;
+  for (size_t size = 0; size < request.size(); ++size) {
+    ASSERT(parser.Parse(string_view(request).substr(0, size), req) == HttpRequestParser::Status::Incomplete);
+  }
+  ASSERT(parser.Parse(request, req) == HttpRequestParser::Status::Complete);
+  ASSERT_EQUAL(req.path, "/checkcaptcha");
+  ASSERT_EQUAL(req.body, "1 42");
+  ASSERT_EQUAL(parser.Consumed(), request.size());
+
+  ASSERT(parser.Parse("NONSENSE\r\n\r\n", req) == HttpRequestParser::Status::Error);
+  ASSERT(parser.Parse("GET / HTTP/1.1\r\nContent-Length: x\r\n\r\n", req) == HttpRequestParser::Status::Error);
+  ASSERT(parser.Parse("POST / HTTP/1.1\r\nContent-Length: 10000000000\r\n\r\n", req) == HttpRequestParser::Status::Error);
+}
+
+void TestParseIdAndContent() {
+  ASSERT_EQUAL(ParseIdAndContent("12 Buy my goods").first, 12u);
+  ASSERT_EQUAL(ParseIdAndContent("12 Buy my goods").second, "Buy my goods");
+  ASSERT_EQUAL(ParseIdAndContent("7").first, 7u);
+  ASSERT_EQUAL(ParseIdAndContent("7").second, "");
+}
+
+void TestAddCommentParsingDoesNotAllocate() {
+  const string buffer =
+    "POST /add_comment HTTP/1.1\r\n"
+    "Content-Length: 19\r\n"
+    "\r\n"
+    "0 A reasonably long comment";
+
+  HttpRequestParser parser;
+  HttpRequestView req;
+  const size_t before = allocation_count;
+  parser.Parse(buffer, req);
+  auto [user_id, comment] = ParseIdAndContent(req.body);
+  const size_t after = allocation_count;
+  ASSERT_EQUAL(after - before, 0u);
+  ASSERT_EQUAL(user_id, 0u);
+  ASSERT_EQUAL(comment, "A reasonably long");
+}
+
+string Join(const vector<iovec>& fragments) {
+  string result;
+  for (const iovec& fragment : fragments) {
+    result.append(static_cast<const char*>(fragment.iov_base), fragment.iov_len);
+  }
+  return result;
+}
+
+void TestSerializeResponse() {
+  HttpResponseSerializer serializer;
+
+  HttpResponse redirect(HttpCode::Found);
+  redirect.AddHeader("Location", "/captcha");
+  ASSERT_EQUAL(Join(serializer.Serialize(redirect)),
+    "HTTP/1.1 302 Found\r\n"
+    "Location: /captcha\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n");
+  ASSERT_EQUAL(serializer.Serialize(redirect).size(), 1u);
+
+  HttpResponse ok(HttpCode::Ok);
+  ok.SetContent(string(100000, 'x'));
+  const vector<iovec>& fragments = serializer.Serialize(ok);
+  ASSERT_EQUAL(fragments.size(), 2u);
+  ASSERT_EQUAL(Join({fragments[0]}), "HTTP/1.1 200 OK\r\nContent-Length: 100000\r\n\r\n");
+  ASSERT(fragments[1].iov_base == ok.Content().data());
+  ASSERT_EQUAL(serializer.TotalSize(), fragments[0].iov_len + 100000);
+
+  ASSERT_EQUAL(StatusLine(HttpCode::NotFound), "HTTP/1.1 404 Not found\r\n");
+}
+
+void TestSerializationReusesBuffer() {
+  HttpResponseSerializer serializer;
+  HttpResponse resp(HttpCode::Ok);
+  resp.SetContent("0");
+  serializer.Serialize(resp);
+
+  const size_t before = allocation_count;
+  for (int i = 0; i < 100; ++i) {
+    serializer.Serialize(resp);
+  }
+  const size_t after = allocation_count;
+  ASSERT_EQUAL(after - before, 0u);
+}
+
+// Крутит цикл сервера в отдельном потоке, пока жив объект
+class ServerThread {
+public:
+  explicit ServerThread(TcpServer& server)
+    : server(server)
+    , loop([&server] { server.Run(); })
+  {
+  }
+
+  ~ServerThread() {
+    server.Stop();
+    loop.join();
+  }
+
+private:
+  TcpServer& server;
+  thread loop;
+};
+
+void TestTcpServerKeepAliveAndClose() {
+  CommentServer cs;
+  TcpServer server([&cs](const HttpRequestView& req) { return cs.ServeRequest(req); });
+  ServerThread loop(server);
+
+  {
+    LoopbackClient client(server.Port());
+    ClientResponse resp;
+    client.Send(MakeRequest("POST", "/add_user"));
+    ASSERT(client.Receive(resp));
+    ASSERT_EQUAL(resp.code, 200);
+    ASSERT_EQUAL(resp.content, "0");
+
+    // Два запроса одним куском и третий, разорванный посередине
+    const string second = MakeRequest("POST", "/add_comment", "0 Hello");
+    client.Send(MakeRequest("POST", "/add_user") + second.substr(0, 10));
+    client.Send(second.substr(10));
+    ASSERT(client.Receive(resp));
+    ASSERT_EQUAL(resp.content, "1");
+    ASSERT(client.Receive(resp));
+    ASSERT_EQUAL(resp.code, 200);
+
+    client.Send(
+      "GET /user_comments?user_id=0 HTTP/1.1\r\n"
+      "Connection: close\r\n\r\n"
+    );
+    ASSERT(client.Receive(resp));
+    ASSERT_EQUAL(resp.content, "Hello\n");
+    ASSERT_EQUAL(resp.headers, (vector<HttpHeader>{{"Connection", "close"}}));
+    ASSERT(!client.Receive(resp));
+  }
+  {
+    LoopbackClient client(server.Port());
+    ClientResponse resp;
+    client.Send("GARBAGE\r\n\r\n");
+    ASSERT(client.Receive(resp));
+    ASSERT_EQUAL(resp.code, 400);
+    ASSERT(!client.Receive(resp));
+  }
+}
+
+void TestTcpServerErrors() {
+  atomic<bool> fail_write = false;
+  TcpServer server(
+    [](const HttpRequestView& req) {
+      if (req.path == "/throw") {
+        throw runtime_error("handler failed");
+      }
+      return HttpResponse(HttpCode::Ok);
+    },
+    {"127.0.0.1", 0, 1, [&fail_write] {
+      if (fail_write.exchange(false)) {
+        throw runtime_error("cannot confirm");
+      }
+    }}
+  );
+  ServerThread loop(server);
+  ClientResponse resp;
+  {
+    // Запросы после упавшего уже не обрабатываются
+    LoopbackClient client(server.Port());
+    client.Send(MakeRequest("GET", "/ok") + MakeRequest("GET", "/throw") + MakeRequest("GET", "/ok"));
+    ASSERT(client.Receive(resp));
+    ASSERT_EQUAL(resp.code, 200);
+    ASSERT(client.Receive(resp));
+    ASSERT_EQUAL(resp.code, 500);
+    ASSERT_EQUAL(resp.headers, (vector<HttpHeader>{{"Connection", "close"}}));
+    ASSERT(!client.Receive(resp));
+  }
+  {
+    LoopbackClient client(server.Port());
+    fail_write = true;
+    client.Send(MakeRequest("GET", "/ok"));
+    ASSERT(client.Receive(resp));
+    ASSERT_EQUAL(resp.code, 500);
+    ASSERT(!client.Receive(resp));
+  }
+  {
+    LoopbackClient client(server.Port());
+    client.Send(MakeRequest("GET", "/ok"));
+    ASSERT(client.Receive(resp));
+    ASSERT_EQUAL(resp.code, 200);
+  }
+}
+
+void TestTcpServerLimitsQueuedResponses() {
+  const size_t kRequests = 2000;
+  const string content(64 * 1024, 'x');
+  atomic<size_t> handled = 0;
+  TcpServer server([&](const HttpRequestView&) {
+    ++handled;
+    HttpResponse resp(HttpCode::Ok);
+    resp.SetContent(content);
+    return resp;
+  });
+  ServerThread loop(server);
+  LoopbackClient client(server.Port());
+  string requests;
+  for (size_t i = 0; i < kRequests; ++i) {
+    requests += MakeRequest("GET", "/big");
+  }
+  client.Send(requests);
+
+  // Клиент не читает ответы: сервер обрабатывает запросы, только пока
+  // есть место в очереди и буферах сокета
+  this_thread::sleep_for(chrono::milliseconds(200));
+  ASSERT(handled < kRequests / 2);
+
+  ClientResponse resp;
+  for (size_t i = 0; i < kRequests; ++i) {
+    ASSERT(client.Receive(resp));
+    ASSERT_EQUAL(resp.content.size(), content.size());
+  }
+  ASSERT_EQUAL(handled.load(), kRequests);
+}
+
+template <size_t Threads>
+void TestTcpServerLoad() {
+  const size_t kClients = 8;
+  const size_t kBatches = 20;
+  const size_t kBatchSize = 50;
+
+  CommentServer cs;
+  TcpServer server(
+    [&cs](const HttpRequestView& req) { return cs.ServeRequest(req); },
+    {"127.0.0.1", 0, Threads}
+  );
+  ServerThread loop(server);
+
+  // Каждый клиент заводит двух пользователей и пишет от них по очереди,
+  // поэтому ни один пользователь не пишет дважды подряд и не банится
+  vector<string> user_ids(2 * kClients);
+  vector<thread> clients;
+  atomic<size_t> failures = 0;
+  for (size_t c = 0; c < kClients; ++c) {
+    clients.emplace_back([&, c] {
+      LoopbackClient client(server.Port());
+      ClientResponse resp;
+      client.Send(MakeRequest("POST", "/add_user") + MakeRequest("POST", "/add_user"));
+      for (size_t i = 0; i < 2; ++i) {
+        client.Receive(resp);
+        user_ids[2 * c + i] = resp.content;
+      }
+      for (size_t batch = 0; batch < kBatches; ++batch) {
+        string requests;
+        for (size_t i = 0; i < kBatchSize; ++i) {
+          const string& user = user_ids[2 * c + i % 2];
+          requests += MakeRequest("POST", "/add_comment", user + " comment");
+        }
+        client.Send(requests);
+        for (size_t i = 0; i < kBatchSize; ++i) {
+          if (!client.Receive(resp) || resp.code != 200) {
+            ++failures;
+          }
+        }
+      }
+    });
+  }
+  for (auto& t : clients) {
+    t.join();
+  }
+  ASSERT_EQUAL(failures.load(), 0u);
+
+  LoopbackClient client(server.Port());
+  for (const string& user : user_ids) {
+    ClientResponse resp;
+    client.Send(MakeRequest("GET", "/user_comments?user_id=" + user));
+    ASSERT(client.Receive(resp));
+    size_t lines = count(resp.content.begin(), resp.content.end(), '\n');
+    ASSERT_EQUAL(lines, kBatches * kBatchSize / 2);
+  }
+}
+
+void TestConcurrentServeRequest() {
+  const size_t kThreads = 4;
+  const size_t kUsersPerThread = 50;
+  const size_t kRounds = 200;
+
+  CommentServer cs;
+  vector<vector<size_t>> user_ids(kThreads);
+  vector<thread> workers;
+  for (size_t t = 0; t < kThreads; ++t) {
+    workers.emplace_back([&, t] {
+      for (size_t i = 0; i < kUsersPerThread; ++i) {
+        HttpResponse resp = cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+        user_ids[t].push_back(stoul(resp.Content()));
+      }
+      // Пользователи потока пишут по кругу, поэтому никто не пишет дважды подряд
+      for (size_t round = 0; round < kRounds; ++round) {
+        for (size_t user : user_ids[t]) {
+          cs.ServeRequest(HttpRequest{"POST", "/add_comment", to_string(user) + " hi"});
+        }
+        const string user = to_string(user_ids[t][round % kUsersPerThread]);
+        cs.ServeRequest(HttpRequest{"GET", "/user_comments", "", {{"user_id", user}}});
+      }
+    });
+  }
+  for (auto& t : workers) {
+    t.join();
+  }
+
+  set<size_t> unique_ids;
+  for (const auto& ids : user_ids) {
+    unique_ids.insert(ids.begin(), ids.end());
+  }
+  ASSERT_EQUAL(unique_ids.size(), kThreads * kUsersPerThread);
+  ASSERT_EQUAL(*unique_ids.rbegin(), kThreads * kUsersPerThread - 1);
+  for (size_t user : unique_ids) {
+    HttpResponse resp = cs.ServeRequest(
+      HttpRequest{"GET", "/user_comments", "", {{"user_id", to_string(user)}}}
+    );
+    ASSERT_EQUAL(resp.ContentSize(), kRounds * string("hi\n").size());
+  }
+}
+
+void TestUnknownUser() {
+  CommentServer cs;
+  cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+  ASSERT_EQUAL(
+    cs.ServeRequest(HttpRequest{"POST", "/add_comment", "100 Hello"}).Code(),
+    HttpCode::NotFound
+  );
+  ASSERT_EQUAL(
+    cs.ServeRequest(HttpRequest{"GET", "/user_comments", "", {{"user_id", "1"}}}).Code(),
+    HttpCode::NotFound
+  );
+}
+
+void TestRouteTable() {
+  static constexpr auto routes = MakeRouteTable<int>({
+    {"GET", "/a", 1},
+    {"POST", "/a", 2},
+    {"GET", "/b", 3},
+  });
+  static_assert(routes.SlotCount() >= 6);
+
+  ASSERT_EQUAL(*routes.Find("GET", "/a"), 1);
+  ASSERT_EQUAL(*routes.Find("POST", "/a"), 2);
+  ASSERT_EQUAL(*routes.Find("GET", "/b"), 3);
+  ASSERT(!routes.Find("POST", "/b"));
+  ASSERT(!routes.Find("GET", "/c"));
+  ASSERT(!routes.Find("GET", "/a/"));
+  ASSERT(!routes.Find("", ""));
+}
+
+string JoinViews(const HttpResponse& resp) {
+  string result = resp.Content();
+  for (string_view part : resp.ContentViews()) {
+    result += part;
+  }
+  return result;
+}
+
+void TestCommentArena() {
+  CommentArena arena;
+  string expected;
+  for (size_t i = 0; i < 2000; ++i) {
+    // Иногда попадаются комментарии длиннее любого куска
+    const string comment = i % 500 == 7 ? string(100'000, 'x') : "comment " + to_string(i);
+    arena.Add(comment);
+    expected += comment + '\n';
+  }
+  ASSERT_EQUAL(arena.Size(), 2000u);
+
+  string all;
+  size_t parts = 0;
+  arena.Page(0, arena.Size(), [&](string_view part) {
+    all += part;
+    ++parts;
+  });
+  ASSERT_EQUAL(all, expected);
+  // Фрагментов столько, сколько кусков, а не комментариев
+  ASSERT(parts < 30);
+
+  string page;
+  arena.Page(10, 3, [&page](string_view part) { page += part; });
+  ASSERT_EQUAL(page, "comment 10\ncomment 11\ncomment 12\n");
+
+  size_t calls = 0;
+  arena.Page(1999, 10, [&calls](string_view) { ++calls; });
+  ASSERT_EQUAL(calls, 1u);
+  arena.Page(5000, 10, [&calls](string_view) { ++calls; });
+  ASSERT_EQUAL(calls, 1u);
+}
+
+void TestUserCommentsPagination() {
+  CommentServer cs;
+  cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+  cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+  for (size_t i = 0; i < 2 * CommentServer::kMaxCommentsPage; ++i) {
+    // Чередуем пользователей, чтобы не попасть под бан
+    cs.ServeRequest(HttpRequest{"POST", "/add_comment", to_string(i % 2) + " c" + to_string(i)});
+  }
+  auto get = [&cs](map<string, string> params) {
+    return JoinViews(cs.ServeRequest(HttpRequest{"GET", "/user_comments", "", move(params)}));
+  };
+
+  ASSERT_EQUAL(get({{"user_id", "1"}, {"offset", "2"}, {"limit", "3"}}), "c5\nc7\nc9\n");
+  ASSERT_EQUAL(get({{"user_id", "1"}, {"offset", "998"}}), "c1997\nc1999\n");
+  ASSERT_EQUAL(get({{"user_id", "1"}, {"offset", "1000"}}), "");
+  ASSERT_EQUAL(get({{"user_id", "1"}, {"limit", "0"}}), "");
+
+  const string first_page = get({{"user_id", "0"}});
+  ASSERT_EQUAL(
+    static_cast<size_t>(count(first_page.begin(), first_page.end(), '\n')),
+    CommentServer::kMaxCommentsPage
+  );
+  const string huge_limit = get({{"user_id", "0"}, {"limit", "1000000"}});
+  ASSERT_EQUAL(huge_limit, first_page);
+
+  auto code = [&cs](map<string, string> params) {
+    return cs.ServeRequest(HttpRequest{"GET", "/user_comments", "", move(params)}).Code();
+  };
+  ASSERT_EQUAL(code({}), HttpCode::BadRequest);
+  for (const char* bad : {"", "x", "1x", "-1", "99999999999999999999999"}) {
+    ASSERT_EQUAL(code({{"user_id", bad}}), HttpCode::BadRequest);
+    ASSERT_EQUAL(code({{"user_id", "0"}, {"offset", bad}}), HttpCode::BadRequest);
+    ASSERT_EQUAL(code({{"user_id", "0"}, {"limit", bad}}), HttpCode::BadRequest);
+  }
+
+  // Тело из нескольких фрагментов сериализуется целиком
+  HttpResponse resp(HttpCode::Ok);
+  resp.SetContent("head ").AddContentView("first ").AddContentView("").AddContentView("second");
+  ASSERT_EQUAL(resp.ContentSize(), 17u);
+  HttpResponseSerializer serializer;
+  ASSERT_EQUAL(serializer.Serialize(resp).size(), 4u);
+  ASSERT_EQUAL(serializer.TotalSize(), StatusLine(HttpCode::Ok).size() + 22 + 17);
+}
+
+void TestLatencyBuckets() {
+  for (uint64_t value : {0ull, 1ull, 7ull, 8ull, 15ull, 16ull, 17ull, 1000ull, 123456789ull}) {
+    const size_t index = LatencyBuckets::Index(value);
+    ASSERT(LatencyBuckets::LowerBound(index) <= value);
+    ASSERT(value < LatencyBuckets::LowerBound(index + 1));
+    // Ширина корзины -- не больше восьмой части её начала
+    ASSERT(LatencyBuckets::LowerBound(index + 1) - LatencyBuckets::LowerBound(index)
+           <= max<uint64_t>(1, LatencyBuckets::LowerBound(index) / 8));
+  }
+  ASSERT_EQUAL(LatencyBuckets::Index(~0ull), LatencyBuckets::kCount - 1);
+}
+
+void TestMetrics() {
+  CommentServer cs;
+  cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+  cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+  cs.ServeRequest(HttpRequest{"POST", "/checkcaptcha", "0 24"});
+  cs.ServeRequest(HttpRequest{"GET", "/nowhere"});
+  thread([&cs] { cs.ServeRequest(HttpRequest{"GET", "/captcha"}); }).join();
+
+  const string report = cs.ServeRequest(HttpRequest{"GET", "/metrics"}).Content();
+  auto has = [&report](const string& line) {
+    return report.find(line + "\n") != string::npos;
+  };
+  ASSERT(has("comment_server_requests_total{route=\"POST /add_user\"} 2"));
+  ASSERT(has("comment_server_requests_total{route=\"POST /checkcaptcha\"} 1"));
+  ASSERT(has("comment_server_requests_total{route=\"GET /captcha\"} 1"));
+  ASSERT(has("comment_server_requests_total{route=\"POST /add_comment\"} 0"));
+  ASSERT(has("comment_server_requests_total{route=\"other\"} 1"));
+  ASSERT(has("comment_server_responses_total{code=\"200\"} 3"));
+  ASSERT(has("comment_server_responses_total{code=\"302\"} 1"));
+  ASSERT(has("comment_server_responses_total{code=\"404\"} 1"));
+  ASSERT(report.find("route=\"POST /add_user\",quantile=\"0.99\"") != string::npos);
+  ASSERT(report.find("route=\"POST /add_comment\",quantile") == string::npos);
+}
+
+// Стоимость замеров проверяет comment_server_v2_metrics_benchmark
+void TestMetricsCountEveryRequest() {
+  const size_t kRequests = 1'000'000;
+  RequestMetrics metrics({"GET /a", "GET /b"});
+  for (size_t i = 0; i < kRequests; ++i) {
+    metrics.Track(i % 3, [] { return HttpResponse(HttpCode::Ok); });
+  }
+  const string report = metrics.Report();
+  ASSERT(report.find("comment_server_requests_total{route=\"other\"} 333333\n") != string::npos);
+  ASSERT(report.find("comment_server_responses_total{code=\"200\"} 1000000\n") != string::npos);
+}
+
+const string kJournalPath = "comment_server_test";
+
+void RemoveJournal() {
+  remove((kJournalPath + ".journal").c_str());
+  remove((kJournalPath + ".snapshot").c_str());
+}
+
+string ReadFile(const string& path) {
+  ifstream input(path, ios::binary);
+  return string(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+}
+
+string GetComments(CommentServer& cs, const string& user_id) {
+  return JoinViews(cs.ServeRequest(HttpRequest{"GET", "/user_comments", "", {{"user_id", user_id}}}));
+}
+
+void TestJournalReplay() {
+  RemoveJournal();
+  {
+    CommentServer cs(JournalOptions{kJournalPath});
+    cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+    cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+    cs.ServeRequest(HttpRequest{"POST", "/add_comment", "0 Hello"});
+    for (const string comment : {"1 a", "1 b", "1 c", "1 d"}) {
+      cs.ServeRequest(HttpRequest{"POST", "/add_comment", comment});
+    }
+    cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+    cs.ServeRequest(HttpRequest{"POST", "/add_comment", "2 Third"});
+  }
+  {
+    CommentServer cs(JournalOptions{kJournalPath});
+    ASSERT_EQUAL(GetComments(cs, "0"), "Hello\n");
+    ASSERT_EQUAL(GetComments(cs, "1"), "a\nb\nc\n");
+    ASSERT_EQUAL(GetComments(cs, "2"), "Third\n");
+    // Бан пережил перезапуск
+    ASSERT_EQUAL(cs.ServeRequest(HttpRequest{"POST", "/add_comment", "1 e"}).Code(), HttpCode::Found);
+    ASSERT_EQUAL(cs.ServeRequest(HttpRequest{"POST", "/add_user"}).Content(), "3");
+    cs.ServeRequest(HttpRequest{"POST", "/checkcaptcha", "1 42"});
+  }
+  {
+    CommentServer cs(JournalOptions{kJournalPath});
+    ASSERT_EQUAL(cs.ServeRequest(HttpRequest{"POST", "/add_comment", "1 e"}).Code(), HttpCode::Ok);
+    ASSERT_EQUAL(GetComments(cs, "1"), "a\nb\nc\ne\n");
+  }
+  RemoveJournal();
+}
+
+void TestJournalCheckpoint() {
+  RemoveJournal();
+  JournalOptions options{kJournalPath};
+  options.checkpoint_every = 10;
+  {
+    CommentServer cs(options);
+    cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+    cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+    for (size_t i = 0; i < 25; ++i) {
+      cs.ServeRequest(HttpRequest{"POST", "/add_comment", to_string(i % 2) + " c" + to_string(i)});
+    }
+  }
+  // Снимки делались в фоне по ходу, в журнале остался только хвост меньше
+  // checkpoint_every записей (запись комментария здесь -- до 40 байт)
+  ASSERT(!ReadFile(kJournalPath + ".snapshot").empty());
+  ASSERT(ReadFile(kJournalPath + ".journal").size() < 10 * 40);
+
+  string stale_journal;
+  {
+    CommentServer cs(options);
+    ASSERT_EQUAL(GetComments(cs, "1"), "c1\nc3\nc5\nc7\nc9\nc11\nc13\nc15\nc17\nc19\nc21\nc23\n");
+    cs.ServeRequest(HttpRequest{"POST", "/add_comment", "0 last"});
+    stale_journal = ReadFile(kJournalPath + ".journal");
+    cs.Checkpoint();
+    ASSERT_EQUAL(ReadFile(kJournalPath + ".journal"), "");
+  }
+
+  // Как будто процесс упал после записи снимка, но до обрезки журнала
+  ofstream(kJournalPath + ".journal", ios::binary) << stale_journal;
+  {
+    CommentServer cs(options);
+    const string comments = GetComments(cs, "0");
+    ASSERT_EQUAL(count(comments.begin(), comments.end(), '\n'), 14);
+    ASSERT_EQUAL(comments.substr(comments.size() - 5), "last\n");
+  }
+  RemoveJournal();
+}
+
+void TestJournalWaitsForWhatRequestSees() {
+  RemoveJournal();
+  CommentServer cs(JournalOptions{kJournalPath});
+  cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+  cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+  const uint64_t syncs = cs.JournalSyncCount();
+
+  // Запись другого потока ещё не сброшена. Запросы, которые её не видят,
+  // сброса не ждут: пользователь 1 лежит в другом шарде
+  thread([&cs] { cs.ServeRequestDeferred(HttpRequest{"POST", "/add_comment", "0 pending"}); }).join();
+  cs.ServeRequest(HttpRequest{"GET", "/captcha"});
+  ASSERT_EQUAL(GetComments(cs, "1"), "");
+  ASSERT_EQUAL(cs.JournalSyncCount(), syncs);
+
+  // Ответ с этой записью отдаётся только после её сброса
+  ASSERT_EQUAL(GetComments(cs, "0"), "pending\n");
+  ASSERT_EQUAL(cs.JournalSyncCount(), syncs + 1);
+  ASSERT_EQUAL(GetComments(cs, "0"), "pending\n");
+  ASSERT_EQUAL(cs.JournalSyncCount(), syncs + 1);
+
+  cs.ServeRequest(HttpRequest{"POST", "/add_comment", "0 own"});
+  ASSERT_EQUAL(cs.JournalSyncCount(), syncs + 2);
+  RemoveJournal();
+}
+
+void TestJournalCheckpointDuringWrites() {
+  RemoveJournal();
+  const size_t kThreads = 4;
+  const size_t kRequests = 300;
+  JournalOptions options{kJournalPath};
+  options.checkpoint_every = 50;
+  vector<string> expected(kThreads);
+  {
+    CommentServer cs(options);
+    for (size_t t = 0; t < kThreads; ++t) {
+      cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+    }
+    atomic<bool> done = false;
+    vector<thread> workers;
+    for (size_t t = 0; t < kThreads; ++t) {
+      workers.emplace_back([&cs, t] {
+        for (size_t i = 0; i < kRequests; ++i) {
+          cs.ServeRequest(HttpRequest{"POST", "/add_comment", to_string(t) + " c" + to_string(i)});
+          cs.ServeRequest(HttpRequest{"POST", "/checkcaptcha", to_string(t) + " 42"});
+        }
+      });
+    }
+    thread checkpoints([&cs, &done] {
+      while (!done) {
+        cs.Checkpoint();
+      }
+    });
+    for (auto& w : workers) {
+      w.join();
+    }
+    done = true;
+    checkpoints.join();
+    for (size_t t = 0; t < kThreads; ++t) {
+      expected[t] = GetComments(cs, to_string(t));
+    }
+  }
+  {
+    CommentServer cs(options);
+    for (size_t t = 0; t < kThreads; ++t) {
+      ASSERT_EQUAL(GetComments(cs, to_string(t)), expected[t]);
+    }
+  }
+  RemoveJournal();
+}
+
+void TestJournalCheckpointFailureKeepsServing() {
+  RemoveJournal();
+  JournalOptions options{kJournalPath};
+  options.checkpoint_every = 5;
+  // Каталог на месте временного файла снимка: снимок не создать
+  const string blocker = kJournalPath + ".snapshot.tmp";
+  ASSERT_EQUAL(mkdir(blocker.c_str(), 0755), 0);
+  {
+    CommentServer cs(options);
+    // Каждый запрос пишет в журнал и, набрав checkpoint_every записей,
+    // просит фоновый снимок
+    auto serve_until = [&cs](auto condition) {
+      for (int i = 0; i < 2000 && !condition(); ++i) {
+        ASSERT_EQUAL(cs.ServeRequest(HttpRequest{"POST", "/add_user"}).Code(), HttpCode::Ok);
+        this_thread::sleep_for(chrono::milliseconds(1));
+      }
+      return condition();
+    };
+    ASSERT(serve_until([&cs] { return !cs.CheckpointError().empty(); }));
+    remove(blocker.c_str());
+    ASSERT(serve_until([&cs] { return cs.CheckpointError().empty(); }));
+  }
+  ASSERT(!ReadFile(kJournalPath + ".snapshot").empty());
+  remove(blocker.c_str());
+  RemoveJournal();
+}
+
+void TestJournalGroupCommit() {
+  RemoveJournal();
+  const size_t kThreads = 8;
+  const size_t kRequests = 50;
+  JournalOptions options{kJournalPath};
+  options.wal.commit_delay = chrono::milliseconds(1);
+  CommentServer cs(options);
+  for (size_t t = 0; t < kThreads; ++t) {
+    cs.ServeRequest(HttpRequest{"POST", "/add_user"});
+  }
+
+  vector<thread> workers;
+  for (size_t t = 0; t < kThreads; ++t) {
+    workers.emplace_back([&cs, t] {
+      for (size_t i = 0; i < kRequests; ++i) {
+        cs.ServeRequest(HttpRequest{"POST", "/add_comment", to_string(t) + " hi"});
+        // Чужие комментарии между своими не гарантированы, поэтому снимаем бан
+        cs.ServeRequest(HttpRequest{"POST", "/checkcaptcha", to_string(t) + " 42"});
+      }
+    });
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  const uint64_t syncs = cs.JournalSyncCount();
+  ASSERT(syncs < kThreads * kRequests);
+
+  // Через TCP ответы на конвейер запросов ждут одного общего сброса
+  TcpServer server(
+    [&cs](const HttpRequestView& req) { return cs.ServeRequestDeferred(req); },
+    {"127.0.0.1", 0, 1, [&cs] { cs.WaitDurable(); }}
+  );
+  ServerThread loop(server);
+  LoopbackClient client(server.Port());
+  string requests;
+  for (size_t i = 0; i < kRequests; ++i) {
+    requests += MakeRequest("POST", "/add_comment", to_string(i % 2) + " piped");
+  }
+  const uint64_t syncs_before = cs.JournalSyncCount();
+  client.Send(requests);
+  ClientResponse resp;
+  for (size_t i = 0; i < kRequests; ++i) {
+    ASSERT(client.Receive(resp));
+    ASSERT_EQUAL(resp.code, 200);
+  }
+  ASSERT(cs.JournalSyncCount() - syncs_before < kRequests / 2);
+  RemoveJournal();
+}
+
 int main() {
   TestRunner tr;
   RUN_TEST(tr, TestServer<CommentServer>);
+  RUN_TEST(tr, TestParseRequest);
+  RUN_TEST(tr, TestParseRequestIncrementally);
+  RUN_TEST(tr, TestParseIdAndContent);
+  RUN_TEST(tr, TestAddCommentParsingDoesNotAllocate);
+  RUN_TEST(tr, TestSerializeResponse);
+  RUN_TEST(tr, TestSerializationReusesBuffer);
+  RUN_TEST(tr, TestTcpServerKeepAliveAndClose);
+  RUN_TEST(tr, TestTcpServerErrors);
+  RUN_TEST(tr, TestTcpServerLimitsQueuedResponses);
+  RUN_TEST(tr, TestTcpServerLoad<1>);
+  RUN_TEST(tr, TestTcpServerLoad<4>);
+  RUN_TEST(tr, TestConcurrentServeRequest);
+  RUN_TEST(tr, TestUnknownUser);
+  RUN_TEST(tr, TestRouteTable);
+  RUN_TEST(tr, TestCommentArena);
+  RUN_TEST(tr, TestUserCommentsPagination);
+  RUN_TEST(tr, TestLatencyBuckets);
+  RUN_TEST(tr, TestMetrics);
+  RUN_TEST(tr, TestMetricsCountEveryRequest);
+  RUN_TEST(tr, TestJournalReplay);
+  RUN_TEST(tr, TestJournalCheckpoint);
+  RUN_TEST(tr, TestJournalWaitsForWhatRequestSees);
+  RUN_TEST(tr, TestJournalCheckpointDuringWrites);
+  RUN_TEST(tr, TestJournalCheckpointFailureKeepsServing);
+  RUN_TEST(tr, TestJournalGroupCommit);
 }
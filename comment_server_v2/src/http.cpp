@@ -0,0 +1,250 @@
+#include "http.h"
+
+#include <cctype>
+#include <charconv>
+#include <iterator>
+#include <utility>
+
+using namespace std;
+
+namespace {
+
+// Заголовки длиннее этого считаем ошибкой, чтобы не копить мусор в буфере
+const size_t kMaxHeaderSize = 64 * 1024;
+// Тело длиннее этого тоже не ждём: иначе клиент с огромным Content-Length
+// заставил бы буфер соединения расти без конца
+const size_t kMaxBodySize = 1024 * 1024;
+
+bool EqualsIgnoreCase(string_view lhs, string_view rhs) {
+  if (lhs.size() != rhs.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < lhs.size(); ++i) {
+    if (tolower(static_cast<unsigned char>(lhs[i])) != tolower(static_cast<unsigned char>(rhs[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+string_view Trim(string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+// Отрезает от s всё до разделителя включительно и возвращает отрезанное
+string_view ReadToken(string_view& s, char delimiter) {
+  size_t pos = s.find(delimiter);
+  string_view token = s.substr(0, pos);
+  s.remove_prefix(pos == string_view::npos ? s.size() : pos + 1);
+  return token;
+}
+
+}
+
+HttpRequestView::HttpRequestView(const HttpRequest& req)
+  : method(req.method)
+  , path(req.path)
+  , body(req.body)
+  , get_params(&req.get_params)
+{
+}
+
+optional<string_view> HttpRequestView::GetParam(string_view name) const {
+  if (get_params) {
+    auto it = get_params->find(string(name));
+    if (it == get_params->end()) {
+      return nullopt;
+    }
+    return string_view(it->second);
+  }
+  for (string_view rest = query; !rest.empty(); ) {
+    string_view value = ReadToken(rest, '&');
+    string_view key = ReadToken(value, '=');
+    if (key == name) {
+      return value;
+    }
+  }
+  return nullopt;
+}
+
+HttpRequestParser::Status HttpRequestParser::Parse(string_view buffer, HttpRequestView& request) {
+  // Ищем пустую строку, продолжая с того места, где остановились в прошлый
+  // раз: иначе запрос, приходящий по байту, разбирался бы за квадрат
+  const size_t from = scanned > 2 ? scanned - 2 : 0;
+  size_t header_end = string_view::npos;
+  size_t body_start = 0;
+  if (size_t lf = buffer.find("\n\n", from); lf != string_view::npos) {
+    header_end = lf + 1;
+    body_start = lf + 2;
+  }
+  if (size_t crlf = buffer.find("\n\r\n", from); crlf != string_view::npos && crlf < header_end) {
+    header_end = crlf + 1;
+    body_start = crlf + 3;
+  }
+  if (header_end == string_view::npos) {
+    scanned = buffer.size();
+    return buffer.size() > kMaxHeaderSize ? Status::Error : Status::Incomplete;
+  }
+  scanned = header_end;
+
+  string_view headers = buffer.substr(0, header_end);
+  string_view request_line = Trim(ReadToken(headers, '\n'));
+  request.method = ReadToken(request_line, ' ');
+  string_view target = ReadToken(request_line, ' ');
+  string_view version = request_line;
+  if (request.method.empty() || target.empty() || version.substr(0, 7) != "HTTP/1.") {
+    return Status::Error;
+  }
+  request.path = ReadToken(target, '?');
+  request.query = target;
+  request.keep_alive = version != "HTTP/1.0";
+
+  size_t content_length = 0;
+  while (!headers.empty()) {
+    string_view value = Trim(ReadToken(headers, '\n'));
+    if (value.empty()) {
+      continue;
+    }
+    string_view name = Trim(ReadToken(value, ':'));
+    value = Trim(value);
+    if (EqualsIgnoreCase(name, "Content-Length")) {
+      auto [end, error] = from_chars(value.data(), value.data() + value.size(), content_length);
+      if (error != errc() || end != value.data() + value.size() || content_length > kMaxBodySize) {
+        return Status::Error;
+      }
+    } else if (EqualsIgnoreCase(name, "Connection")) {
+      if (EqualsIgnoreCase(value, "close")) {
+        request.keep_alive = false;
+      } else if (EqualsIgnoreCase(value, "keep-alive")) {
+        request.keep_alive = true;
+      }
+    }
+  }
+
+  if (buffer.size() - body_start < content_length) {
+    return Status::Incomplete;
+  }
+  request.body = buffer.substr(body_start, content_length);
+  consumed = body_start + content_length;
+  scanned = 0;
+  return Status::Complete;
+}
+
+ostream& operator<< (ostream& output, const HttpCode& code) {
+  switch (code)
+  {
+    case HttpCode::Ok:
+      output << "200 OK";
+      break;
+    case HttpCode::Found:
+      output << "302 Found";
+      break;
+    case HttpCode::NotFound:
+      output << "404 Not found";
+      break;
+    case HttpCode::BadRequest:
+      output << "400 Bad request";
+      break;
+    case HttpCode::InternalServerError:
+      output << "500 Internal Server Error";
+      break;
+  }
+  return output;
+}
+
+string_view StatusLine(HttpCode code) {
+  switch (code) {
+    case HttpCode::Ok:
+      return "HTTP/1.1 200 OK\r\n";
+    case HttpCode::Found:
+      return "HTTP/1.1 302 Found\r\n";
+    case HttpCode::NotFound:
+      return "HTTP/1.1 404 Not found\r\n";
+    case HttpCode::BadRequest:
+      return "HTTP/1.1 400 Bad request\r\n";
+    case HttpCode::InternalServerError:
+      break;
+  }
+  return "HTTP/1.1 500 Internal Server Error\r\n";
+}
+
+const vector<iovec>& HttpResponseSerializer::Serialize(const HttpResponse& resp) {
+  head.clear();
+  head += StatusLine(resp.Code());
+  for (const HttpHeader& header : resp.Headers()) {
+    head += header.name;
+    head += ": ";
+    head += header.value;
+    head += "\r\n";
+  }
+
+  char length[24];
+  auto [length_end, error] = to_chars(begin(length), end(length), resp.ContentSize());
+  head += "Content-Length: ";
+  head.append(length, length_end);
+  head += "\r\n\r\n";
+
+  fragments.clear();
+  fragments.push_back({head.data(), head.size()});
+  if (!resp.Content().empty()) {
+    fragments.push_back({const_cast<char*>(resp.Content().data()), resp.Content().size()});
+  }
+  for (string_view part : resp.ContentViews()) {
+    fragments.push_back({const_cast<char*>(part.data()), part.size()});
+  }
+  total_size = head.size() + resp.ContentSize();
+  return fragments;
+}
+
+ostream& operator<<(ostream& output, const HttpHeader& h) {
+  return output << h.name << ": " << h.value;
+}
+
+bool operator==(const HttpHeader& lhs, const HttpHeader& rhs) {
+  return lhs.name == rhs.name && lhs.value == rhs.value;
+}
+
+HttpResponse& HttpResponse::AddHeader(string name, string value) {
+  headers.push_back(HttpHeader{move(name), move(value)});
+  return *this;
+}
+
+HttpResponse& HttpResponse::SetContent(string a_content) {
+  content_size += a_content.size() - content.size();
+  content = move(a_content);
+  return *this;
+}
+
+HttpResponse& HttpResponse::AddContentView(string_view part) {
+  if (!part.empty()) {
+    content_views.push_back(part);
+    content_size += part.size();
+  }
+  return *this;
+}
+
+HttpResponse& HttpResponse::SetCode(HttpCode a_code) {
+  code = a_code;
+  return *this;
+}
+
+ostream& operator<< (ostream& output, const HttpResponse& resp) {
+  output << "HTTP/1.1 " << resp.code << '\n';
+  for (const HttpHeader& header : resp.headers) {
+    output << header << '\n';
+  }
+  if (resp.content_size != 0) {
+    output << "Content-Length: " << to_string(resp.content_size) << '\n';
+  }
+  output << '\n' << resp.content;
+  for (string_view part : resp.content_views) {
+    output << part;
+  }
+  return output;
+}
@@ -0,0 +1,386 @@
+#include "comment_server.h"
+#include "http.h"
+#include "loopback_client.h"
+#include "tcp_server.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+// Нагрузочный замер CommentServer на смеси запросов.
+// Запуск: comment_server_v2_load_benchmark [ключ=значение ...]
+//   threads=4         -- число нагружающих потоков
+//   requests=200000   -- запросов на поток
+//   users=32          -- пользователей, которых заводит каждый поток
+//   mix=add_user:1,add_comment:50,user_comments:40,captcha:9
+//   loopback=0        -- 1: слать запросы через TcpServer на 127.0.0.1
+//   server_threads=1  -- потоков TcpServer в режиме loopback
+//   pipeline=1        -- сколько запросов клиент шлёт, не дожидаясь ответов
+//   scaling=0         -- 1: прогнать замер с 1, 2, 4 и N потоками (N -- число
+//                        ядер) вместо threads и сравнить пропускную способность
+
+namespace {
+
+// Выделения памяти считаются по потокам, чтобы счётчик не стал общей
+// горячей точкой; потоки клиентов в режиме loopback не считаются
+struct alignas(64) AllocationCounter {
+  atomic<size_t> value = 0;
+};
+
+array<AllocationCounter, 64> allocation_counters;
+atomic<size_t> next_counter = 0;
+thread_local const size_t counter_index = next_counter++ % allocation_counters.size();
+thread_local bool is_client_thread = false;
+
+size_t TotalAllocations() {
+  size_t total = 0;
+  for (const auto& counter : allocation_counters) {
+    total += counter.value.load(memory_order_relaxed);
+  }
+  return total;
+}
+
+}
+
+void* operator new(size_t size) {
+  if (!is_client_thread) {
+    allocation_counters[counter_index].value.fetch_add(1, memory_order_relaxed);
+  }
+  if (void* p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+namespace {
+
+enum class Kind {
+  AddUser,
+  AddComment,
+  UserComments,
+  Captcha,
+};
+
+const array<string_view, 4> kKindNames = {"add_user", "add_comment", "user_comments", "captcha"};
+
+struct Options {
+  size_t threads = 4;
+  size_t requests = 200'000;
+  size_t users = 32;
+  array<unsigned, 4> mix = {1, 50, 40, 9};
+  bool loopback = false;
+  size_t server_threads = 1;
+  size_t pipeline = 1;
+  bool scaling = false;
+};
+
+void ParseMix(string_view text, array<unsigned, 4>& mix) {
+  mix.fill(0);
+  while (!text.empty()) {
+    const size_t comma = text.find(',');
+    const string_view item = text.substr(0, comma);
+    text.remove_prefix(comma == string_view::npos ? text.size() : comma + 1);
+    const size_t colon = item.find(':');
+    const string_view name = item.substr(0, colon);
+    auto it = find(kKindNames.begin(), kKindNames.end(), name);
+    if (it == kKindNames.end() || colon == string_view::npos) {
+      throw invalid_argument("Bad mix item " + string(item));
+    }
+    mix[it - kKindNames.begin()] = stoul(string(item.substr(colon + 1)));
+  }
+}
+
+Options ParseOptions(int argc, char* argv[]) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    const string_view arg = argv[i];
+    const size_t eq = arg.find('=');
+    const string_view key = arg.substr(0, eq);
+    const string value(eq == string_view::npos ? "" : arg.substr(eq + 1));
+    if (key == "threads") {
+      options.threads = stoul(value);
+    } else if (key == "requests") {
+      options.requests = stoul(value);
+    } else if (key == "users") {
+      options.users = max<size_t>(stoul(value), 2);
+    } else if (key == "mix") {
+      ParseMix(value, options.mix);
+    } else if (key == "loopback") {
+      options.loopback = value != "0";
+    } else if (key == "server_threads") {
+      options.server_threads = stoul(value);
+    } else if (key == "pipeline") {
+      options.pipeline = max<size_t>(stoul(value), 1);
+    } else if (key == "scaling") {
+      options.scaling = value != "0";
+    } else {
+      throw invalid_argument("Unknown option " + string(arg));
+    }
+  }
+  return options;
+}
+
+// Запросы одного потока, записанные подряд в один буфер, как они пришли бы по сети
+struct RequestStream {
+  string data;
+  vector<size_t> offsets = {0};
+  array<size_t, 4> counts = {};
+
+  size_t Size() const {
+    return offsets.size() - 1;
+  }
+
+  string_view Request(size_t i) const {
+    return string_view(data).substr(offsets[i], offsets[i + 1] - offsets[i]);
+  }
+};
+
+// Длины комментариев: в основном короткие, изредка длинные простыни
+size_t CommentLength(mt19937& gen) {
+  const unsigned roll = gen() % 100;
+  if (roll < 70) {
+    return 20 + gen() % 100;
+  } else if (roll < 95) {
+    return 120 + gen() % 480;
+  }
+  return 600 + gen() % 3400;
+}
+
+RequestStream GenerateRequests(const Options& options, const vector<string>& users, unsigned seed) {
+  mt19937 gen(seed);
+  discrete_distribution<size_t> pick_kind(options.mix.begin(), options.mix.end());
+  RequestStream stream;
+  string body;
+  // Комментарии идут от пользователей потока по кругу, чтобы никто не
+  // писал дважды подряд и не попадал под бан
+  size_t next_author = 0;
+  for (size_t i = 0; i < options.requests; ++i) {
+    const size_t kind = pick_kind(gen);
+    ++stream.counts[kind];
+    switch (static_cast<Kind>(kind)) {
+      case Kind::AddUser:
+        stream.data += MakeRequest("POST", "/add_user");
+        break;
+      case Kind::AddComment: {
+        body = users[next_author++ % users.size()];
+        body += ' ';
+        const size_t length = CommentLength(gen);
+        for (size_t j = 0; j < length; ++j) {
+          body += static_cast<char>('a' + gen() % 26);
+        }
+        stream.data += MakeRequest("POST", "/add_comment", body);
+        break;
+      }
+      case Kind::UserComments: {
+        string target = "/user_comments?user_id=" + users[gen() % users.size()];
+        if (gen() % 2) {
+          target += "&limit=50";
+        }
+        stream.data += MakeRequest("GET", target);
+        break;
+      }
+      case Kind::Captcha:
+        stream.data += MakeRequest("GET", "/captcha");
+        break;
+    }
+    stream.offsets.push_back(stream.data.size());
+  }
+  return stream;
+}
+
+struct ThreadResult {
+  vector<uint32_t> latencies_ns;
+};
+
+// Прогоняет запросы через разбор и ServeRequest прямо в потоке
+void RunInProcess(CommentServer& server, const RequestStream& stream, ThreadResult& result) {
+  HttpRequestParser parser;
+  HttpRequestView request;
+  for (size_t i = 0; i < stream.Size(); ++i) {
+    const auto start = steady_clock::now();
+    if (parser.Parse(stream.Request(i), request) != HttpRequestParser::Status::Complete) {
+      throw runtime_error("Generated request does not parse");
+    }
+    server.ServeRequest(request);
+    result.latencies_ns.push_back(duration_cast<nanoseconds>(steady_clock::now() - start).count());
+  }
+}
+
+// Шлёт запросы пачками по pipeline штук через одно соединение
+void RunLoopback(uint16_t port, size_t pipeline, const RequestStream& stream, ThreadResult& result) {
+  LoopbackClient client(port);
+  ClientResponse response;
+  for (size_t begin = 0; begin < stream.Size(); begin += pipeline) {
+    const size_t end = min(begin + pipeline, stream.Size());
+    const auto start = steady_clock::now();
+    client.Send(string_view(stream.data).substr(
+      stream.offsets[begin], stream.offsets[end] - stream.offsets[begin]
+    ));
+    for (size_t i = begin; i < end; ++i) {
+      if (!client.Receive(response)) {
+        throw runtime_error("Server closed the connection");
+      }
+      result.latencies_ns.push_back(duration_cast<nanoseconds>(steady_clock::now() - start).count());
+    }
+  }
+}
+
+vector<string> AddUsers(CommentServer& server, size_t count) {
+  vector<string> users;
+  for (size_t i = 0; i < count; ++i) {
+    users.push_back(server.ServeRequest(HttpRequest{"POST", "/add_user"}).Content());
+  }
+  return users;
+}
+
+void PrintLatencies(vector<uint32_t>& latencies) {
+  if (latencies.empty()) {
+    return;
+  }
+  cout << "  latency us:";
+  const pair<const char*, double> quantiles[] = {
+    {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p99.9", 0.999}, {"max", 1.0},
+  };
+  for (const auto& [name, quantile] : quantiles) {
+    const size_t rank = min(latencies.size() - 1, static_cast<size_t>(quantile * latencies.size()));
+    nth_element(latencies.begin(), latencies.begin() + rank, latencies.end());
+    cout << " " << name << "=" << fixed << setprecision(2) << latencies[rank] / 1000.0;
+  }
+  cout << endl;
+}
+
+// Возвращает пропускную способность в запросах в секунду
+double Run(const Options& options) {
+  CommentServer server;
+  vector<RequestStream> streams;
+  for (size_t t = 0; t < options.threads; ++t) {
+    streams.push_back(GenerateRequests(options, AddUsers(server, options.users), t + 1));
+  }
+  vector<ThreadResult> results(options.threads);
+  for (auto& result : results) {
+    result.latencies_ns.reserve(options.requests);
+  }
+
+  unique_ptr<TcpServer> tcp_server;
+  thread server_loop;
+  if (options.loopback) {
+    tcp_server = make_unique<TcpServer>(
+      [&server](const HttpRequestView& req) { return server.ServeRequest(req); },
+      TcpServerOptions{"127.0.0.1", 0, options.server_threads}
+    );
+    server_loop = thread([&tcp_server] { tcp_server->Run(); });
+  }
+
+  const size_t allocations_before = TotalAllocations();
+  const auto start = steady_clock::now();
+  vector<thread> workers;
+  for (size_t t = 0; t < options.threads; ++t) {
+    workers.emplace_back([&, t] {
+      if (options.loopback) {
+        is_client_thread = true;
+        RunLoopback(tcp_server->Port(), options.pipeline, streams[t], results[t]);
+      } else {
+        RunInProcess(server, streams[t], results[t]);
+      }
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  const double seconds = duration<double>(steady_clock::now() - start).count();
+  const size_t allocations = TotalAllocations() - allocations_before;
+
+  if (tcp_server) {
+    tcp_server->Stop();
+    server_loop.join();
+  }
+
+  const size_t total = options.threads * options.requests;
+  array<size_t, 4> counts = {};
+  vector<uint32_t> latencies;
+  latencies.reserve(total);
+  for (size_t t = 0; t < options.threads; ++t) {
+    for (size_t k = 0; k < counts.size(); ++k) {
+      counts[k] += streams[t].counts[k];
+    }
+    latencies.insert(latencies.end(), results[t].latencies_ns.begin(), results[t].latencies_ns.end());
+  }
+
+  cout << (options.loopback ? "loopback" : "in-process")
+       << " threads=" << options.threads;
+  if (options.loopback) {
+    cout << " server_threads=" << options.server_threads << " pipeline=" << options.pipeline;
+  }
+  cout << " requests=" << total << endl;
+  cout << "  mix:";
+  for (size_t k = 0; k < counts.size(); ++k) {
+    cout << " " << kKindNames[k] << "=" << counts[k];
+  }
+  cout << endl;
+  cout << "  throughput: " << static_cast<uint64_t>(total / seconds) << " req/s" << endl;
+  cout << "  allocations: " << fixed << setprecision(2)
+       << static_cast<double>(allocations) / total << " per request"
+       << (options.loopback ? " (server side)" : "") << endl;
+  PrintLatencies(latencies);
+  return total / seconds;
+}
+
+void RunScaling(Options options) {
+  vector<size_t> thread_counts = {1, 2, 4, max<size_t>(thread::hardware_concurrency(), 1)};
+  sort(thread_counts.begin(), thread_counts.end());
+  thread_counts.erase(unique(thread_counts.begin(), thread_counts.end()), thread_counts.end());
+
+  vector<double> throughputs;
+  for (size_t threads : thread_counts) {
+    options.threads = threads;
+    throughputs.push_back(Run(options));
+  }
+  cout << "scaling:" << endl;
+  for (size_t i = 0; i < thread_counts.size(); ++i) {
+    cout << "  threads=" << thread_counts[i]
+         << " throughput=" << static_cast<uint64_t>(throughputs[i]) << " req/s"
+         << " speedup=" << fixed << setprecision(2) << throughputs[i] / throughputs[0]
+         << endl;
+  }
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    const Options options = ParseOptions(argc, argv);
+    if (options.scaling) {
+      RunScaling(options);
+    } else {
+      Run(options);
+    }
+  } catch (const exception& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,119 @@
+#include "loopback_client.h"
+
+#include <charconv>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+size_t ParseNumber(string_view s) {
+  size_t value = 0;
+  from_chars(s.data(), s.data() + s.size(), value);
+  return value;
+}
+
+}
+
+string MakeRequest(string_view method, string_view target, string_view body) {
+  string request;
+  request.reserve(method.size() + target.size() + body.size() + 48);
+  request += method;
+  request += ' ';
+  request += target;
+  request += " HTTP/1.1\r\nContent-Length: ";
+  request += to_string(body.size());
+  request += "\r\n\r\n";
+  request += body;
+  return request;
+}
+
+LoopbackClient::LoopbackClient(uint16_t port)
+  : fd(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0))
+{
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    close(fd);
+    throw runtime_error("connect failed");
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+LoopbackClient::~LoopbackClient() {
+  close(fd);
+}
+
+void LoopbackClient::Send(string_view data) {
+  while (!data.empty()) {
+    ssize_t written = write(fd, data.data(), data.size());
+    if (written <= 0) {
+      throw runtime_error("write failed");
+    }
+    data.remove_prefix(written);
+  }
+}
+
+bool LoopbackClient::Receive(ClientResponse& response) {
+  // Разобранные ответы выбрасываем здесь, а не в ReadMore: ниже позиции
+  // в буфере должны оставаться верными между чтениями
+  buffer.erase(0, buffer_start);
+  buffer_start = 0;
+  size_t head_end;
+  while ((head_end = buffer.find("\r\n\r\n")) == string::npos) {
+    if (!ReadMore()) {
+      return false;
+    }
+  }
+
+  string_view head = string_view(buffer).substr(0, head_end + 2);
+  const size_t status_end = head.find("\r\n");
+  string_view status = head.substr(0, status_end);
+  status.remove_prefix(min(status.size(), status.find(' ') + 1));
+  response.code = ParseNumber(status);
+  head.remove_prefix(status_end + 2);
+
+  response.headers.clear();
+  size_t content_length = 0;
+  while (!head.empty()) {
+    const size_t line_end = head.find("\r\n");
+    const string_view line = head.substr(0, line_end);
+    head.remove_prefix(line_end + 2);
+    const size_t colon = line.find(": ");
+    const string_view name = line.substr(0, colon);
+    const string_view value = colon == string_view::npos ? "" : line.substr(colon + 2);
+    if (name == "Content-Length") {
+      content_length = ParseNumber(value);
+    } else {
+      response.headers.push_back({string(name), string(value)});
+    }
+  }
+
+  while (buffer.size() < head_end + 4 + content_length) {
+    if (!ReadMore()) {
+      return false;
+    }
+  }
+  response.content.assign(buffer, head_end + 4, content_length);
+  buffer_start = head_end + 4 + content_length;
+  return true;
+}
+
+bool LoopbackClient::ReadMore() {
+  char chunk[16 * 1024];
+  ssize_t got = read(fd, chunk, sizeof(chunk));
+  if (got <= 0) {
+    return false;
+  }
+  buffer.append(chunk, got);
+  return true;
+}
@@ -0,0 +1,104 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+
+namespace {
+
+atomic<uint64_t> next_metrics_id = 1;
+
+}
+
+uint64_t LatencyBuckets::LowerBound(size_t index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  const size_t shift = index / kSubBuckets - 1;
+  return (kSubBuckets + index % kSubBuckets) << shift;
+}
+
+RequestMetrics::ThreadCounters::ThreadCounters(size_t route_count)
+  : routes(route_count * kRouteStride)
+  , until_sample(route_count)
+{
+}
+
+RequestMetrics::RequestMetrics(vector<string> route_names)
+  : id(next_metrics_id++)
+  , route_names(move(route_names))
+  , created_ticks(CycleClock::Now())
+  , created_at(chrono::steady_clock::now())
+{
+}
+
+RequestMetrics::ThreadCounters& RequestMetrics::AttachThread() {
+  lock_guard<mutex> guard(m);
+  auto& counters = threads[this_thread::get_id()];
+  if (!counters) {
+    counters = make_unique<ThreadCounters>(route_names.size() + 1);
+  }
+  local_slot = {id, counters.get()};
+  return *counters;
+}
+
+string RequestMetrics::Report() const {
+  const size_t route_count = route_names.size() + 1;
+  vector<uint64_t> routes(route_count * kRouteStride);
+  array<uint64_t, kCodes.size()> codes = {};
+  {
+    lock_guard<mutex> guard(m);
+    for (const auto& [thread_id, counters] : threads) {
+      for (size_t i = 0; i < routes.size(); ++i) {
+        routes[i] += counters->routes[i].load(memory_order_relaxed);
+      }
+      for (size_t i = 0; i < kCodes.size(); ++i) {
+        codes[i] += counters->codes[i].load(memory_order_relaxed);
+      }
+    }
+  }
+
+  const uint64_t ticks = CycleClock::Now() - created_ticks;
+  const chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - created_at;
+  const double nanos_per_tick = ticks > 0 ? elapsed.count() / ticks : 1.0;
+
+  ostringstream os;
+  for (size_t route = 0; route < route_count; ++route) {
+    const string name = route < route_names.size() ? route_names[route] : "other";
+    const uint64_t* row = &routes[route * kRouteStride];
+    const uint64_t total = row[0];
+    os << "comment_server_requests_total{route=\"" << name << "\"} " << total << '\n';
+    if (total == 0) {
+      continue;
+    }
+    // В гистограмму попадает только часть запросов, так что доли считаем
+    // от числа замеров, а не от total
+    uint64_t sampled = 0;
+    for (size_t bucket = 0; bucket < LatencyBuckets::kCount; ++bucket) {
+      sampled += row[1 + bucket];
+    }
+    if (sampled == 0) {
+      continue;
+    }
+    for (double quantile : {0.5, 0.9, 0.99, 1.0}) {
+      // Верхняя граница корзины, до которой набралась нужная доля замеров
+      const uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(quantile * sampled + 0.5));
+      uint64_t seen = row[1];
+      size_t bucket = 0;
+      while (seen < rank && bucket + 1 < LatencyBuckets::kCount) {
+        seen += row[1 + ++bucket];
+      }
+      const uint64_t upper = bucket + 1 < LatencyBuckets::kCount
+          ? LatencyBuckets::LowerBound(bucket + 1) : LatencyBuckets::LowerBound(bucket);
+      os << "comment_server_request_latency_ns{route=\"" << name
+         << "\",quantile=\"" << quantile << "\"} "
+         << static_cast<uint64_t>(upper * nanos_per_tick + 0.5) << '\n';
+    }
+  }
+  for (size_t i = 0; i < kCodes.size(); ++i) {
+    os << "comment_server_responses_total{code=\"" << static_cast<int>(kCodes[i]) << "\"} "
+       << codes[i] << '\n';
+  }
+  return os.str();
+}
@@ -0,0 +1,141 @@
+#include "router.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+// Сравнение RouteTable с линейной цепочкой сравнений, как в прежнем
+// ServeRequest, на 5, 20 и 100 маршрутах.
+// Запуск: comment_server_v2_router_benchmark [lookups]
+
+namespace {
+
+const size_t kMaxPath = 32;
+
+// Первые маршруты -- настоящие маршруты CommentServer, остальные синтетические
+constexpr string_view kRealRoutes[][2] = {
+  {"POST", "/add_user"},
+  {"POST", "/add_comment"},
+  {"POST", "/checkcaptcha"},
+  {"GET", "/user_comments"},
+  {"GET", "/captcha"},
+};
+
+template <size_t N>
+struct PathStorage {
+  array<array<char, kMaxPath>, N> paths = {};
+  array<size_t, N> sizes = {};
+
+  constexpr PathStorage() {
+    for (size_t i = 0; i < N; ++i) {
+      const string_view prefix = "/api/resource_";
+      size_t size = 0;
+      for (char c : prefix) {
+        paths[i][size++] = c;
+      }
+      char digits[8] = {};
+      size_t digit_count = 0;
+      for (size_t value = i; digit_count == 0 || value > 0; value /= 10) {
+        digits[digit_count++] = static_cast<char>('0' + value % 10);
+      }
+      while (digit_count > 0) {
+        paths[i][size++] = digits[--digit_count];
+      }
+      sizes[i] = size;
+    }
+  }
+};
+
+template <size_t N>
+constexpr PathStorage<N> kPaths{};
+
+template <size_t N>
+constexpr array<Route<int>, N> MakeRoutes() {
+  array<Route<int>, N> routes = {};
+  for (size_t i = 0; i < N; ++i) {
+    if (i < size(kRealRoutes)) {
+      routes[i] = {kRealRoutes[i][0], kRealRoutes[i][1], static_cast<int>(i)};
+    } else {
+      routes[i] = {
+        i % 2 ? "POST" : "GET",
+        string_view(kPaths<N>.paths[i].data(), kPaths<N>.sizes[i]),
+        static_cast<int>(i)
+      };
+    }
+  }
+  return routes;
+}
+
+template <size_t N>
+constexpr array<Route<int>, N> kRoutes = MakeRoutes<N>();
+
+template <size_t N>
+constexpr RouteTable<int, N> kTable(kRoutes<N>);
+
+template <size_t N>
+const int* FindLinear(string_view method, string_view path) {
+  for (const Route<int>& route : kRoutes<N>) {
+    if (route.method == method && route.path == path) {
+      return &route.handler;
+    }
+  }
+  return nullptr;
+}
+
+template <typename Find>
+void Measure(const string& name, const vector<pair<string, string>>& requests, Find find) {
+  const auto start = steady_clock::now();
+  int64_t checksum = 0;
+  for (const auto& [method, path] : requests) {
+    const int* handler = find(method, path);
+    checksum += handler ? *handler : -1;
+  }
+  const double ns = duration<double, nano>(steady_clock::now() - start).count();
+  cout << "  " << name << ": " << ns / requests.size() << " ns/lookup"
+       << " (checksum " << checksum << ")" << endl;
+}
+
+template <size_t N>
+void BenchmarkRoutes(size_t lookups) {
+  // Запросы копируются в отдельные строки, как если бы пришли из сети;
+  // каждый десятый не соответствует ни одному маршруту
+  mt19937 gen(N);
+  uniform_int_distribution<size_t> pick(0, N - 1);
+  vector<pair<string, string>> requests;
+  requests.reserve(lookups);
+  for (size_t i = 0; i < lookups; ++i) {
+    const Route<int>& route = kRoutes<N>[pick(gen)];
+    if (i % 10 == 9) {
+      requests.emplace_back(string(route.method), string(route.path) + "_missing");
+    } else {
+      requests.emplace_back(string(route.method), string(route.path));
+    }
+  }
+
+  cout << N << " routes, " << kTable<N>.SlotCount() << " slots" << endl;
+  Measure("if-chain", requests, [](string_view method, string_view path) {
+    return FindLinear<N>(method, path);
+  });
+  Measure("route table", requests, [](string_view method, string_view path) {
+    return kTable<N>.Find(method, path);
+  });
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  const size_t lookups = argc > 1 ? stoul(argv[1]) : 2'000'000;
+  BenchmarkRoutes<5>(lookups);
+  BenchmarkRoutes<20>(lookups);
+  BenchmarkRoutes<100>(lookups);
+  return 0;
+}
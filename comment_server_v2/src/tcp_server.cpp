@@ -0,0 +1,416 @@
+#include "tcp_server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+const size_t kReadChunk = 64 * 1024;
+const size_t kMaxEvents = 256;
+const size_t kMaxIovecs = 64;
+// Пока в очереди соединения больше стольких ответов или байт, из него
+// не читаем: клиент, который шлёт запросы и не читает ответы, иначе
+// раздул бы очередь без предела
+const size_t kMaxQueuedResponses = 1024;
+const size_t kMaxQueuedBytes = 4 * 1024 * 1024;
+
+[[noreturn]] void ThrowErrno(const string& what) {
+  throw runtime_error(what + ": " + strerror(errno));
+}
+
+void AddToEpoll(int epoll_fd, int fd, uint32_t events) {
+  epoll_event event = {};
+  event.events = events;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+    ThrowErrno("epoll_ctl");
+  }
+}
+
+int Listen(const string& address, uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    ThrowErrno("socket");
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+    close(fd);
+    throw invalid_argument("Bad address " + address);
+  }
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+      || listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    ThrowErrno("bind " + address);
+  }
+  return fd;
+}
+
+uint16_t LocalPort(int fd) {
+  sockaddr_in addr = {};
+  socklen_t len = sizeof(addr);
+  getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+  return ntohs(addr.sin_port);
+}
+
+}
+
+class TcpServer::EventLoop {
+public:
+  EventLoop(const TcpServer& server, int listen_fd, int stop_fd)
+    : handler(server.handler)
+    , before_write(server.before_write)
+    , listen_fd(listen_fd)
+    , stop_fd(stop_fd)
+    , epoll_fd(epoll_create1(EPOLL_CLOEXEC))
+  {
+    if (epoll_fd < 0) {
+      close(listen_fd);
+      ThrowErrno("epoll_create");
+    }
+    AddToEpoll(epoll_fd, listen_fd, EPOLLIN | EPOLLET);
+    // Без EPOLLET: сигнал остановки должны увидеть все потоки
+    AddToEpoll(epoll_fd, stop_fd, EPOLLIN);
+  }
+
+  ~EventLoop() {
+    for (auto& [fd, conn] : connections) {
+      close(fd);
+    }
+    close(epoll_fd);
+    close(listen_fd);
+  }
+
+  void Run();
+
+private:
+  struct Outgoing {
+    HttpResponse response;
+    string head;
+    size_t written = 0;
+  };
+
+  struct Connection {
+    int fd;
+    string in;
+    HttpRequestParser parser;
+    deque<Outgoing> out;
+    // Байт в out, ещё не отправленных
+    size_t queued_bytes = 0;
+    bool close_after_write = false;
+  };
+
+  const Handler& handler;
+  const function<void()>& before_write;
+  const int listen_fd;
+  const int stop_fd;
+  const int epoll_fd;
+  unordered_map<int, unique_ptr<Connection>> connections;
+  HttpResponseSerializer serializer;
+  vector<char> scratch = vector<char>(kReadChunk);
+
+  void Accept();
+  // Возвращают false, если соединение нужно закрыть
+  bool Read(Connection& conn);
+  bool Write(Connection& conn);
+  // Разбирает запросы из conn.in, пока очередь ответов не переполнена
+  void HandleRequests(Connection& conn);
+  HttpResponse Handle(Connection& conn, const HttpRequestView& request);
+  void Enqueue(Connection& conn, HttpResponse response);
+  static bool Backlogged(const Connection& conn);
+  void Close(int fd);
+};
+
+TcpServer::TcpServer(Handler handler, TcpServerOptions options)
+  : handler(move(handler))
+  , before_write(move(options.before_write))
+{
+  stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (stop_fd < 0) {
+    ThrowErrno("eventfd");
+  }
+  port = options.port;
+  try {
+    for (size_t i = 0; i < max<size_t>(options.threads, 1); ++i) {
+      int listen_fd = Listen(options.address, port);
+      port = LocalPort(listen_fd);
+      loops.push_back(make_unique<EventLoop>(*this, listen_fd, stop_fd));
+    }
+  } catch (...) {
+    loops.clear();
+    close(stop_fd);
+    throw;
+  }
+}
+
+TcpServer::~TcpServer() {
+  loops.clear();
+  close(stop_fd);
+}
+
+void TcpServer::Run() {
+  vector<thread> workers;
+  for (size_t i = 1; i < loops.size(); ++i) {
+    workers.emplace_back([loop = loops[i].get()] { loop->Run(); });
+  }
+  loops[0]->Run();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  // Сбрасываем сигнал, чтобы сервер можно было запустить снова
+  uint64_t value;
+  [[maybe_unused]] ssize_t got = read(stop_fd, &value, sizeof(value));
+}
+
+void TcpServer::Stop() {
+  uint64_t one = 1;
+  [[maybe_unused]] ssize_t written = write(stop_fd, &one, sizeof(one));
+}
+
+void TcpServer::EventLoop::Run() {
+  epoll_event events[kMaxEvents];
+  while (true) {
+    int ready = epoll_wait(epoll_fd, events, kMaxEvents, -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ThrowErrno("epoll_wait");
+    }
+    for (int i = 0; i < ready; ++i) {
+      const int fd = events[i].data.fd;
+      if (fd == stop_fd) {
+        return;
+      }
+      if (fd == listen_fd) {
+        Accept();
+        continue;
+      }
+
+      auto it = connections.find(fd);
+      if (it == connections.end()) {
+        continue;
+      }
+      Connection& conn = *it->second;
+      bool alive = true;
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        alive = false;
+      }
+      if (alive && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+        alive = Read(conn);
+      }
+      if (alive && (events[i].events & EPOLLOUT)) {
+        const bool backlogged = Backlogged(conn);
+        alive = Write(conn);
+        // Новых событий о непрочитанных данных в режиме edge-triggered
+        // не будет, поэтому после разгрузки очереди читаем сами
+        if (alive && backlogged && !Backlogged(conn)) {
+          alive = Read(conn);
+        }
+      }
+      if (!alive) {
+        Close(fd);
+      }
+    }
+  }
+}
+
+void TcpServer::EventLoop::Accept() {
+  // В режиме edge-triggered нужно забрать все ожидающие соединения
+  while (true) {
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    auto conn = make_unique<Connection>();
+    conn->fd = fd;
+    connections[fd] = move(conn);
+    AddToEpoll(epoll_fd, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+  }
+}
+
+bool TcpServer::EventLoop::Read(Connection& conn) {
+  while (true) {
+    // Ответы, которые до этого прохода уже прошли before_write
+    const size_t ready = conn.out.size();
+    bool peer_closed = false;
+    bool paused = false;
+    // Сначала запросы, отложенные из-за переполненной очереди
+    HandleRequests(conn);
+    while (!conn.close_after_write) {
+      if (Backlogged(conn)) {
+        paused = true;
+        break;
+      }
+      // Читаем в общий буфер цикла: растить conn.in на kReadChunk заранее
+      // означало бы заполнять нулями 64 КБ на каждую попытку чтения
+      ssize_t got = read(conn.fd, scratch.data(), scratch.size());
+      if (got > 0) {
+        conn.in.append(scratch.data(), got);
+        HandleRequests(conn);
+        continue;
+      }
+      if (got == 0) {
+        peer_closed = true;
+      } else if (errno == EINTR) {
+        continue;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
+      }
+      break;
+    }
+
+    if (before_write && conn.out.size() > ready) {
+      try {
+        before_write();
+      } catch (...) {
+        // Новые ответы отправлять нельзя: вместо первого из них -- ошибка
+        while (conn.out.size() > ready) {
+          Outgoing& last = conn.out.back();
+          conn.queued_bytes -= last.head.size() + last.response.ContentSize();
+          conn.out.pop_back();
+        }
+        conn.close_after_write = true;
+        Enqueue(conn, HttpResponse(HttpCode::InternalServerError));
+      }
+    }
+    if (peer_closed) {
+      conn.close_after_write = true;
+    }
+    if (!Write(conn)) {
+      return false;
+    }
+    // Если очередь ушла сразу, EPOLLOUT не придёт: продолжаем чтение сами
+    if (!paused || Backlogged(conn)) {
+      return true;
+    }
+  }
+}
+
+void TcpServer::EventLoop::HandleRequests(Connection& conn) {
+  // Разбираем все целиком пришедшие запросы: их может быть несколько подряд
+  size_t start = 0;
+  HttpRequestView request;
+  while (!conn.close_after_write && !Backlogged(conn)) {
+    auto status = conn.parser.Parse(string_view(conn.in).substr(start), request);
+    if (status == HttpRequestParser::Status::Incomplete) {
+      break;
+    }
+    if (status == HttpRequestParser::Status::Error) {
+      conn.close_after_write = true;
+      Enqueue(conn, HttpResponse(HttpCode::BadRequest));
+      break;
+    }
+    start += conn.parser.Consumed();
+    if (!request.keep_alive) {
+      conn.close_after_write = true;
+    }
+    Enqueue(conn, Handle(conn, request));
+  }
+  conn.in.erase(0, start);
+}
+
+HttpResponse TcpServer::EventLoop::Handle(Connection& conn, const HttpRequestView& request) {
+  try {
+    return handler(request);
+  } catch (...) {
+    conn.close_after_write = true;
+    return HttpResponse(HttpCode::InternalServerError);
+  }
+}
+
+bool TcpServer::EventLoop::Backlogged(const Connection& conn) {
+  return conn.out.size() >= kMaxQueuedResponses || conn.queued_bytes >= kMaxQueuedBytes;
+}
+
+void TcpServer::EventLoop::Enqueue(Connection& conn, HttpResponse response) {
+  if (conn.close_after_write) {
+    response.AddHeader("Connection", "close");
+  }
+  conn.out.push_back({move(response), {}, 0});
+  Outgoing& outgoing = conn.out.back();
+  const vector<iovec>& fragments = serializer.Serialize(outgoing.response);
+  outgoing.head.assign(static_cast<const char*>(fragments[0].iov_base), fragments[0].iov_len);
+  conn.queued_bytes += outgoing.head.size() + outgoing.response.ContentSize();
+}
+
+bool TcpServer::EventLoop::Write(Connection& conn) {
+  while (!conn.out.empty()) {
+    // Собираем заголовки и тела нескольких ответов в один sendmsg
+    iovec iov[kMaxIovecs];
+    size_t count = 0;
+    for (auto it = conn.out.begin(); it != conn.out.end() && count < kMaxIovecs; ++it) {
+      size_t skip = it->written;
+      auto add_part = [&](string_view part) {
+        if (skip >= part.size()) {
+          skip -= part.size();
+        } else if (count < kMaxIovecs) {
+          iov[count++] = {const_cast<char*>(part.data()) + skip, part.size() - skip};
+          skip = 0;
+        }
+      };
+      add_part(it->head);
+      add_part(it->response.Content());
+      for (string_view part : it->response.ContentViews()) {
+        add_part(part);
+      }
+    }
+
+    // В отличие от writev, с MSG_NOSIGNAL ушедший клиент даёт EPIPE,
+    // а не SIGPIPE, который убил бы весь процесс
+    msghdr message = {};
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+    ssize_t written = sendmsg(conn.fd, &message, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    size_t left = written;
+    while (left > 0) {
+      Outgoing& front = conn.out.front();
+      const size_t total = front.head.size() + front.response.ContentSize();
+      const size_t step = min(left, total - front.written);
+      front.written += step;
+      conn.queued_bytes -= step;
+      left -= step;
+      if (front.written == total) {
+        conn.out.pop_front();
+      }
+    }
+  }
+  return !conn.close_after_write;
+}
+
+void TcpServer::EventLoop::Close(int fd) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  close(fd);
+  connections.erase(fd);
+}
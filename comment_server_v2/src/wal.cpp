@@ -0,0 +1,265 @@
+#include "wal.h"
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+const size_t kFrameHeaderSize = 2 * sizeof(uint32_t);
+
+array<uint32_t, 256> MakeCrcTable() {
+  array<uint32_t, 256> table;
+  for (uint32_t i = 0; i < table.size(); ++i) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; ++k) {
+      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    }
+    table[i] = c;
+  }
+  return table;
+}
+
+uint32_t Crc32(string_view data) {
+  static const array<uint32_t, 256> table = MakeCrcTable();
+  uint32_t crc = 0xFFFFFFFFu;
+  for (unsigned char c : data) {
+    crc = table[(crc ^ c) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFFu;
+}
+
+void AppendUint32(string& out, uint32_t value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+uint32_t ReadUint32(const char* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+}
+
+void SyncDirectory(const string& file_path) {
+  const size_t slash = file_path.rfind('/');
+  const string dir = slash == string::npos ? "." : file_path.substr(0, slash + 1);
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    throw runtime_error("Cannot open directory " + dir + ": " + strerror(errno));
+  }
+  const bool ok = fsync(fd) == 0;
+  const int error = errno;
+  close(fd);
+  if (!ok) {
+    throw runtime_error("Cannot sync directory " + dir + ": " + strerror(error));
+  }
+}
+
+WriteAheadLog::WriteAheadLog(const string& path, WalOptions options)
+  : path(path)
+  , options(options)
+  , fd(open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644))
+{
+  if (fd < 0) {
+    throw runtime_error("Cannot open log " + path + ": " + strerror(errno));
+  }
+  const off_t size = lseek(fd, 0, SEEK_END);
+  appended_offset = durable_offset = size > 0 ? size : 0;
+}
+
+WriteAheadLog::~WriteAheadLog() {
+  close(fd);
+}
+
+void WriteAheadLog::Replay(const function<void(string_view)>& handler) {
+  string content;
+  {
+    ifstream input(path, ios::binary);
+    content.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+  }
+
+  size_t pos = 0;
+  while (content.size() - pos >= kFrameHeaderSize) {
+    const uint32_t size = ReadUint32(content.data() + pos);
+    const uint32_t crc = ReadUint32(content.data() + pos + sizeof(uint32_t));
+    if (size > content.size() - pos - kFrameHeaderSize) {
+      break;
+    }
+    string_view payload(content.data() + pos + kFrameHeaderSize, size);
+    if (Crc32(payload) != crc) {
+      break;
+    }
+    handler(payload);
+    pos += kFrameHeaderSize + size;
+  }
+
+  // Хвост после последней целой записи остался от прерванной группы
+  if (pos != content.size()) {
+    if (ftruncate(fd, pos) != 0 || fdatasync(fd) != 0) {
+      throw runtime_error("Cannot truncate log " + path + ": " + strerror(errno));
+    }
+  }
+  lock_guard<mutex> g(m);
+  appended_offset = durable_offset = pos;
+}
+
+uint64_t WriteAheadLog::Append(string_view payload) {
+  lock_guard<mutex> g(m);
+  AppendUint32(pending, payload.size());
+  AppendUint32(pending, Crc32(payload));
+  pending.append(payload);
+  appended_offset += kFrameHeaderSize + payload.size();
+  if (pending.size() >= options.max_batch_bytes) {
+    batch_full_cv.notify_one();
+  }
+  return ++appended_lsn;
+}
+
+void WriteAheadLog::WaitDurable(uint64_t lsn) {
+  unique_lock<mutex> lock(m);
+  while (durable_lsn < lsn) {
+    if (failed) {
+      throw runtime_error("Log " + path + " is unusable after a failed write");
+    }
+    if (flushing) {
+      durable_cv.wait(lock);
+      continue;
+    }
+
+    // Становимся лидером группы: ждём попутчиков не дольше commit_delay,
+    // затем одним fdatasync сбрасываем всё накопленное
+    flushing = true;
+    if (options.commit_delay.count() > 0) {
+      batch_full_cv.wait_for(lock, options.commit_delay, [this] {
+        return pending.size() >= options.max_batch_bytes;
+      });
+    }
+    string batch;
+    batch.swap(pending);
+    const uint64_t batch_lsn = appended_lsn;
+    const uint64_t batch_offset = appended_offset;
+
+    lock.unlock();
+    bool ok = true;
+    try {
+      WriteAndSync(fd, batch);
+    } catch (...) {
+      ok = false;
+    }
+    lock.lock();
+
+    flushing = false;
+    if (ok) {
+      durable_lsn = max(durable_lsn, batch_lsn);
+      durable_offset = batch_offset;
+      ++sync_count;
+    } else {
+      failed = true;
+    }
+    durable_cv.notify_all();
+  }
+}
+
+void WriteAheadLog::DiscardBefore(LogPosition position) {
+  // Переписываем только то, что уже в файле, поэтому сначала дожидаемся,
+  // пока туда попадёт и сама position
+  WaitDurable(position.lsn);
+  unique_lock<mutex> lock(m);
+  durable_cv.wait(lock, [this] { return !flushing; });
+  if (failed) {
+    throw runtime_error("Log " + path + " is unusable after a failed write");
+  }
+  if (position.offset <= file_start) {
+    return;
+  }
+  // Пока флаг поднят, лидеры групп не пишут в файл, так что его содержимое
+  // неизменно; новые записи копятся в pending
+  flushing = true;
+  const uint64_t tail_begin = position.offset - file_start;
+  const uint64_t tail_end = durable_offset - file_start;
+  lock.unlock();
+
+  int new_fd = -1;
+  bool renamed = false;
+  try {
+    string tail(tail_end - tail_begin, '\0');
+    {
+      ifstream input(path, ios::binary);
+      input.seekg(tail_begin);
+      if (!input.read(tail.data(), tail.size())) {
+        throw runtime_error("Cannot read log " + path);
+      }
+    }
+    const string tmp_path = path + ".tmp";
+    new_fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (new_fd < 0) {
+      throw runtime_error("Cannot create log " + tmp_path + ": " + strerror(errno));
+    }
+    WriteAndSync(new_fd, tail);
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+      throw runtime_error("Cannot rename log " + tmp_path + ": " + strerror(errno));
+    }
+    renamed = true;
+    // Новые группы пойдут только в новый файл, поэтому его имя должно
+    // оказаться на диске раньше, чем первая из них
+    SyncDirectory(path);
+  } catch (...) {
+    if (new_fd >= 0) {
+      close(new_fd);
+    }
+    lock.lock();
+    flushing = false;
+    // Старый файл уже не виден по пути, а новый может пропасть при сбое:
+    // подтверждать записи больше нельзя
+    if (renamed) {
+      failed = true;
+    }
+    durable_cv.notify_all();
+    throw;
+  }
+
+  lock.lock();
+  close(fd);
+  fd = new_fd;
+  file_start = position.offset;
+  flushing = false;
+  durable_cv.notify_all();
+}
+
+LogPosition WriteAheadLog::AppendedPosition() const {
+  lock_guard<mutex> g(m);
+  return {appended_lsn, appended_offset};
+}
+
+uint64_t WriteAheadLog::SyncCount() const {
+  lock_guard<mutex> g(m);
+  return sync_count;
+}
+
+void WriteAheadLog::WriteAndSync(int target, const string& batch) {
+  const char* data = batch.data();
+  size_t left = batch.size();
+  while (left > 0) {
+    ssize_t written = write(target, data, left);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw runtime_error("Cannot write log " + path + ": " + strerror(errno));
+    }
+    data += written;
+    left -= written;
+  }
+  if (fdatasync(target) != 0) {
+    throw runtime_error("Cannot sync log " + path + ": " + strerror(errno));
+  }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// Буферизованная запись в файловый дескриптор из фонового потока. Данные
+// копируются в один из двух выровненных по странице буферов; заполненный
+// буфер отдаётся фоновому потоку, а запись продолжается во второй. Писатель
+// ждёт, только когда заняты оба буфера. Дескриптором класс не владеет.
+class AsyncFdWriter {
+public:
+  static constexpr size_t kDefaultBufferSize = 1 << 20;
+
+  explicit AsyncFdWriter(int fd, size_t buffer_size = kDefaultBufferSize);
+  AsyncFdWriter(const AsyncFdWriter&) = delete;
+  AsyncFdWriter& operator=(const AsyncFdWriter&) = delete;
+  // дописывает оставшееся, ошибки записи при этом теряются
+  ~AsyncFdWriter();
+
+  // Ошибку записи из фонового потока бросает следующий Append или Flush
+  void Append(std::string_view data) {
+    if (data.size() < buffer_size - filled) {
+      std::memcpy(filling + filled, data.data(), data.size());
+      filled += data.size();
+    } else {
+      AppendSlow(data);
+    }
+  }
+  // Отдаёт на запись текущий буфер и дожидается, пока всё будет записано
+  void Flush();
+
+  size_t BytesWritten() const;
+
+private:
+  const int fd;
+  const size_t buffer_size;
+  // filling заполняет писатель, writing пишет фоновый поток
+  char* filling;
+  char* writing;
+  size_t filled = 0;
+
+  mutable std::mutex m;
+  std::condition_variable submitted;
+  std::condition_variable written;
+  size_t pending = 0;
+  bool busy = false;
+  bool stopping = false;
+  std::string error;
+  size_t bytes_written = 0;
+  std::thread writer;
+
+  // дописывает data, отдавая на запись заполнившиеся буферы
+  void AppendSlow(std::string_view data);
+  void Submit();
+  void WaitIdle(std::unique_lock<std::mutex>& lock);
+  void ThrowIfFailed() const;
+  void WriterLoop();
+};
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "shared_text.h"
+
+#include <string>
+
+// from и body неизменяемы и разделяются между копиями письма:
+// своё у каждой копии только поле to
+struct Email {
+  SharedText from;
+  std::string to = "";
+  SharedText body;
+};
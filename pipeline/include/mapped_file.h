@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Файл, целиком отображённый в память только для чтения. Ядру сообщается,
+// что файл будут читать последовательно, чтобы оно заранее подкачивало
+// страницы.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& path);
+  MappedFile(MappedFile&& other);
+  MappedFile& operator=(MappedFile&& other);
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+
+  const char* Data() const {
+    return data;
+  }
+  size_t Size() const {
+    return size;
+  }
+  std::string_view View() const {
+    return {data, size};
+  }
+
+private:
+  const char* data = nullptr;
+  size_t size = 0;
+
+  void Release();
+};
@@ -0,0 +1,212 @@
+#pragma once
+
+#include "email.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+enum class EmailField : uint8_t {
+  From,
+  To,
+  Body,
+};
+
+template <EmailField F>
+std::string_view FieldOf(const Email& email) {
+  if constexpr (F == EmailField::From) {
+    return email.from;
+  } else if constexpr (F == EmailField::To) {
+    return email.to;
+  } else {
+    return email.body;
+  }
+}
+
+std::string_view FieldOf(const Email& email, EmailField field);
+
+// Поиск подстроки. На x86 строка просматривается по 16 байт через SSE2:
+// сравниваются сразу первый и последний символы образца во всех позициях
+// блока, и только совпавшие позиции проверяются целиком.
+class SubstringFinder {
+public:
+  explicit SubstringFinder(std::string needle) : needle(std::move(needle)) {
+  }
+
+  bool In(std::string_view haystack) const;
+
+  const std::string& Needle() const {
+    return needle;
+  }
+
+private:
+  std::string needle;
+};
+
+// Предикаты-выражения, которые собираются во время компиляции и вызываются
+// без стирания типа:
+//
+//   using namespace Match;
+//   builder.FilterBy(From == "erich@example.com" && !Body.Contains("spam"));
+namespace Match {
+
+// Общая база выражений: по ней операторы &&, || и ! узнают своих
+template <typename Derived>
+struct Expr {
+};
+
+template <EmailField F>
+struct FieldEquals : Expr<FieldEquals<F>> {
+  std::string value;
+
+  explicit FieldEquals(std::string value) : value(std::move(value)) {
+  }
+  bool operator()(const Email& email) const {
+    return FieldOf<F>(email) == value;
+  }
+};
+
+template <EmailField F>
+struct FieldStartsWith : Expr<FieldStartsWith<F>> {
+  std::string prefix;
+
+  explicit FieldStartsWith(std::string prefix) : prefix(std::move(prefix)) {
+  }
+  bool operator()(const Email& email) const {
+    return FieldOf<F>(email).substr(0, prefix.size()) == prefix;
+  }
+};
+
+template <EmailField F>
+struct FieldContains : Expr<FieldContains<F>> {
+  SubstringFinder finder;
+
+  explicit FieldContains(std::string needle) : finder(std::move(needle)) {
+  }
+  bool operator()(const Email& email) const {
+    return finder.In(FieldOf<F>(email));
+  }
+};
+
+template <typename L, typename R>
+struct And : Expr<And<L, R>> {
+  L lhs;
+  R rhs;
+
+  And(L lhs, R rhs) : lhs(std::move(lhs)), rhs(std::move(rhs)) {
+  }
+  bool operator()(const Email& email) const {
+    return lhs(email) && rhs(email);
+  }
+};
+
+template <typename L, typename R>
+struct Or : Expr<Or<L, R>> {
+  L lhs;
+  R rhs;
+
+  Or(L lhs, R rhs) : lhs(std::move(lhs)), rhs(std::move(rhs)) {
+  }
+  bool operator()(const Email& email) const {
+    return lhs(email) || rhs(email);
+  }
+};
+
+template <typename E>
+struct Not : Expr<Not<E>> {
+  E operand;
+
+  explicit Not(E operand) : operand(std::move(operand)) {
+  }
+  bool operator()(const Email& email) const {
+    return !operand(email);
+  }
+};
+
+template <typename L, typename R>
+And<L, R> operator&&(const Expr<L>& lhs, const Expr<R>& rhs) {
+  return And<L, R>(static_cast<const L&>(lhs), static_cast<const R&>(rhs));
+}
+
+template <typename L, typename R>
+Or<L, R> operator||(const Expr<L>& lhs, const Expr<R>& rhs) {
+  return Or<L, R>(static_cast<const L&>(lhs), static_cast<const R&>(rhs));
+}
+
+template <typename E>
+Not<E> operator!(const Expr<E>& operand) {
+  return Not<E>(static_cast<const E&>(operand));
+}
+
+template <EmailField F>
+struct Field {
+  FieldEquals<F> operator==(std::string value) const {
+    return FieldEquals<F>(std::move(value));
+  }
+  FieldStartsWith<F> StartsWith(std::string prefix) const {
+    return FieldStartsWith<F>(std::move(prefix));
+  }
+  FieldContains<F> Contains(std::string needle) const {
+    return FieldContains<F>(std::move(needle));
+  }
+};
+
+inline constexpr Field<EmailField::From> From;
+inline constexpr Field<EmailField::To> To;
+inline constexpr Field<EmailField::Body> Body;
+
+}
+
+template <typename T>
+inline constexpr bool kIsMatchExpr = std::is_base_of_v<Match::Expr<T>, T>;
+
+// Правило фильтрации, разобранное во время работы и скомпилированное
+// в байткод с одним булевым регистром. && и || компилируются в условные
+// переходы, так что вычисление, как и в C++, сокращённое.
+//
+// Грамматика:
+//   expr  := and ("||" and)*
+//   and   := unary ("&&" unary)*
+//   unary := "!" unary | "(" expr ")" | test
+//   test  := field ("==" | "starts_with" | "contains") string
+//   field := "from" | "to" | "body"
+//
+// Строки пишутся в двойных кавычках, внутри допустимы \" и \\.
+class CompiledPredicate {
+public:
+  // Бросает invalid_argument, если правило не соответствует грамматике
+  static CompiledPredicate Compile(std::string_view rule);
+
+  bool operator()(const Email& email) const;
+
+  size_t CodeSize() const {
+    return code.size();
+  }
+
+private:
+  enum class Op : uint8_t {
+    Equals,
+    StartsWith,
+    Contains,
+    Not,
+    JumpIfFalse,
+    JumpIfTrue,
+  };
+
+  // arg -- номер строки для Equals и StartsWith, номер SubstringFinder
+  // для Contains, адрес перехода для Jump*
+  struct Instruction {
+    Op op;
+    EmailField field;
+    uint32_t arg;
+  };
+
+  class Compiler;
+
+  std::vector<Instruction> code;
+  std::vector<std::string> strings;
+  std::vector<SubstringFinder> finders;
+};
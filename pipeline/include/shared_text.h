@@ -0,0 +1,61 @@
+#pragma once
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+// Неизменяемый кусок текста с подсчётом ссылок. Копия разделяет буфер
+// с оригиналом, поэтому копирование стоит одного атомарного инкремента.
+// Несколько кусков могут указывать в один буфер.
+class SharedText {
+public:
+  SharedText() = default;
+
+  SharedText(std::string text)
+    : owner(std::make_shared<const std::string>(std::move(text)))
+    , view(*owner)
+  {
+  }
+
+  // view должен указывать внутрь *owner
+  SharedText(std::shared_ptr<const std::string> owner, std::string_view view)
+    : owner(std::move(owner))
+    , view(view)
+  {
+  }
+
+  // Кусок чужой памяти без подсчёта ссылок: она должна пережить все копии
+  static SharedText Borrow(std::string_view view) {
+    return SharedText(nullptr, view);
+  }
+
+  std::string_view View() const {
+    return view;
+  }
+
+  operator std::string_view() const {
+    return view;
+  }
+
+  // Сколько кусков разделяют буфер
+  long UseCount() const {
+    return owner.use_count();
+  }
+
+  friend bool operator==(const SharedText& lhs, std::string_view rhs) {
+    return lhs.view == rhs;
+  }
+
+  friend bool operator!=(const SharedText& lhs, std::string_view rhs) {
+    return lhs.view != rhs;
+  }
+
+  friend std::ostream& operator<<(std::ostream& output, const SharedText& text) {
+    return output << text.view;
+  }
+
+private:
+  std::shared_ptr<const std::string> owner;
+  std::string_view view;
+};
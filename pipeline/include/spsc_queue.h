@@ -0,0 +1,157 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+
+// Ограниченная очередь без блокировок для одного писателя и одного читателя.
+// Кольцевой буфер размером в степень двойки; индексы растут монотонно,
+// каждая сторона кэширует чужой индекс и перечитывает его, только когда
+// по кэшу очередь кажется полной (пустой). Блокирующие Push и Pop сначала
+// крутятся, а потом засыпают, пока другая сторона их не разбудит.
+template <typename T>
+class SpscQueue {
+public:
+  explicit SpscQueue(size_t capacity)
+    : mask(RoundUp(capacity) - 1)
+    , slots(std::make_unique<std::optional<T>[]>(mask + 1))
+  {
+  }
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  size_t Capacity() const {
+    return mask + 1;
+  }
+
+  // Вызывает только писатель. false, если очередь полна
+  bool TryPush(T& value) {
+    const size_t tail = producer.index.load(std::memory_order_relaxed);
+    if (tail - producer.cached_other > mask) {
+      producer.cached_other = consumer.index.load(std::memory_order_acquire);
+      if (tail - producer.cached_other > mask) {
+        return false;
+      }
+    }
+    slots[tail & mask].emplace(std::move(value));
+    producer.index.store(tail + 1, std::memory_order_release);
+    consumer_parking.Wake();
+    return true;
+  }
+
+  // Вызывает только читатель. nullopt, если очередь пуста
+  std::optional<T> TryPop() {
+    const size_t head = consumer.index.load(std::memory_order_relaxed);
+    if (head == consumer.cached_other) {
+      consumer.cached_other = producer.index.load(std::memory_order_acquire);
+      if (head == consumer.cached_other) {
+        return std::nullopt;
+      }
+    }
+    std::optional<T>& slot = slots[head & mask];
+    std::optional<T> value = std::move(slot);
+    slot.reset();
+    consumer.index.store(head + 1, std::memory_order_release);
+    producer_parking.Wake();
+    return value;
+  }
+
+  // Блокирующие варианты: недолго крутятся, уступая процессор, а затем
+  // спят, чтобы ожидание медленной стороны не занимало ядро
+  void Push(T value) {
+    for (size_t attempt = 0; !TryPush(value); ++attempt) {
+      if (attempt < kSpinAttempts) {
+        Backoff(attempt);
+      } else {
+        producer_parking.Wait([this] {
+          return producer.index.load(std::memory_order_relaxed)
+               - consumer.index.load(std::memory_order_acquire) <= mask;
+        });
+      }
+    }
+  }
+
+  T Pop() {
+    for (size_t attempt = 0; ; ++attempt) {
+      if (auto value = TryPop()) {
+        return std::move(*value);
+      }
+      if (attempt < kSpinAttempts) {
+        Backoff(attempt);
+      } else {
+        consumer_parking.Wait([this] {
+          return producer.index.load(std::memory_order_acquire)
+               != consumer.index.load(std::memory_order_relaxed);
+        });
+      }
+    }
+  }
+
+private:
+  static size_t RoundUp(size_t capacity) {
+    size_t result = 2;
+    while (result < capacity) {
+      result *= 2;
+    }
+    return result;
+  }
+
+  static constexpr size_t kSpinAttempts = 128;
+
+  static void Backoff(size_t attempt) {
+    if (attempt > 64) {
+      std::this_thread::yield();
+    }
+  }
+
+  // Место, где засыпает одна сторона. Спящий поднимает флаг и перепроверяет
+  // условие, а будящий сдвигает индекс и проверяет флаг; барьеры между
+  // записью и чтением в обоих потоках гарантируют, что хотя бы один из них
+  // увидит изменение другого, так что пробуждение не теряется.
+  struct alignas(64) Parking {
+    std::mutex m;
+    std::condition_variable cv;
+    std::atomic<bool> sleeping = false;
+
+    template <typename Ready>
+    void Wait(Ready ready) {
+      std::unique_lock<std::mutex> lock(m);
+      sleeping.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      cv.wait(lock, ready);
+      sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    // Дёшево, пока никто не спит: барьер и чтение флага
+    void Wake() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (sleeping.load(std::memory_order_relaxed)) {
+        // Спящий держит мьютекс от подъёма флага до засыпания
+        std::lock_guard<std::mutex> guard(m);
+        cv.notify_one();
+      }
+    }
+  };
+
+  // Индекс стороны и её копия индекса другой стороны лежат в своей линии
+  // кэша, чтобы писатель и читатель не мешали друг другу
+  struct alignas(64) Side {
+    std::atomic<size_t> index = 0;
+    size_t cached_other = 0;
+  };
+
+  const size_t mask;
+  std::unique_ptr<std::optional<T>[]> slots;
+  Side producer;
+  Side consumer;
+  // Здесь ждёт читатель пустой очереди, его будит писатель
+  Parking consumer_parking;
+  // Здесь ждёт писатель полной очереди, его будит читатель
+  Parking producer_parking;
+};
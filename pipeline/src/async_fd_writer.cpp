@@ -0,0 +1,134 @@
+#include "async_fd_writer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+const size_t kAlignment = 4096;
+
+char* AllocateBuffer(size_t size) {
+  // aligned_alloc требует размер, кратный выравниванию
+  const size_t rounded = (size + kAlignment - 1) / kAlignment * kAlignment;
+  void* buffer = aligned_alloc(kAlignment, rounded);
+  if (!buffer) {
+    throw bad_alloc();
+  }
+  return static_cast<char*>(buffer);
+}
+
+}
+
+AsyncFdWriter::AsyncFdWriter(int fd, size_t buffer_size)
+  : fd(fd)
+  , buffer_size(max<size_t>(buffer_size, 1))
+  , filling(AllocateBuffer(this->buffer_size))
+  , writing(AllocateBuffer(this->buffer_size))
+  , writer([this] { WriterLoop(); })
+{
+}
+
+AsyncFdWriter::~AsyncFdWriter() {
+  try {
+    Flush();
+  } catch (...) {
+  }
+  {
+    lock_guard lock(m);
+    stopping = true;
+  }
+  submitted.notify_one();
+  writer.join();
+  free(filling);
+  free(writing);
+}
+
+void AsyncFdWriter::AppendSlow(string_view data) {
+  while (!data.empty()) {
+    const size_t chunk = min(data.size(), buffer_size - filled);
+    memcpy(filling + filled, data.data(), chunk);
+    filled += chunk;
+    data.remove_prefix(chunk);
+    if (filled == buffer_size) {
+      Submit();
+    }
+  }
+}
+
+void AsyncFdWriter::Flush() {
+  if (filled > 0) {
+    Submit();
+  }
+  unique_lock lock(m);
+  WaitIdle(lock);
+  ThrowIfFailed();
+}
+
+size_t AsyncFdWriter::BytesWritten() const {
+  lock_guard lock(m);
+  return bytes_written;
+}
+
+void AsyncFdWriter::Submit() {
+  unique_lock lock(m);
+  WaitIdle(lock);
+  ThrowIfFailed();
+  swap(filling, writing);
+  pending = filled;
+  filled = 0;
+  busy = true;
+  submitted.notify_one();
+}
+
+void AsyncFdWriter::WaitIdle(unique_lock<mutex>& lock) {
+  written.wait(lock, [this] { return !busy; });
+}
+
+void AsyncFdWriter::ThrowIfFailed() const {
+  if (!error.empty()) {
+    throw runtime_error(error);
+  }
+}
+
+void AsyncFdWriter::WriterLoop() {
+  unique_lock lock(m);
+  while (true) {
+    submitted.wait(lock, [this] { return busy || stopping; });
+    if (!busy) {
+      return;
+    }
+    // буфер writing до конца записи принадлежит этому потоку
+    const char* data = writing;
+    size_t size = pending;
+    const bool failed = !error.empty();
+    lock.unlock();
+    string write_error;
+    size_t done = 0;
+    while (!failed && done < size) {
+      const ssize_t n = write(fd, data + done, size - done);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        write_error = string("Cannot write to fd ") + to_string(fd) + ": " + strerror(errno);
+        break;
+      }
+      done += n;
+    }
+    lock.lock();
+    bytes_written += done;
+    if (!write_error.empty()) {
+      error = move(write_error);
+    }
+    busy = false;
+    written.notify_all();
+  }
+}
@@ -0,0 +1,65 @@
+#include "mapped_file.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+MappedFile::MappedFile(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw runtime_error("Cannot stat " + path + ": " + strerror(errno));
+  }
+  size = st.st_size;
+  if (size > 0) {
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      close(fd);
+      throw runtime_error("Cannot mmap " + path + ": " + strerror(errno));
+    }
+    madvise(addr, size, MADV_SEQUENTIAL);
+    data = static_cast<const char*>(addr);
+  }
+  close(fd);
+}
+
+MappedFile::MappedFile(MappedFile&& other)
+  : data(other.data)
+  , size(other.size)
+{
+  other.data = nullptr;
+  other.size = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) {
+  if (this != &other) {
+    Release();
+    swap(data, other.data);
+    swap(size, other.size);
+  }
+  return *this;
+}
+
+MappedFile::~MappedFile() {
+  Release();
+}
+
+void MappedFile::Release() {
+  if (data) {
+    munmap(const_cast<char*>(data), size);
+    data = nullptr;
+    size = 0;
+  }
+}
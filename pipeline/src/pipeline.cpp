@@ -1,29 +1,113 @@
 #include "test_runner.h"
+#include "async_fd_writer.h"
+#include "email.h"
+#include "mapped_file.h"
+#include "predicate.h"
+#include "spsc_queue.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <fstream>
 #include <functional>
+#include <iomanip>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 using namespace std;
 
 
-struct Email {
-  string from = "";
-  string to = "";
-  string body = "";
+// Пул писем. Отработавшие письма возвращаются сюда вместо освобождения,
+// и новые берутся отсюда вместе с уже выделенной под to памятью. Пул
+// разделяют обработчики из разных потоков, поэтому письма берутся
+// и возвращаются сразу пачками под одной блокировкой.
+class EmailPool {
+public:
+  static constexpr size_t kDefaultMaxFree = 16 * 1024;
+
+  explicit EmailPool(size_t max_free = kDefaultMaxFree) : max_free(max_free) {
+  }
+
+  // дописывает в batch count пустых писем
+  void Acquire(vector<unique_ptr<Email>>& batch, size_t count) {
+    {
+      lock_guard lock(m);
+      const size_t reused = min(count, free.size());
+      move(free.end() - reused, free.end(), back_inserter(batch));
+      free.resize(free.size() - reused);
+      count -= reused;
+    }
+    allocated += count;
+    for (; count > 0; --count) {
+      batch.push_back(make_unique<Email>());
+    }
+  }
+
+  // забирает письма batch[from..], лишние сверх max_free освобождаются
+  void Release(vector<unique_ptr<Email>>& batch, size_t from = 0) {
+    for (auto it = batch.begin() + from; it != batch.end(); ++it) {
+      Email& email = **it;
+      email.from = {};
+      email.to.clear();
+      email.body = {};
+    }
+    {
+      lock_guard lock(m);
+      const size_t kept = min(batch.size() - from, max_free - min(max_free, free.size()));
+      move(batch.begin() + from, batch.begin() + from + kept, back_inserter(free));
+    }
+    batch.resize(from);
+  }
+
+  // сколько писем пул выделил за всё время
+  size_t Allocated() const {
+    return allocated;
+  }
+
+private:
+  const size_t max_free;
+  mutex m;
+  vector<unique_ptr<Email>> free;
+  atomic<size_t> allocated = 0;
 };
 
 
 class Worker {
 public:
+  using Batch = vector<unique_ptr<Email>>;
+
   virtual ~Worker() = default;
   virtual void Process(unique_ptr<Email> email) = 0;
+  // обрабатывает пачку писем за один вызов; после вызова пачка пуста и её
+  // можно переиспользовать. По умолчанию письма идут по одному в Process
+  virtual void ProcessBatch(Batch& batch) {
+    for (unique_ptr<Email>& email : batch) {
+      Process(move(email));
+    }
+    batch.clear();
+  }
   virtual void Run() {
     // только первому worker-у в пайплайне нужно это имплементировать
     throw logic_error("Unimplemented");
   }
+  // конец потока писем: обработчики, которые что-то копят или работают
+  // в своём потоке, переопределяют его и в конце передают сигнал дальше
+  virtual void Finish() {
+    FinishNext();
+  }
 
 protected:
   // реализации должны вызывать PassOn, чтобы передать объект дальше
@@ -33,6 +117,17 @@ protected:
       next_->Process(move(email));
     }
   }
+  void PassOnBatch(Batch& batch) const {
+    if (next_ && !batch.empty()) {
+      next_->ProcessBatch(batch);
+    }
+    batch.clear();
+  }
+  void FinishNext() const {
+    if (next_) {
+      next_->Finish();
+    }
+  }
   unique_ptr<Worker> next_;
 
 public:
@@ -49,81 +144,540 @@ public:
 
 class Reader : public Worker {
 public:
-  Reader (istream& is) : is_(is)
+  // столько писем Reader передаёт дальше одной пачкой
+  static constexpr size_t kBatchSize = 256;
+
+  Reader (istream& is, shared_ptr<EmailPool> pool = nullptr)
+    : is_(is)
+    , pool(pool ? move(pool) : make_shared<EmailPool>())
   {
   }
   virtual void Process(unique_ptr<Email> email) override {
   }
 
   virtual void Run() override {
-    string s;
+    Batch batch;
+    batch.reserve(kBatchSize);
+    string from, body;
     while(true) {
-      unique_ptr<Email> email = make_unique<Email>();
-      getline(is_, email->from);
-      getline(is_, email->to);
-      getline(is_, email->body);
-      if (is_)
-        PassOn(move(email));
-      else
-        return;
+      pool->Acquire(batch, kBatchSize);
+      size_t filled = 0;
+      for (; filled < kBatchSize; ++filled) {
+        Email& email = *batch[filled];
+        if (!getline(is_, from) || !getline(is_, email.to) || !getline(is_, body))
+          break;
+        // from и body письма лежат в одном буфере
+        auto text = make_shared<string>();
+        text->reserve(from.size() + body.size());
+        *text += from;
+        *text += body;
+        const string_view view = *text;
+        email.from = SharedText(text, view.substr(0, from.size()));
+        email.body = SharedText(text, view.substr(from.size()));
+      }
+      if (filled < kBatchSize) {
+        pool->Release(batch, filled);
+        PassOnBatch(batch);
+        break;
+      }
+      PassOnBatch(batch);
     }
+    Finish();
   }
 
 private:
   istream& is_;
+  shared_ptr<EmailPool> pool;
 };
 
 
-class Filter : public Worker {
+// Reader, отображающий файл в память. Записи разбиваются на строки через
+// memchr, а from и body писем указывают прямо в отображение -- без копий
+// и подсчёта ссылок. Отображение живёт, пока жив сам MappedReader, а Run
+// возвращается, только когда вся цепочка отработала, поэтому обработчикам
+// указатели в файл остаются действительными.
+class MappedReader : public Worker {
 public:
-  using Function = function<bool(const Email&)>;
+  static constexpr size_t kBatchSize = Reader::kBatchSize;
 
+  explicit MappedReader(const string& path, shared_ptr<EmailPool> pool = nullptr)
+    : file(path)
+    , pool(pool ? move(pool) : make_shared<EmailPool>())
+  {
+  }
+
+  // потоки остатка цепочки ещё могут читать отображение: сначала
+  // разрушаем цепочку, дожидаясь их, и только потом снимаем отображение
+  ~MappedReader() override {
+    next_.reset();
+  }
+
+  virtual void Process(unique_ptr<Email> email) override {
+  }
+
+  virtual void Run() override {
+    string_view rest = file.View();
+    Batch batch;
+    batch.reserve(kBatchSize);
+    for (bool done = false; !done; ) {
+      pool->Acquire(batch, kBatchSize);
+      size_t filled = 0;
+      for (string_view from, to, body; filled < kBatchSize; ++filled) {
+        if (!NextLine(rest, from) || !NextLine(rest, to) || !NextLine(rest, body)) {
+          done = true;
+          break;
+        }
+        Email& email = *batch[filled];
+        email.from = SharedText::Borrow(from);
+        email.to.assign(to.data(), to.size());
+        email.body = SharedText::Borrow(body);
+      }
+      pool->Release(batch, filled);
+      PassOnBatch(batch);
+    }
+    Finish();
+  }
+
+private:
+  // отрезает от rest строку без перевода строки; как и у getline,
+  // последняя строка файла может им не заканчиваться
+  static bool NextLine(string_view& rest, string_view& line) {
+    if (rest.empty()) {
+      return false;
+    }
+    const void* lf = memchr(rest.data(), '\n', rest.size());
+    const size_t length = lf ? static_cast<const char*>(lf) - rest.data() : rest.size();
+    line = rest.substr(0, length);
+    rest.remove_prefix(lf ? length + 1 : length);
+    return true;
+  }
+
+  MappedFile file;
+  shared_ptr<EmailPool> pool;
+};
+
+
+// Пропускает письма, на которых предикат истинен. Тип предиката известен
+// при компиляции, так что выражения из Match вызываются без косвенности
+template <typename Predicate>
+class PredicateFilter : public Worker {
 public:
-  Filter(Function pred) : pred(pred) {}
+  PredicateFilter(Predicate pred) : pred(move(pred)) {}
 
   virtual void Process(unique_ptr<Email> email) override {
     if (pred(*email.get())) {
       PassOn(move(email));
     }
   }
+
+  // прошедшие фильтр письма сдвигаются к началу пачки
+  virtual void ProcessBatch(Batch& batch) override {
+    auto kept = batch.begin();
+    for (unique_ptr<Email>& email : batch) {
+      if (pred(*email)) {
+        *kept++ = move(email);
+      }
+    }
+    batch.erase(kept, batch.end());
+    PassOnBatch(batch);
+  }
 private:
-  Function pred;
+  Predicate pred;
+};
+
+
+class Filter : public PredicateFilter<function<bool(const Email&)>> {
+public:
+  using Function = function<bool(const Email&)>;
+
+public:
+  using PredicateFilter::PredicateFilter;
 };
 
 
 class Copier : public Worker {
 public:
-  Copier (string to) : to(move(to)) {}
+  Copier (string to, shared_ptr<EmailPool> pool = nullptr)
+    : to(move(to))
+    , pool(pool ? move(pool) : make_shared<EmailPool>())
+  {
+  }
 
   virtual void Process(unique_ptr<Email> email) override {
     if (email->to == to) {
       PassOn(move(email));
     }
     else {
-      unique_ptr<Email> copy = make_unique<Email>(*email);
-      copy->to = to;
+      pool->Acquire(spares, 1);
+      unique_ptr<Email> copy = MakeCopy(*email);
       PassOn(move(email));
       PassOn(move(copy));
     }
   }
+
+  // пачка расширяется на месте: копии дописываются в конец, а письма
+  // сдвигаются с конца к началу так, что каждая копия встаёт сразу за
+  // оригиналом, как и при обработке по одному
+  virtual void ProcessBatch(Batch& batch) override {
+    size_t copies = 0;
+    for (const unique_ptr<Email>& email : batch) {
+      copies += email->to != to;
+    }
+    pool->Acquire(spares, copies);
+    size_t src = batch.size();
+    size_t dst = src + copies;
+    batch.resize(dst);
+    while (src != dst) {
+      unique_ptr<Email>& email = batch[--src];
+      if (email->to != to) {
+        batch[--dst] = MakeCopy(*email);
+      }
+      batch[--dst] = move(email);
+    }
+    PassOnBatch(batch);
+  }
 private:
+  // копия берёт из spares письмо пула и разделяет с оригиналом from и body
+  unique_ptr<Email> MakeCopy(const Email& email) {
+    unique_ptr<Email> copy = move(spares.back());
+    spares.pop_back();
+    copy->from = email.from;
+    copy->to = to;
+    copy->body = email.body;
+    return copy;
+  }
+
   string to;
+  shared_ptr<EmailPool> pool;
+  Batch spares;
 };
 
 
 class Sender : public Worker {
 public:
-  Sender (ostream& out) : out(out) {}
+  // с пулом письма после отправки возвращаются в него, если Sender
+  // последний в цепочке
+  Sender (ostream& out, shared_ptr<EmailPool> pool = nullptr) : out(out), pool(move(pool)) {}
 
   virtual void Process(unique_ptr<Email> email) override {
     out << email->from << '\n'
         << email->to   << '\n'
         << email->body << '\n';
-    PassOn(move(email));
+    if (pool && !next_) {
+      sent.push_back(move(email));
+      pool->Release(sent);
+    } else {
+      PassOn(move(email));
+    }
+  }
+
+  // вся пачка собирается в буфер и пишется в поток одним вызовом
+  virtual void ProcessBatch(Batch& batch) override {
+    buffer.clear();
+    for (const unique_ptr<Email>& email : batch) {
+      buffer += email->from;
+      buffer += '\n';
+      buffer += email->to;
+      buffer += '\n';
+      buffer += email->body;
+      buffer += '\n';
+    }
+    out.write(buffer.data(), buffer.size());
+    if (pool && !next_) {
+      pool->Release(batch);
+    } else {
+      PassOnBatch(batch);
+    }
   }
 
 private:
   ostream& out;
+  shared_ptr<EmailPool> pool;
+  string buffer;
+  Batch sent;
+};
+
+
+// Sender, который пишет в файловый дескриптор через AsyncFdWriter: письма
+// форматируются в потоке цепочки, а write выполняет фоновый поток. Finish
+// дожидается, пока всё будет записано, и бросает ошибку записи
+class FdSender : public Worker {
+public:
+  FdSender(int fd, size_t buffer_size = AsyncFdWriter::kDefaultBufferSize, shared_ptr<EmailPool> pool = nullptr)
+    : writer(fd, buffer_size)
+    , pool(move(pool))
+  {
+  }
+
+  virtual void Process(unique_ptr<Email> email) override {
+    Write(*email);
+    if (pool && !next_) {
+      sent.push_back(move(email));
+      pool->Release(sent);
+    } else {
+      PassOn(move(email));
+    }
+  }
+
+  virtual void ProcessBatch(Batch& batch) override {
+    for (const unique_ptr<Email>& email : batch) {
+      Write(*email);
+    }
+    if (pool && !next_) {
+      pool->Release(batch);
+    } else {
+      PassOnBatch(batch);
+    }
+  }
+
+  virtual void Finish() override {
+    writer.Flush();
+    FinishNext();
+  }
+
+private:
+  void Write(const Email& email) {
+    writer.Append(email.from);
+    writer.Append("\n");
+    writer.Append(email.to);
+    writer.Append("\n");
+    writer.Append(email.body);
+    writer.Append("\n");
+  }
+
+  AsyncFdWriter writer;
+  shared_ptr<EmailPool> pool;
+  Batch sent;
+};
+
+
+// Граница потоков: пачки писем складываются в ограниченную очередь, а остаток
+// цепочки обрабатывает их в отдельном потоке в том же порядке. Поток
+// запускается с первым письмом; Finish дожидается, пока очередь опустеет,
+// и передаёт сигнал конца дальше уже из этого потока. Исключение
+// из остатка цепочки пробрасывается в поток-писатель.
+class ThreadBoundary : public Worker {
+public:
+  static constexpr size_t kDefaultCapacity = 1024;
+
+  explicit ThreadBoundary(size_t capacity = kDefaultCapacity) : queue(capacity) {
+  }
+
+  ~ThreadBoundary() override {
+    Stop();
+  }
+
+  virtual void Process(unique_ptr<Email> email) override {
+    Batch batch;
+    batch.push_back(move(email));
+    ProcessBatch(batch);
+  }
+
+  virtual void ProcessBatch(Batch& batch) override {
+    if (failed.load(memory_order_acquire)) {
+      rethrow_exception(error);
+    }
+    if (batch.empty()) {
+      return;
+    }
+    Start();
+    queue.Push(move(batch));
+    batch.clear();
+  }
+
+  virtual void Finish() override {
+    Start();
+    Stop();
+    if (failed.load(memory_order_acquire)) {
+      rethrow_exception(error);
+    }
+  }
+
+private:
+  void Start() {
+    if (!consumer.joinable()) {
+      consumer = thread([this] { Consume(); });
+    }
+  }
+
+  // пустая пачка в очереди -- конец потока писем
+  void Stop() {
+    if (consumer.joinable()) {
+      queue.Push(Batch());
+      consumer.join();
+    }
+  }
+
+  void Consume() {
+    try {
+      for (Batch batch = queue.Pop(); !batch.empty(); batch = queue.Pop()) {
+        PassOnBatch(batch);
+      }
+      FinishNext();
+      return;
+    } catch (...) {
+      error = current_exception();
+      failed.store(true, memory_order_release);
+    }
+    // писатель может ждать места в очереди: разгружаем её до конца
+    while (!queue.Pop().empty()) {
+    }
+  }
+
+  SpscQueue<Batch> queue;
+  thread consumer;
+  atomic<bool> failed = false;
+  exception_ptr error;
+};
+
+
+// Разветвление цепочки: письма идут и в ветвь, и дальше по цепочке. Ветви
+// достаются свои письма из пула, но from и body у них общие с оригиналами,
+// так что копируется только to. Конец потока писем передаётся сначала
+// в ветвь, потом дальше по цепочке.
+class Tee : public Worker {
+public:
+  Tee(unique_ptr<Worker> branch, shared_ptr<EmailPool> pool)
+    : branch(move(branch))
+    , pool(move(pool))
+  {
+  }
+
+  virtual void Process(unique_ptr<Email> email) override {
+    Batch batch;
+    batch.push_back(move(email));
+    ProcessBatch(batch);
+  }
+
+  // ветвь получает пачку первой: если она работает в своём потоке,
+  // то обрабатывает её, пока письма идут дальше по цепочке
+  virtual void ProcessBatch(Batch& batch) override {
+    pool->Acquire(shared, batch.size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+      *shared[i] = *batch[i];
+    }
+    branch->ProcessBatch(shared);
+    shared.clear();
+    PassOnBatch(batch);
+  }
+
+  virtual void Finish() override {
+    branch->Finish();
+    FinishNext();
+  }
+
+private:
+  unique_ptr<Worker> branch;
+  shared_ptr<EmailPool> pool;
+  Batch shared;
+};
+
+
+// Начало ветви: передаёт письма дальше как есть
+class PassThrough : public Worker {
+public:
+  virtual void Process(unique_ptr<Email> email) override {
+    PassOn(move(email));
+  }
+
+  virtual void ProcessBatch(Batch& batch) override {
+    PassOnBatch(batch);
+  }
+};
+
+
+// Метрики одной стадии. Каждую стадию обслуживает один поток, так что
+// счётчики обычные; читать их можно после Run.
+struct StageMetrics {
+  string name;
+  // у первой стадии нет входа, у границы потоков -- выхода в этом потоке
+  bool has_input = true;
+  bool has_output = true;
+  size_t emails_in = 0;
+  size_t emails_out = 0;
+  // собственное время стадии, без остатка цепочки, вызванного из неё
+  chrono::steady_clock::duration busy{};
+  // время остатка цепочки, которое StageProbe насчитал с начала работы
+  chrono::steady_clock::duration downstream{};
+};
+
+
+// Ставится перед стадией: считает входящие письма и время вызова стадии.
+// Время, которое остаток цепочки провёл внутри этого вызова, StageProbe
+// за стадией прибавляет к downstream, и оно вычитается.
+class StageMeter : public Worker {
+public:
+  explicit StageMeter(shared_ptr<StageMetrics> metrics) : metrics(move(metrics)) {
+  }
+
+  virtual void Process(unique_ptr<Email> email) override {
+    ++metrics->emails_in;
+    Timed([&] { PassOn(move(email)); });
+  }
+
+  virtual void ProcessBatch(Batch& batch) override {
+    metrics->emails_in += batch.size();
+    Timed([&] { PassOnBatch(batch); });
+  }
+
+  virtual void Run() override {
+    Timed([&] { next_->Run(); });
+  }
+
+  virtual void Finish() override {
+    Timed([&] { FinishNext(); });
+  }
+
+private:
+  template <typename Call>
+  void Timed(Call call) {
+    const auto downstream_before = metrics->downstream;
+    const auto start = chrono::steady_clock::now();
+    call();
+    metrics->busy += chrono::steady_clock::now() - start - (metrics->downstream - downstream_before);
+  }
+
+  shared_ptr<StageMetrics> metrics;
+};
+
+
+// Ставится за стадией: считает исходящие письма и время остатка цепочки.
+// Если дальше никого нет, возвращает письма в пул, как это сделал бы
+// последний Sender
+class StageProbe : public Worker {
+public:
+  StageProbe(shared_ptr<StageMetrics> metrics, shared_ptr<EmailPool> pool)
+    : metrics(move(metrics))
+    , pool(move(pool))
+  {
+  }
+
+  virtual void Process(unique_ptr<Email> email) override {
+    Batch batch;
+    batch.push_back(move(email));
+    ProcessBatch(batch);
+  }
+
+  virtual void ProcessBatch(Batch& batch) override {
+    metrics->emails_out += batch.size();
+    if (!next_) {
+      pool->Release(batch);
+      return;
+    }
+    const auto start = chrono::steady_clock::now();
+    PassOnBatch(batch);
+    metrics->downstream += chrono::steady_clock::now() - start;
+  }
+
+  virtual void Finish() override {
+    const auto start = chrono::steady_clock::now();
+    FinishNext();
+    metrics->downstream += chrono::steady_clock::now() - start;
+  }
+
+private:
+  shared_ptr<StageMetrics> metrics;
+  shared_ptr<EmailPool> pool;
 };
 
 
@@ -131,33 +685,188 @@ private:
 class PipelineBuilder {
 public:
   // добавляет в качестве первого обработчика Reader
-  explicit PipelineBuilder(istream& in) : chain(make_unique<Reader>(in)) {
+  explicit PipelineBuilder(istream& in)
+    : pool(make_shared<EmailPool>())
+    , chain(make_unique<Reader>(in, pool))
+  {
+  }
+
+  // добавляет в качестве первого обработчика MappedReader для файла path
+  static PipelineBuilder FromFile(const string& path) {
+    auto pool = make_shared<EmailPool>();
+    auto reader = make_unique<MappedReader>(path, pool);
+    return PipelineBuilder(move(pool), move(reader));
+  }
+
+  // включает метрики по стадиям: каждую стадию окружают StageMeter
+  // и StageProbe. Без этого вызова цепочка та же, что и раньше, и ничего
+  // не стоит. Вызывается до добавления стадий
+  PipelineBuilder& CollectMetrics() {
+    if (collect_metrics || is_branch || stage_count != 0) {
+      throw logic_error("CollectMetrics must be called on a new root builder");
+    }
+    collect_metrics = true;
+    auto metrics = make_shared<StageMetrics>();
+    metrics->name = "Reader";
+    metrics->has_input = false;
+    stages.push_back(metrics);
+    auto head = make_unique<StageMeter>(metrics);
+    head->SetNext(move(chain));
+    chain = move(head);
+    chain->SetNext(make_unique<StageProbe>(metrics, pool));
+    return *this;
   }
 
   // добавляет новый обработчик Filter
   PipelineBuilder& FilterBy(Filter::Function filter) {
-    chain->SetNext(make_unique<Filter>(move(filter)));
+    AddStage("Filter", make_unique<Filter>(move(filter)));
+    return *this;
+  }
+
+  // добавляет фильтр с выражением из Match или правилом, скомпилированным
+  // во время работы: оба вызываются напрямую, а не через function
+  template <typename Predicate,
+            typename = enable_if_t<kIsMatchExpr<Predicate> || is_same_v<Predicate, CompiledPredicate>>>
+  PipelineBuilder& FilterBy(Predicate predicate) {
+    AddStage("Filter", make_unique<PredicateFilter<Predicate>>(move(predicate)));
     return *this;
   }
 
   // добавляет новый обработчик Copier
   PipelineBuilder& CopyTo(string recipient) {
-    chain->SetNext(make_unique<Copier>(move(recipient)));
+    string name = "CopyTo " + recipient;
+    AddStage(move(name), make_unique<Copier>(move(recipient), pool));
     return *this;
   }
 
   // добавляет новый обработчик Sender
   PipelineBuilder& Send(ostream& out) {
-    chain->SetNext(make_unique<Sender>(out));
+    AddStage("Sender", make_unique<Sender>(out, pool));
     return *this;
   }
 
+  // добавляет FdSender, пишущий в fd через буферы по buffer_size байт;
+  // дескриптор должен оставаться открытым, пока жива цепочка
+  PipelineBuilder& SendTo(int fd, size_t buffer_size = AsyncFdWriter::kDefaultBufferSize) {
+    AddStage("FdSender", make_unique<FdSender>(fd, buffer_size, pool));
+    return *this;
+  }
+
+  // следующие обработчики работают в отдельном потоке, получая письма
+  // через очередь на queue_capacity пачек
+  PipelineBuilder& NewThread(size_t queue_capacity = ThreadBoundary::kDefaultCapacity) {
+    // выход границы -- уже в другом потоке, его время сюда не относится
+    AddStage("NewThread", make_unique<ThreadBoundary>(queue_capacity), false);
+    return *this;
+  }
+
+  // ответвляет от цепочки ветвь, которую собирает build_branch: письма
+  // идут и в неё, и дальше по цепочке. Ветвь, начатая с NewThread,
+  // работает в отдельном потоке. Ветви могут ветвиться сами
+  PipelineBuilder& Branch(const function<void(PipelineBuilder&)>& build_branch) {
+    // метрики Tee: на выходе письма и цепочки, и ветви
+    shared_ptr<StageMetrics> metrics = NewStageMetrics("Tee");
+    unique_ptr<Worker> head = make_unique<PassThrough>();
+    if (metrics) {
+      head = make_unique<StageProbe>(metrics, pool);
+    }
+    PipelineBuilder branch(pool, move(head));
+    branch.is_branch = true;
+    branch.collect_metrics = collect_metrics;
+    build_branch(branch);
+    for (const auto& stage : branch.stages) {
+      stage->name = "  " + stage->name;
+      stages.push_back(stage);
+    }
+    AddStage(make_unique<Tee>(branch.Build(), pool), move(metrics));
+    return *this;
+  }
+
+  // метрики стадий в порядке цепочки; пусто без CollectMetrics
+  const vector<shared_ptr<StageMetrics>>& Metrics() const {
+    return stages;
+  }
+
+  // печатает метрики по стадиям, когда Run завершился
+  void PrintMetrics(ostream& out) const {
+    chrono::steady_clock::duration total{};
+    for (const auto& stage : stages) {
+      total += stage->busy;
+    }
+    out << fixed << setprecision(3);
+    for (const auto& stage : stages) {
+      out << left << setw(24) << stage->name << right;
+      if (stage->has_input) {
+        out << " in " << setw(10) << stage->emails_in;
+      } else {
+        out << "    " << setw(10) << "";
+      }
+      if (stage->has_output) {
+        out << " out " << setw(10) << stage->emails_out;
+        if (stage->has_input && stage->emails_out < stage->emails_in) {
+          out << " dropped " << setw(10) << stage->emails_in - stage->emails_out;
+        } else if (stage->has_input && stage->emails_out > stage->emails_in) {
+          out << " copied  " << setw(10) << stage->emails_out - stage->emails_in;
+        } else {
+          out << setw(19) << "";
+        }
+      } else {
+        out << setw(34) << "";
+      }
+      const double ms = chrono::duration<double, milli>(stage->busy).count();
+      const double share = total.count() ? 100.0 * stage->busy.count() / total.count() : 0;
+      out << setw(12) << ms << " ms " << setw(6) << setprecision(1) << share << "%\n" << setprecision(3);
+    }
+    out << defaultfloat;
+  }
+
   // возвращает готовую цепочку обработчиков
   unique_ptr<Worker> Build() {
     return move(chain);
   }
 private:
+  PipelineBuilder(shared_ptr<EmailPool> pool, unique_ptr<Worker> reader)
+    : pool(move(pool))
+    , chain(move(reader))
+  {
+  }
+
+  // nullptr, если метрики не собираются
+  shared_ptr<StageMetrics> NewStageMetrics(string name, bool has_output = true) {
+    if (!collect_metrics) {
+      return nullptr;
+    }
+    auto metrics = make_shared<StageMetrics>();
+    metrics->name = move(name);
+    metrics->has_output = has_output;
+    stages.push_back(metrics);
+    return metrics;
+  }
+
+  void AddStage(string name, unique_ptr<Worker> stage, bool has_output = true) {
+    AddStage(move(stage), NewStageMetrics(move(name), has_output));
+  }
+
+  void AddStage(unique_ptr<Worker> stage, shared_ptr<StageMetrics> metrics) {
+    ++stage_count;
+    if (!metrics) {
+      chain->SetNext(move(stage));
+      return;
+    }
+    chain->SetNext(make_unique<StageMeter>(metrics));
+    chain->SetNext(move(stage));
+    if (metrics->has_output) {
+      chain->SetNext(make_unique<StageProbe>(metrics, pool));
+    }
+  }
+
+  // письма Reader-а и копии Copier-ов возвращаются в пул после Sender-а
+  shared_ptr<EmailPool> pool;
   unique_ptr<Worker> chain;
+  size_t stage_count = 0;
+  bool is_branch = false;
+  bool collect_metrics = false;
+  vector<shared_ptr<StageMetrics>> stages;
 };
 
 
@@ -205,8 +914,836 @@ void TestSanity() {
   ASSERT_EQUAL(expectedOutput, outStream.str());
 }
 
+string MakeNumberedEmails(size_t count) {
+  ostringstream out;
+  for (size_t i = 0; i < count; ++i) {
+    out << "from" << i % 7 << "@example.com\n"
+        << "to" << i % 5 << "@example.com\n"
+        << "body " << i << '\n';
+  }
+  return out.str();
+}
+
+// Одна и та же цепочка: Filter, Copier, Sender. С threaded каждый
+// обработчик работает в своём потоке
+void AddSampleStages(PipelineBuilder& builder, ostream& out, bool threaded, size_t queue_capacity) {
+  auto maybe_thread = [&] {
+    if (threaded) {
+      builder.NewThread(queue_capacity);
+    }
+  };
+  maybe_thread();
+  builder.FilterBy([](const Email& email) {
+    return email.from != "from3@example.com";
+  });
+  maybe_thread();
+  builder.CopyTo("to1@example.com");
+  maybe_thread();
+  builder.Send(out);
+}
+
+string RunSamplePipeline(const string& input, bool threaded, size_t queue_capacity) {
+  istringstream in(input);
+  ostringstream out;
+  PipelineBuilder builder(in);
+  AddSampleStages(builder, out, threaded, queue_capacity);
+  builder.Build()->Run();
+  return out.str();
+}
+
+void TestThreadedSanity() {
+  SpscQueue<int> queue(3);
+  ASSERT_EQUAL(queue.Capacity(), 4u);
+  for (int i = 0; i < 4; ++i) {
+    ASSERT(queue.TryPush(i));
+  }
+  int extra = 4;
+  ASSERT(!queue.TryPush(extra));
+  ASSERT_EQUAL(*queue.TryPop(), 0);
+  ASSERT(queue.TryPush(extra));
+  for (int i = 1; i <= 4; ++i) {
+    ASSERT_EQUAL(queue.Pop(), i);
+  }
+  ASSERT(!queue.TryPop());
+
+  const string input = MakeNumberedEmails(9);
+  ASSERT_EQUAL(RunSamplePipeline(input, true, 2), RunSamplePipeline(input, false, 2));
+}
+
+chrono::nanoseconds ThreadCpuTime() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return chrono::seconds(ts.tv_sec) + chrono::nanoseconds(ts.tv_nsec);
+}
+
+void TestQueueWaitSleeps() {
+  const auto delay = chrono::milliseconds(200);
+  SpscQueue<int> queue(2);
+
+  // читатель ждёт медленного писателя
+  thread producer([&queue, delay] {
+    this_thread::sleep_for(delay);
+    queue.Push(1);
+  });
+  auto cpu_before = ThreadCpuTime();
+  ASSERT_EQUAL(queue.Pop(), 1);
+  ASSERT(ThreadCpuTime() - cpu_before < delay / 4);
+  producer.join();
+
+  // писатель ждёт, пока медленный читатель освободит место
+  queue.Push(1);
+  queue.Push(2);
+  thread consumer([&queue, delay] {
+    this_thread::sleep_for(delay);
+    queue.Pop();
+  });
+  cpu_before = ThreadCpuTime();
+  queue.Push(3);
+  ASSERT(ThreadCpuTime() - cpu_before < delay / 4);
+  consumer.join();
+  ASSERT_EQUAL(queue.Pop(), 2);
+  ASSERT_EQUAL(queue.Pop(), 3);
+}
+
+void TestThreadedPreservesOrder() {
+  const string input = MakeNumberedEmails(20000);
+  const string expected = RunSamplePipeline(input, false, 0);
+  // маленькая очередь заставляет потоки постоянно ждать друг друга
+  ASSERT_EQUAL(RunSamplePipeline(input, true, 2), expected);
+  ASSERT_EQUAL(RunSamplePipeline(input, true, 1024), expected);
+}
+
+void TestThreadedEmptyInput() {
+  ASSERT_EQUAL(RunSamplePipeline("", true, 4), "");
+
+  // поток ни разу не запускался -- разрушение без Finish не должно зависать
+  istringstream in(MakeNumberedEmails(3));
+  PipelineBuilder builder(in);
+  builder.NewThread().Send(cout);
+}
+
+void TestThreadedPropagatesErrors() {
+  istringstream in(MakeNumberedEmails(1000));
+  ostringstream out;
+  PipelineBuilder builder(in);
+  size_t processed = 0;
+  builder.NewThread(2).FilterBy([&processed](const Email&) {
+    if (++processed == 100) {
+      throw runtime_error("filter failed");
+    }
+    return true;
+  });
+  builder.Send(out);
+  auto pipeline = builder.Build();
+  try {
+    pipeline->Run();
+    ASSERT(false);
+  } catch (const runtime_error& e) {
+    ASSERT_EQUAL(string(e.what()), "filter failed");
+  }
+}
+
+// Три медленных стадии: последовательно время складывается,
+// а в отдельных потоках определяется самой медленной
+chrono::nanoseconds RunSlowStages(const string& input, bool threaded) {
+  istringstream in(input);
+  ostringstream out;
+  PipelineBuilder builder(in);
+  for (int stage = 0; stage < 3; ++stage) {
+    if (threaded) {
+      builder.NewThread(8);
+    }
+    builder.FilterBy([](const Email&) {
+      this_thread::sleep_for(chrono::microseconds(20));
+      return true;
+    });
+  }
+  builder.Send(out);
+  const auto start = chrono::steady_clock::now();
+  builder.Build()->Run();
+  return chrono::steady_clock::now() - start;
+}
+
+void TestThreadedOverlapsStages() {
+  // потоки обмениваются пачками, поэтому писем нужно на несколько пачек
+  const string input = MakeNumberedEmails(4 * Reader::kBatchSize);
+  ASSERT(RunSlowStages(input, true) < RunSlowStages(input, false));
+}
+
+// Обрабатывает письма только по одному: пачки до него доходят через
+// адаптер по умолчанию
+class Recorder : public Worker {
+public:
+  explicit Recorder(vector<string>& log) : log(log) {
+  }
+
+  virtual void Process(unique_ptr<Email> email) override {
+    log.push_back(email->to + ": " + string(email->body.View()));
+    PassOn(move(email));
+  }
+
+private:
+  vector<string>& log;
+};
+
+void TestBatchedWorkers() {
+  auto make_emails = [] {
+    Worker::Batch batch;
+    istringstream in(MakeNumberedEmails(50));
+    for (string from, to, body; getline(in, from) && getline(in, to) && getline(in, body); ) {
+      batch.push_back(make_unique<Email>(Email{from, to, body}));
+    }
+    return batch;
+  };
+  auto make_chain = [](ostream& out, vector<string>& log) {
+    auto chain = make_unique<Filter>([](const Email& email) {
+      return email.to != "to2@example.com";
+    });
+    chain->SetNext(make_unique<Copier>("to0@example.com"));
+    chain->SetNext(make_unique<Recorder>(log));
+    chain->SetNext(make_unique<Sender>(out));
+    return chain;
+  };
+
+  ostringstream single_out;
+  vector<string> single_log;
+  auto single = make_chain(single_out, single_log);
+  for (unique_ptr<Email>& email : make_emails()) {
+    single->Process(move(email));
+  }
+
+  ostringstream batch_out;
+  vector<string> batch_log;
+  auto batched = make_chain(batch_out, batch_log);
+  Worker::Batch batch = make_emails();
+  batched->ProcessBatch(batch);
+  ASSERT(batch.empty());
+
+  ASSERT_EQUAL(batch_out.str(), single_out.str());
+  ASSERT_EQUAL(batch_log, single_log);
+  ASSERT_EQUAL(batch_log.size(), 40u + 30u);
+}
+
+// Запоминает, какие буферы from и body у прошедших писем
+class BufferInspector : public Worker {
+public:
+  vector<const char*> from_buffers, body_buffers;
+
+  virtual void Process(unique_ptr<Email> email) override {
+    from_buffers.push_back(email->from.View().data());
+    body_buffers.push_back(email->body.View().data());
+    PassOn(move(email));
+  }
+};
+
+void TestCopiesShareText() {
+  const string body(100000, 'x');
+  istringstream in("sender@example.com\nto0@example.com\n" + body + "\n");
+  auto pool = make_shared<EmailPool>();
+  Reader reader(in, pool);
+  // каждый Copier удваивает число писем: 2^8 писем с одним телом
+  const size_t kCopiers = 8;
+  for (size_t i = 0; i < kCopiers; ++i) {
+    reader.SetNext(make_unique<Copier>("to" + to_string(i + 1) + "@example.com", pool));
+  }
+  auto inspector = make_unique<BufferInspector>();
+  BufferInspector& seen = *inspector;
+  reader.SetNext(move(inspector));
+  reader.Run();
+
+  ASSERT_EQUAL(seen.body_buffers.size(), 1u << kCopiers);
+  for (size_t i = 0; i < seen.body_buffers.size(); ++i) {
+    ASSERT_EQUAL(seen.from_buffers[i], seen.from_buffers[0]);
+    ASSERT_EQUAL(seen.body_buffers[i], seen.body_buffers[0]);
+  }
+
+  Email original{string("a@example.com"), "b@example.com", string("text")};
+  Email copy = original;
+  ASSERT_EQUAL(copy.body.View().data(), original.body.View().data());
+  ASSERT_EQUAL(original.body.UseCount(), 2);
+  ASSERT(copy.body == "text");
+}
+
+void TestPoolRecyclesEmails() {
+  const string input = MakeNumberedEmails(10 * Reader::kBatchSize);
+  auto run = [&input](shared_ptr<EmailPool> pool) {
+    istringstream in(input);
+    ostringstream out;
+    Reader reader(in, pool);
+    reader.SetNext(make_unique<Copier>("to1@example.com", pool));
+    reader.SetNext(make_unique<Sender>(out, pool));
+    reader.Run();
+    return out.str();
+  };
+  auto pool = make_shared<EmailPool>();
+  ASSERT_EQUAL(run(pool), run(nullptr));
+  // письма одной пачки и их копии, дальше всё берётся из пула
+  ASSERT(pool->Allocated() <= 2 * Reader::kBatchSize);
+
+  // письма сверх max_free освобождаются
+  EmailPool small(2);
+  Worker::Batch batch;
+  small.Acquire(batch, 5);
+  ASSERT_EQUAL(small.Allocated(), 5u);
+  small.Release(batch, 1);
+  ASSERT_EQUAL(batch.size(), 1u);
+  small.Acquire(batch, 3);
+  ASSERT_EQUAL(small.Allocated(), 6u);
+  ASSERT(batch[1]->to.empty() && batch[1]->body.View().empty());
+}
+
+const char kMappedPath[] = "pipeline_mapped_test.txt";
+
+void WriteFile(const string& path, const string& content) {
+  ofstream(path, ios::binary) << content;
+}
+
+string RunMappedPipeline(const string& input, bool threaded) {
+  WriteFile(kMappedPath, input);
+  ostringstream out;
+  {
+    PipelineBuilder builder = PipelineBuilder::FromFile(kMappedPath);
+    AddSampleStages(builder, out, threaded, 2);
+    builder.Build()->Run();
+  }
+  remove(kMappedPath);
+  return out.str();
+}
+
+void TestMappedReader() {
+  const string input = MakeNumberedEmails(3 * Reader::kBatchSize + 5);
+  const string expected = RunSamplePipeline(input, false, 0);
+  ASSERT_EQUAL(RunMappedPipeline(input, false), expected);
+  ASSERT_EQUAL(RunMappedPipeline(input, true), expected);
+
+  // последняя строка без перевода строки и оборванная запись
+  const string unterminated = input.substr(0, input.size() - 1);
+  ASSERT_EQUAL(RunMappedPipeline(unterminated, false), RunSamplePipeline(unterminated, false, 0));
+  const string truncated = input + "from0@example.com\nto0@example.com";
+  ASSERT_EQUAL(RunMappedPipeline(truncated, false), expected);
+  ASSERT_EQUAL(RunMappedPipeline("", true), "");
+
+  try {
+    PipelineBuilder::FromFile("no/such/file");
+    ASSERT(false);
+  } catch (const runtime_error&) {
+  }
+}
+
+// Только считает байты писем и возвращает письма в пул
+class ByteCounter : public Worker {
+public:
+  size_t bytes = 0;
+
+  explicit ByteCounter(shared_ptr<EmailPool> pool) : pool(move(pool)) {
+  }
+
+  virtual void Process(unique_ptr<Email> email) override {
+    Batch batch;
+    batch.push_back(move(email));
+    ProcessBatch(batch);
+  }
+
+  virtual void ProcessBatch(Batch& batch) override {
+    for (const unique_ptr<Email>& email : batch) {
+      bytes += email->from.View().size() + email->to.size() + email->body.View().size();
+    }
+    pool->Release(batch);
+  }
+
+private:
+  shared_ptr<EmailPool> pool;
+};
+
+// Прогоняет читатель до конца; возвращает байты писем и время в секундах
+pair<size_t, double> MeasureReader(unique_ptr<Worker> reader, shared_ptr<EmailPool> pool) {
+  auto counter = make_unique<ByteCounter>(move(pool));
+  ByteCounter& seen = *counter;
+  reader->SetNext(move(counter));
+  const auto start = chrono::steady_clock::now();
+  reader->Run();
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  return {seen.bytes, elapsed.count()};
+}
+
+void TestMappedReaderReadsAllBytes() {
+  WriteFile(kMappedPath, MakeNumberedEmails(10 * Reader::kBatchSize + 3));
+  auto pool = make_shared<EmailPool>();
+  ifstream in(kMappedPath, ios::binary);
+  const size_t stream_bytes = MeasureReader(make_unique<Reader>(in, pool), pool).first;
+  const size_t mapped_bytes = MeasureReader(make_unique<MappedReader>(kMappedPath, pool), pool).first;
+  remove(kMappedPath);
+  ASSERT_EQUAL(mapped_bytes, stream_bytes);
+}
+
+void TestSubstringFinder() {
+  // образец в каждой позиции строк разной длины, по обе стороны от границ
+  // 16-байтных блоков
+  for (size_t length = 0; length < 70; ++length) {
+    string haystack(length, 'a');
+    for (size_t k = 1; k <= 5 && k <= length; ++k) {
+      for (size_t pos = 0; pos + k <= length; ++pos) {
+        string s = haystack;
+        s.replace(pos, k, string(k - 1, 'b') + 'c');
+        SubstringFinder finder(string(k - 1, 'b') + 'c');
+        ASSERT(finder.In(s));
+        ASSERT(!SubstringFinder(string(k - 1, 'b') + 'd').In(s));
+      }
+    }
+  }
+  // первый и последний символы совпадают, середина -- нет
+  const string tricky = string(40, 'x') + "abXd" + string(40, 'x') + "abcd";
+  ASSERT(SubstringFinder("abcd").In(tricky));
+  ASSERT(!SubstringFinder("abcd").In(tricky.substr(0, tricky.size() - 1)));
+  ASSERT(SubstringFinder("").In(""));
+  ASSERT(!SubstringFinder("ab").In("a"));
+}
+
+void TestPredicates() {
+  using namespace Match;
+  vector<Email> emails;
+  for (int i = 0; i < 60; ++i) {
+    emails.push_back({
+      string("from") + to_string(i % 7) + "@example.com",
+      "to" + to_string(i % 5) + "@example.com",
+      string(i % 3 ? "hello " : "buy now ") + to_string(i) + string(i % 4, '!'),
+    });
+  }
+
+  auto reference = [](const Email& e) {
+    return (e.from == "from1@example.com" || e.body.View().find("buy") != string_view::npos)
+        && !(e.to.rfind("to2", 0) == 0);
+  };
+  auto expr = (From == "from1@example.com" || Body.Contains("buy")) && !To.StartsWith("to2");
+  static_assert(kIsMatchExpr<decltype(expr)>);
+  auto compiled = CompiledPredicate::Compile(
+      R"(  (from == "from1@example.com" || body contains "buy") && !to starts_with "to2" )");
+  for (const Email& email : emails) {
+    ASSERT_EQUAL(expr(email), reference(email));
+    ASSERT_EQUAL(compiled(email), reference(email));
+  }
+
+  auto escaped = CompiledPredicate::Compile(R"(body contains "say \"hi\" \\ ok")");
+  ASSERT(escaped({string("a"), "b", string("they say \"hi\" \\ ok")}));
+
+  for (const char* bad : {"", "from", "subject == \"x\"", "from == x", "from like \"x\"",
+                          "(from == \"x\"", "from == \"x", "to == \"x\" ||", "to == \"x\" to"}) {
+    try {
+      CompiledPredicate::Compile(bad);
+      ASSERT(false);
+    } catch (const invalid_argument&) {
+    }
+  }
+}
+
+void TestFilterByPredicates() {
+  using namespace Match;
+  const string input = MakeNumberedEmails(1000);
+  auto run = [&input](auto filter) {
+    istringstream in(input);
+    ostringstream out;
+    PipelineBuilder builder(in);
+    builder.FilterBy(filter).CopyTo("to0@example.com").Send(out);
+    builder.Build()->Run();
+    return out.str();
+  };
+  const string expected = run(Filter::Function([](const Email& email) {
+    return email.from != "from3@example.com" && email.body.View().find('7') != string_view::npos;
+  }));
+  ASSERT(!expected.empty());
+  ASSERT_EQUAL(run(!(From == "from3@example.com") && Body.Contains("7")), expected);
+  ASSERT_EQUAL(run(CompiledPredicate::Compile(R"(!(from == "from3@example.com") && body contains "7")")),
+               expected);
+}
+
+// Письма по 2 КБ обычного текста: первая и последняя буквы образца
+// в нём встречаются часто. "unsubscribe" есть в каждом втором
+vector<Email> MakeNewsletters(size_t count) {
+  string text;
+  while (text.size() < 2000) {
+    text += "please find the subscription settings at the end of this newsletter, sincerely ";
+  }
+  vector<Email> emails;
+  for (size_t i = 0; i < count; ++i) {
+    emails.push_back({string("from@example.com"), "to@example.com", text + (i % 2 ? "unsubscribe" : "")});
+  }
+  return emails;
+}
+
+// Возвращает число совпадений за rounds проходов и время в микросекундах
+template <typename Predicate>
+pair<size_t, double> MeasurePredicate(const vector<Email>& emails, int rounds, const Predicate& predicate) {
+  size_t matched = 0;
+  const auto start = chrono::steady_clock::now();
+  for (int round = 0; round < rounds; ++round) {
+    for (const Email& email : emails) {
+      matched += predicate(email);
+    }
+  }
+  const chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+  return {matched, elapsed.count()};
+}
+
+bool BodyFindsUnsubscribe(const Email& email) {
+  return email.body.View().find("unsubscribe") != string_view::npos;
+}
+
+void TestPredicatesAgreeOnText() {
+  using namespace Match;
+  const vector<Email> emails = MakeNewsletters(200);
+  const size_t expected = MeasurePredicate(emails, 1, BodyFindsUnsubscribe).first;
+  ASSERT_EQUAL(expected, 100u);
+  ASSERT_EQUAL(MeasurePredicate(emails, 1, Body.Contains("unsubscribe")).first, expected);
+  ASSERT_EQUAL(MeasurePredicate(emails, 1, CompiledPredicate::Compile(R"(body contains "unsubscribe")")).first,
+               expected);
+}
+
+void TestStageMetrics() {
+  const string input = MakeNumberedEmails(1000);
+  for (bool threaded : {false, true}) {
+    istringstream in(input);
+    ostringstream out;
+    PipelineBuilder builder(in);
+    builder.CollectMetrics();
+    AddSampleStages(builder, out, threaded, 2);
+    builder.Build()->Run();
+    ASSERT_EQUAL(out.str(), RunSamplePipeline(input, false, 0));
+
+    vector<shared_ptr<StageMetrics>> stages;
+    for (const auto& stage : builder.Metrics()) {
+      if (stage->name != "NewThread") {
+        stages.push_back(stage);
+      }
+    }
+    ASSERT_EQUAL(stages.size(), 4u);
+    const StageMetrics& reader = *stages[0];
+    const StageMetrics& filter = *stages[1];
+    const StageMetrics& copier = *stages[2];
+    const StageMetrics& sender = *stages[3];
+    ASSERT_EQUAL(reader.emails_out, 1000u);
+    ASSERT_EQUAL(filter.emails_in, 1000u);
+    ASSERT_EQUAL(filter.emails_out, 1000u - 143u);
+    ASSERT_EQUAL(copier.name, "CopyTo to1@example.com");
+    ASSERT_EQUAL(copier.emails_in, filter.emails_out);
+    ASSERT_EQUAL(copier.emails_out, 2 * copier.emails_in - 172u);
+    ASSERT_EQUAL(sender.emails_in, copier.emails_out);
+    ASSERT_EQUAL(sender.emails_out, sender.emails_in);
+    if (threaded) {
+      ASSERT_EQUAL(builder.Metrics().size(), 7u);
+    }
+
+    ostringstream report;
+    builder.PrintMetrics(report);
+    const string text = report.str();
+    ASSERT(text.find("Filter") != string::npos);
+    ASSERT(text.find("dropped        143") != string::npos);
+    ASSERT(text.find("copied ") != string::npos);
+  }
+
+  istringstream in;
+  PipelineBuilder builder(in);
+  builder.Send(cout);
+  ASSERT(builder.Metrics().empty());
+  try {
+    builder.CollectMetrics();
+    ASSERT(false);
+  } catch (const logic_error&) {
+  }
+}
+
+void TestStageMetricsSeparateTime() {
+  // медленный Sender в конце не должен попадать во время стадий до него
+  istringstream in(MakeNumberedEmails(20));
+  PipelineBuilder builder(in);
+  builder.CollectMetrics();
+  builder.FilterBy([](const Email&) {
+    return true;
+  });
+  builder.FilterBy([](const Email&) {
+    this_thread::sleep_for(chrono::milliseconds(1));
+    return true;
+  });
+  builder.Build()->Run();
+  const auto& stages = builder.Metrics();
+  ASSERT(stages[2]->busy >= chrono::milliseconds(20));
+  ASSERT(stages[0]->busy < chrono::milliseconds(5));
+  ASSERT(stages[1]->busy < chrono::milliseconds(5));
+}
+
+void TestBranches() {
+  const string input = MakeNumberedEmails(2000);
+  for (bool threaded : {false, true}) {
+    istringstream in(input);
+    ostringstream archive, delivery, urgent;
+    PipelineBuilder builder(in);
+    builder.Branch([&](PipelineBuilder& branch) {
+      if (threaded) {
+        branch.NewThread(2);
+      }
+      branch.Send(archive);
+    });
+    // вложенная ветвь со своим фильтром
+    builder.Branch([&](PipelineBuilder& branch) {
+      branch.FilterBy([](const Email& email) {
+        return email.from == "from0@example.com";
+      });
+      branch.Branch([&](PipelineBuilder& nested) {
+        if (threaded) {
+          nested.NewThread(2);
+        }
+        nested.Send(urgent);
+      });
+    });
+    AddSampleStages(builder, delivery, threaded, 2);
+    builder.Build()->Run();
+
+    ASSERT_EQUAL(archive.str(), input);
+    ASSERT_EQUAL(delivery.str(), RunSamplePipeline(input, false, 0));
+    istringstream urgent_in(input);
+    ostringstream urgent_expected;
+    PipelineBuilder urgent_builder(urgent_in);
+    urgent_builder.FilterBy([](const Email& email) {
+      return email.from == "from0@example.com";
+    });
+    urgent_builder.Send(urgent_expected);
+    urgent_builder.Build()->Run();
+    ASSERT_EQUAL(urgent.str(), urgent_expected.str());
+  }
+}
+
+void TestBranchSharesText() {
+  istringstream in(MakeNumberedEmails(10));
+  auto pool = make_shared<EmailPool>();
+  Reader reader(in, pool);
+  auto branch = make_unique<BufferInspector>();
+  BufferInspector& branch_seen = *branch;
+  reader.SetNext(make_unique<Tee>(move(branch), pool));
+  auto main = make_unique<BufferInspector>();
+  BufferInspector& main_seen = *main;
+  reader.SetNext(move(main));
+  reader.Run();
+
+  ASSERT_EQUAL(main_seen.body_buffers.size(), 10u);
+  ASSERT_EQUAL(branch_seen.body_buffers, main_seen.body_buffers);
+  ASSERT_EQUAL(branch_seen.from_buffers, main_seen.from_buffers);
+}
+
+void TestBranchMetrics() {
+  istringstream in(MakeNumberedEmails(100));
+  ostringstream archive, delivery;
+  PipelineBuilder builder(in);
+  builder.CollectMetrics();
+  builder.Branch([&](PipelineBuilder& branch) {
+    branch.NewThread().Send(archive);
+    try {
+      branch.CollectMetrics();
+      ASSERT(false);
+    } catch (const logic_error&) {
+    }
+  });
+  builder.Send(delivery);
+  builder.Build()->Run();
+
+  vector<string> names;
+  for (const auto& stage : builder.Metrics()) {
+    names.push_back(stage->name);
+  }
+  ASSERT_EQUAL(names, vector<string>({"Reader", "Tee", "  NewThread", "  Sender", "Sender"}));
+  const auto& stages = builder.Metrics();
+  ASSERT_EQUAL(stages[1]->emails_in, 100u);
+  ASSERT_EQUAL(stages[1]->emails_out, 200u);
+  ASSERT_EQUAL(stages[3]->emails_in, 100u);
+  ASSERT_EQUAL(stages[4]->emails_in, 100u);
+}
+
+const char kSendPath[] = "pipeline_send_test.txt";
+
+string ReadFile(const string& path) {
+  ifstream in(path, ios::binary);
+  return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+void TestFdSender() {
+  // письмо длиннее буфера и много маленьких: буферы постоянно меняются
+  const string input = MakeNumberedEmails(3000) + "big@example.com\nto0@example.com\n" + string(1000, 'z') + "\n";
+  for (size_t buffer_size : {1, 64, 4096, 1 << 20}) {
+    const int fd = open(kSendPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT(fd >= 0);
+    {
+      istringstream in(input);
+      PipelineBuilder builder(in);
+      builder.CopyTo("to1@example.com").SendTo(fd, buffer_size);
+      builder.Build()->Run();
+    }
+    close(fd);
+
+    istringstream in(input);
+    ostringstream expected;
+    PipelineBuilder builder(in);
+    builder.CopyTo("to1@example.com").Send(expected);
+    builder.Build()->Run();
+    ASSERT_EQUAL(ReadFile(kSendPath), expected.str());
+  }
+  remove(kSendPath);
+
+  // дескриптор только для чтения: ошибка записи доходит до Run
+  const int fd = open("/dev/null", O_RDONLY);
+  istringstream in(input);
+  PipelineBuilder builder(in);
+  builder.SendTo(fd, 4096);
+  try {
+    builder.Build()->Run();
+    ASSERT(false);
+  } catch (const runtime_error& e) {
+    ASSERT(string(e.what()).find("Cannot write") != string::npos);
+  }
+  close(fd);
+}
+
+void TestAsyncFdWriter() {
+  int fds[2];
+  ASSERT_EQUAL(pipe(fds), 0);
+  string received;
+  thread reader([&received, fd = fds[0]] {
+    char buffer[4096];
+    for (ssize_t n; (n = read(fd, buffer, sizeof(buffer))) > 0; ) {
+      received.append(buffer, n);
+    }
+  });
+  string expected;
+  {
+    AsyncFdWriter writer(fds[1], 100);
+    for (int i = 0; i < 1000; ++i) {
+      const string line = "line " + to_string(i) + "\n";
+      writer.Append(line);
+      expected += line;
+    }
+    writer.Flush();
+    ASSERT_EQUAL(writer.BytesWritten(), expected.size());
+    // остаток дописывает деструктор
+    writer.Append("tail");
+    expected += "tail";
+  }
+  close(fds[1]);
+  reader.join();
+  close(fds[0]);
+  ASSERT_EQUAL(received, expected);
+}
+
+#ifdef PIPELINE_BENCHMARK
+
+// Сравнения скорости вынесены из тестов в отдельную цель pipeline_benchmark:
+// тот же файл, собранный с PIPELINE_BENCHMARK
+
+void BenchmarkThreadedStages() {
+  const string input = MakeNumberedEmails(16 * Reader::kBatchSize);
+  const auto sequential = RunSlowStages(input, false);
+  const auto threaded = RunSlowStages(input, true);
+  cout << "3 slow stages: sequential "
+       << chrono::duration_cast<chrono::milliseconds>(sequential).count() << " ms, threaded "
+       << chrono::duration_cast<chrono::milliseconds>(threaded).count() << " ms" << endl;
+}
+
+void BenchmarkMappedReader() {
+  const string input = MakeNumberedEmails(200000);
+  WriteFile(kMappedPath, input);
+  auto pool = make_shared<EmailPool>();
+  ifstream in(kMappedPath, ios::binary);
+  const double stream_seconds = MeasureReader(make_unique<Reader>(in, pool), pool).second;
+  const double mapped_seconds = MeasureReader(make_unique<MappedReader>(kMappedPath, pool), pool).second;
+  remove(kMappedPath);
+  cout << input.size() / 1e6 << " MB: istream Reader " << input.size() / 1e6 / stream_seconds
+       << " MB/s, MappedReader " << input.size() / 1e6 / mapped_seconds << " MB/s" << endl;
+}
+
+void BenchmarkPredicates() {
+  using namespace Match;
+  const vector<Email> emails = MakeNewsletters(2000);
+  const Filter::Function function = BodyFindsUnsubscribe;
+  const double function_us = MeasurePredicate(emails, 10, function).second;
+  const double expr_us = MeasurePredicate(emails, 10, Body.Contains("unsubscribe")).second;
+  const double compiled_us =
+      MeasurePredicate(emails, 10, CompiledPredicate::Compile(R"(body contains "unsubscribe")")).second;
+  cout << "body contains: function+find " << function_us << " us, Match " << expr_us
+       << " us, bytecode " << compiled_us << " us" << endl;
+}
+
+void BenchmarkStageMetrics() {
+  const string input = MakeNumberedEmails(200000);
+  for (bool threaded : {false, true}) {
+    istringstream in(input);
+    ostringstream out;
+    PipelineBuilder builder(in);
+    builder.CollectMetrics();
+    AddSampleStages(builder, out, threaded, 64);
+    builder.Build()->Run();
+    cout << (threaded ? "threaded" : "sequential") << " sample pipeline:" << endl;
+    builder.PrintMetrics(cout);
+  }
+}
+
+void BenchmarkFdSender() {
+  // чтение из отображения, чтобы время определялось записью
+  WriteFile(kMappedPath, MakeNumberedEmails(200000));
+  auto measure = [](auto add_sender) {
+    PipelineBuilder builder = PipelineBuilder::FromFile(kMappedPath);
+    add_sender(builder);
+    const auto start = chrono::steady_clock::now();
+    builder.Build()->Run();
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  };
+  ofstream out(kSendPath, ios::binary | ios::trunc);
+  const double stream_ms = measure([&out](PipelineBuilder& builder) {
+    builder.Send(out);
+  });
+  out.close();
+  const int fd = open(kSendPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  const double fd_ms = measure([fd](PipelineBuilder& builder) {
+    builder.SendTo(fd);
+  });
+  close(fd);
+  remove(kSendPath);
+  remove(kMappedPath);
+  cout << "200000 emails: Sender(ofstream) " << stream_ms << " ms, FdSender " << fd_ms << " ms" << endl;
+}
+
+int main() {
+  BenchmarkThreadedStages();
+  BenchmarkMappedReader();
+  BenchmarkPredicates();
+  BenchmarkStageMetrics();
+  BenchmarkFdSender();
+  return 0;
+}
+
+#else
+
 int main() {
   TestRunner tr;
   RUN_TEST(tr, TestSanity);
+  RUN_TEST(tr, TestBatchedWorkers);
+  RUN_TEST(tr, TestCopiesShareText);
+  RUN_TEST(tr, TestPoolRecyclesEmails);
+  RUN_TEST(tr, TestMappedReader);
+  RUN_TEST(tr, TestMappedReaderReadsAllBytes);
+  RUN_TEST(tr, TestSubstringFinder);
+  RUN_TEST(tr, TestPredicates);
+  RUN_TEST(tr, TestFilterByPredicates);
+  RUN_TEST(tr, TestPredicatesAgreeOnText);
+  RUN_TEST(tr, TestStageMetrics);
+  RUN_TEST(tr, TestStageMetricsSeparateTime);
+  RUN_TEST(tr, TestBranches);
+  RUN_TEST(tr, TestBranchSharesText);
+  RUN_TEST(tr, TestBranchMetrics);
+  RUN_TEST(tr, TestAsyncFdWriter);
+  RUN_TEST(tr, TestFdSender);
+  RUN_TEST(tr, TestThreadedSanity);
+  RUN_TEST(tr, TestQueueWaitSleeps);
+  RUN_TEST(tr, TestThreadedPreservesOrder);
+  RUN_TEST(tr, TestThreadedEmptyInput);
+  RUN_TEST(tr, TestThreadedPropagatesErrors);
+  RUN_TEST(tr, TestThreadedOverlapsStages);
   return 0;
 }
+
+#endif
@@ -0,0 +1,260 @@
+#include "predicate.h"
+
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+string_view FieldOf(const Email& email, EmailField field) {
+  switch (field) {
+    case EmailField::From:
+      return email.from;
+    case EmailField::To:
+      return email.to;
+    case EmailField::Body:
+      return email.body;
+  }
+  return {};
+}
+
+bool SubstringFinder::In(string_view haystack) const {
+  const size_t k = needle.size();
+  if (k == 0) {
+    return true;
+  }
+  if (k > haystack.size()) {
+    return false;
+  }
+  if (k == 1) {
+    return memchr(haystack.data(), needle[0], haystack.size()) != nullptr;
+  }
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[k - 1]);
+  auto candidates = [&](size_t at) {
+    const __m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(haystack.data() + at));
+    const __m128i block_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(haystack.data() + at + k - 1));
+    return _mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last));
+  };
+  // блоки из 32 позиций целиком помещаются в строку вместе с образцом
+  for (; i + k - 1 + 32 <= haystack.size(); i += 32) {
+    const __m128i low = candidates(i);
+    const __m128i high = candidates(i + 16);
+    if (_mm_movemask_epi8(_mm_or_si128(low, high)) == 0) {
+      continue;
+    }
+    uint32_t mask = _mm_movemask_epi8(low) | (uint32_t(_mm_movemask_epi8(high)) << 16);
+    while (mask != 0) {
+      const unsigned offset = __builtin_ctz(mask);
+      if (memcmp(haystack.data() + i + offset + 1, needle.data() + 1, k - 2) == 0) {
+        return true;
+      }
+      mask &= mask - 1;
+    }
+  }
+  for (; i + k - 1 + 16 <= haystack.size(); i += 16) {
+    unsigned mask = _mm_movemask_epi8(candidates(i));
+    while (mask != 0) {
+      const unsigned offset = __builtin_ctz(mask);
+      if (memcmp(haystack.data() + i + offset + 1, needle.data() + 1, k - 2) == 0) {
+        return true;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+  return haystack.substr(i).find(needle) != string_view::npos;
+}
+
+bool CompiledPredicate::operator()(const Email& email) const {
+  bool acc = false;
+  for (size_t pc = 0; pc < code.size(); ) {
+    const Instruction& ins = code[pc++];
+    switch (ins.op) {
+      case Op::Equals:
+        acc = FieldOf(email, ins.field) == strings[ins.arg];
+        break;
+      case Op::StartsWith: {
+        const string& prefix = strings[ins.arg];
+        acc = FieldOf(email, ins.field).substr(0, prefix.size()) == prefix;
+        break;
+      }
+      case Op::Contains:
+        acc = finders[ins.arg].In(FieldOf(email, ins.field));
+        break;
+      case Op::Not:
+        acc = !acc;
+        break;
+      case Op::JumpIfFalse:
+        if (!acc) {
+          pc = ins.arg;
+        }
+        break;
+      case Op::JumpIfTrue:
+        if (acc) {
+          pc = ins.arg;
+        }
+        break;
+    }
+  }
+  return acc;
+}
+
+// Разбор рекурсивным спуском с генерацией кода на ходу
+class CompiledPredicate::Compiler {
+public:
+  Compiler(string_view rule, CompiledPredicate& result) : rule(rule), rest(rule), result(result) {
+  }
+
+  void Run() {
+    Expr();
+    SkipSpaces();
+    if (!rest.empty()) {
+      Fail("unexpected trailing input");
+    }
+  }
+
+private:
+  string_view rule;
+  string_view rest;
+  CompiledPredicate& result;
+
+  [[noreturn]] void Fail(const string& what) const {
+    throw invalid_argument("Bad filter rule at " + to_string(rule.size() - rest.size()) + ": " + what);
+  }
+
+  void SkipSpaces() {
+    while (!rest.empty() && isspace(static_cast<unsigned char>(rest.front()))) {
+      rest.remove_prefix(1);
+    }
+  }
+
+  bool Accept(string_view token) {
+    SkipSpaces();
+    if (rest.substr(0, token.size()) != token) {
+      return false;
+    }
+    rest.remove_prefix(token.size());
+    return true;
+  }
+
+  string_view Word() {
+    SkipSpaces();
+    size_t length = 0;
+    while (length < rest.size() && (isalpha(static_cast<unsigned char>(rest[length])) || rest[length] == '_')) {
+      ++length;
+    }
+    string_view word = rest.substr(0, length);
+    rest.remove_prefix(length);
+    return word;
+  }
+
+  string String() {
+    if (!Accept("\"")) {
+      Fail("expected a string");
+    }
+    string value;
+    while (!rest.empty() && rest.front() != '"') {
+      if (rest.front() == '\\' && rest.size() > 1) {
+        rest.remove_prefix(1);
+      }
+      value += rest.front();
+      rest.remove_prefix(1);
+    }
+    if (rest.empty()) {
+      Fail("unterminated string");
+    }
+    rest.remove_prefix(1);
+    return value;
+  }
+
+  size_t Emit(Op op, EmailField field = EmailField::From, uint32_t arg = 0) {
+    result.code.push_back({op, field, arg});
+    return result.code.size() - 1;
+  }
+
+  void PatchJump(size_t jump) {
+    result.code[jump].arg = result.code.size();
+  }
+
+  void Expr() {
+    And();
+    while (Accept("||")) {
+      const size_t jump = Emit(Op::JumpIfTrue);
+      And();
+      PatchJump(jump);
+    }
+  }
+
+  void And() {
+    Unary();
+    while (Accept("&&")) {
+      const size_t jump = Emit(Op::JumpIfFalse);
+      Unary();
+      PatchJump(jump);
+    }
+  }
+
+  void Unary() {
+    if (Accept("!")) {
+      Unary();
+      Emit(Op::Not);
+    } else if (Accept("(")) {
+      Expr();
+      if (!Accept(")")) {
+        Fail("expected ')'");
+      }
+    } else {
+      Test();
+    }
+  }
+
+  void Test() {
+    EmailField field;
+    const string_view name = Word();
+    if (name == "from") {
+      field = EmailField::From;
+    } else if (name == "to") {
+      field = EmailField::To;
+    } else if (name == "body") {
+      field = EmailField::Body;
+    } else {
+      Fail("expected from, to or body");
+    }
+
+    Op op;
+    if (Accept("==")) {
+      op = Op::Equals;
+    } else {
+      const string_view operation = Word();
+      if (operation == "starts_with") {
+        op = Op::StartsWith;
+      } else if (operation == "contains") {
+        op = Op::Contains;
+      } else {
+        Fail("expected ==, starts_with or contains");
+      }
+    }
+
+    string value = String();
+    if (op == Op::Contains) {
+      result.finders.emplace_back(move(value));
+      Emit(op, field, result.finders.size() - 1);
+    } else {
+      result.strings.push_back(move(value));
+      Emit(op, field, result.strings.size() - 1);
+    }
+  }
+};
+
+CompiledPredicate CompiledPredicate::Compile(string_view rule) {
+  CompiledPredicate result;
+  Compiler(rule, result).Run();
+  return result;
+}
@@ -1,13 +1,19 @@
 #pragma once
 
 #include <istream>
+#include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <map>
+#include <variant>
 
 namespace Json {
 
+// Узел хранит ровно одно значение. Короткие строки std::string держит прямо
+// в себе, а словарь, который занял бы 48 байт, вынесен в кучу, так что
+// узел не больше строки с номером альтернативы
 class Node {
 public:
   explicit Node(std::vector<Node> array);
@@ -15,16 +21,46 @@ public:
   explicit Node(int value);
   explicit Node(std::string value);
 
+  // Копирование и разрушение не рекурсивны: глубину документа ограничивает
+  // память, а не стек вызовов
+  Node(const Node& other);
+  Node(Node&&) noexcept = default;
+  Node& operator=(const Node& other);
+  Node& operator=(Node&&) noexcept = default;
+  ~Node();
+
+  // Бросают std::bad_variant_access, если в узле значение другого типа
   const std::vector<Node>& AsArray() const;
   const std::map<std::string, Node>& AsMap() const;
   int AsInt() const;
   const std::string& AsString() const;
 
 private:
-  std::vector<Node> as_array;
-  std::map<std::string, Node> as_map;
-  int as_int;
-  std::string as_string;
+  // Словарь в куче, копируется вместе с содержимым. После перемещения
+  // пуст: указатель уходит вместе со словарём
+  class MapBox {
+  public:
+    explicit MapBox(std::map<std::string, Node> map);
+    MapBox(const MapBox& other);
+    MapBox(MapBox&&) noexcept = default;
+    MapBox& operator=(const MapBox& other);
+    MapBox& operator=(MapBox&&) noexcept = default;
+    ~MapBox();
+
+    const std::map<std::string, Node>& Get() const;
+
+  private:
+    friend class Node;
+
+    std::unique_ptr<std::map<std::string, Node>> items;
+  };
+
+  std::variant<int, std::string, std::vector<Node>, MapBox> value;
+
+  // Копия узла с пустыми массивом или словарём вместо исходных
+  static Node CopyWithoutChildren(const Node& node);
+  // Переносит детей узла в out, оставляя его контейнер пустым
+  void TakeChildren(std::vector<Node>& out);
 };
 
 class Document {
@@ -37,6 +73,28 @@ private:
   Node root;
 };
 
+// Получатель событий потокового разбора. Строки, переданные в Key
+// и String, действительны только во время вызова
+class Handler {
+public:
+  virtual ~Handler() = default;
+
+  virtual void StartArray() {}
+  virtual void EndArray() {}
+  virtual void StartObject() {}
+  virtual void Key(std::string_view) {}
+  virtual void EndObject() {}
+  virtual void Int(int) {}
+  virtual void String(std::string_view) {}
+};
+
+// Разбирает документ без построения дерева, сообщая handler о каждом
+// значении. Разбор не рекурсивный: память ограничена глубиной вложенности
+// и длиной самой длинной строки, а не размером документа. Оборванный
+// документ -- invalid_argument; пустой поток -- документ без событий
+void Parse(std::istream& input, Handler& handler);
+
+// Строит дерево документа поверх Parse
 Document Load(std::istream& input);
 
 }
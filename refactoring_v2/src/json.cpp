@@ -1,34 +1,132 @@
 #include "json.h"
+
+#include <cctype>
+#include <optional>
+#include <stdexcept>
+
 using namespace std;
 
 namespace Json {
 
-Node::Node(vector<Node> array) : as_array(move(array)) {
+Node::MapBox::MapBox(std::map<string, Node> map) : items(make_unique<std::map<string, Node>>(move(map))) {
+}
+
+Node::MapBox::MapBox(const MapBox& other) : items(other.items ? make_unique<std::map<string, Node>>(*other.items) : nullptr) {
+}
+
+Node::MapBox& Node::MapBox::operator=(const MapBox& other) {
+  if (this != &other) {
+    items = other.items ? make_unique<std::map<string, Node>>(*other.items) : nullptr;
+  }
+  return *this;
+}
+
+Node::MapBox::~MapBox() = default;
+
+const map<string, Node>& Node::MapBox::Get() const {
+  static const map<string, Node> empty;
+  return items ? *items : empty;
+}
+
+Node::Node(vector<Node> array) : value(move(array)) {
+}
+
+Node::Node(map<string, Node> map) : value(MapBox(move(map))) {
+}
+
+Node::Node(int value) : value(value) {
+}
+
+Node::Node(string value) : value(move(value)) {
 }
 
-Node::Node(map<string, Node> map) : as_map(move(map)){
+Node::Node(const Node& other) : Node(CopyWithoutChildren(other)) {
+  // Пары (исходный узел, его копия без детей): дети копируются так же
+  // и сами попадают в стек
+  vector<pair<const Node*, Node*>> pending = {{&other, this}};
+  while (!pending.empty()) {
+    auto [source, target] = pending.back();
+    pending.pop_back();
+    if (const auto* array = get_if<vector<Node>>(&source->value)) {
+      vector<Node>& copy = get<vector<Node>>(target->value);
+      copy.reserve(array->size());
+      for (const Node& child : *array) {
+        copy.push_back(CopyWithoutChildren(child));
+      }
+      for (size_t i = 0; i < array->size(); ++i) {
+        pending.push_back({&(*array)[i], &copy[i]});
+      }
+    } else if (const auto* box = get_if<MapBox>(&source->value); box && box->items) {
+      map<string, Node>& copy = *get<MapBox>(target->value).items;
+      for (const auto& [key, child] : *box->items) {
+        Node& added = copy.emplace_hint(copy.end(), key, CopyWithoutChildren(child))->second;
+        pending.push_back({&child, &added});
+      }
+    }
+  }
 }
 
-Node::Node(int value) : as_int(value) {
+Node& Node::operator=(const Node& other) {
+  if (this != &other) {
+    *this = Node(other);
+  }
+  return *this;
 }
 
-Node::Node(string value) : as_string(move(value)) {
+Node::~Node() {
+  if (holds_alternative<int>(value) || holds_alternative<string>(value)) {
+    return;
+  }
+  // Вложенные узлы разбираем через явный стек: к моменту разрушения
+  // у каждого из них детей уже нет
+  vector<Node> pending;
+  TakeChildren(pending);
+  while (!pending.empty()) {
+    Node node = move(pending.back());
+    pending.pop_back();
+    node.TakeChildren(pending);
+  }
+}
+
+Node Node::CopyWithoutChildren(const Node& node) {
+  if (const int* number = get_if<int>(&node.value)) {
+    return Node(*number);
+  } else if (const string* text = get_if<string>(&node.value)) {
+    return Node(*text);
+  } else if (holds_alternative<vector<Node>>(node.value)) {
+    return Node(vector<Node>());
+  }
+  return Node(map<string, Node>());
+}
+
+void Node::TakeChildren(vector<Node>& out) {
+  if (auto* array = get_if<vector<Node>>(&value)) {
+    for (Node& child : *array) {
+      out.push_back(move(child));
+    }
+    array->clear();
+  } else if (auto* box = get_if<MapBox>(&value); box && box->items) {
+    for (auto& [key, child] : *box->items) {
+      out.push_back(move(child));
+    }
+    box->items->clear();
+  }
 }
 
 const vector<Node>& Node::AsArray() const {
-  return as_array;
+  return get<vector<Node>>(value);
 }
 
 const map<string, Node>& Node::AsMap() const {
-  return as_map;
+  return get<MapBox>(value).Get();
 }
 
 int Node::AsInt() const {
-  return as_int;
+  return get<int>(value);
 }
 
 const string& Node::AsString() const {
-  return as_string;
+  return get<string>(value);
 }
 
 Document::Document(Node root) : root(move(root)) {
@@ -38,70 +136,156 @@ const Node& Document::GetRoot() const {
   return root;
 }
 
-Node LoadNode(istream& input);
-
-Node LoadArray(istream& input) {
-  vector<Node> result;
+namespace {
 
-  for (char c; input >> c && c != ']'; ) {
-    if (c != ',') {
-      input.putback(c);
-    }
-    result.push_back(LoadNode(input));
+// Следующий непробельный символ. Документ, оборванный посреди массива,
+// словаря или строки, не разбирается
+char Next(istream& input) {
+  char c;
+  if (!(input >> c)) {
+    throw invalid_argument("unexpected end of JSON");
   }
-
-  return Node(move(result));
+  return c;
 }
 
-Node LoadInt(istream& input) {
-  int result = 0;
-  while (isdigit(input.peek())) {
-    result *= 10;
-    result += input.get() - '0';
+// Строка до закрывающей кавычки, открывающая уже прочитана
+void ReadString(istream& input, string& buffer) {
+  getline(input, buffer, '"');
+  if (input.eof()) {
+    throw invalid_argument("unterminated JSON string");
   }
-  return Node(result);
 }
 
-Node LoadString(istream& input) {
-  string line;
-  getline(input, line, '"');
-  return Node(move(line));
+// Разбирает значение, первый символ которого c уже прочитан. Массив
+// и словарь только открываются: их содержимое разбирает цикл в Parse
+void ParseValue(istream& input, char c, Handler& handler, vector<char>& open, string& buffer) {
+  if (c == '[') {
+    open.push_back('[');
+    handler.StartArray();
+  } else if (c == '{') {
+    open.push_back('{');
+    handler.StartObject();
+  } else if (c == '"') {
+    ReadString(input, buffer);
+    handler.String(buffer);
+  } else {
+    input.putback(c);
+    int result = 0;
+    while (isdigit(input.peek())) {
+      result *= 10;
+      result += input.get() - '0';
+    }
+    handler.Int(result);
+  }
 }
 
-Node LoadDict(istream& input) {
-  map<string, Node> result;
+// Собирает дерево из событий. Незаконченные массивы и словари лежат в стеке
+class DomBuilder : public Handler {
+public:
+  void StartArray() override {
+    stack.push_back({false, {}, {}, {}});
+  }
 
-  for (char c; input >> c && c != '}'; ) {
-    if (c == ',') {
-      input >> c;
-    }
+  void EndArray() override {
+    vector<Node> array = move(stack.back().array);
+    stack.pop_back();
+    Add(Node(move(array)));
+  }
+
+  void StartObject() override {
+    stack.push_back({true, {}, {}, {}});
+  }
+
+  void Key(string_view key) override {
+    stack.back().key = key;
+  }
+
+  void EndObject() override {
+    map<string, Node> dict = move(stack.back().dict);
+    stack.pop_back();
+    Add(Node(move(dict)));
+  }
 
-    string key = LoadString(input).AsString();
-    input >> c;
-    result.insert({move(key), LoadNode(input)});
+  void Int(int value) override {
+    Add(Node(value));
   }
 
-  return Node(move(result));
+  void String(string_view value) override {
+    Add(Node(string(value)));
+  }
+
+  // Пустой документ, как и раньше, читается как 0
+  Node TakeRoot() {
+    return root ? move(*root) : Node(0);
+  }
+
+private:
+  struct Frame {
+    bool is_dict;
+    vector<Node> array;
+    map<string, Node> dict;
+    string key;
+  };
+
+  vector<Frame> stack;
+  optional<Node> root;
+
+  void Add(Node node) {
+    if (stack.empty()) {
+      root = move(node);
+    } else if (Frame& frame = stack.back(); frame.is_dict) {
+      frame.dict.insert({move(frame.key), move(node)});
+    } else {
+      frame.array.push_back(move(node));
+    }
+  }
+};
+
 }
 
-Node LoadNode(istream& input) {
+void Parse(istream& input, Handler& handler) {
+  // открытые массивы и словари: '[' или '{'
+  vector<char> open;
+  string buffer;
   char c;
-  input >> c;
-
-  if (c == '[') {
-    return LoadArray(input);
-  } else if (c == '{') {
-    return LoadDict(input);
-  } else if (c == '"') {
-    return LoadString(input);
-  } else {
-    input.putback(c);
-    return LoadInt(input);
+  if (!(input >> c)) {
+    return;
+  }
+  ParseValue(input, c, handler, open, buffer);
+  while (!open.empty()) {
+    c = Next(input);
+    if (open.back() == '[') {
+      if (c == ']') {
+        open.pop_back();
+        handler.EndArray();
+        continue;
+      }
+      if (c == ',') {
+        c = Next(input);
+      }
+    } else {
+      if (c == '}') {
+        open.pop_back();
+        handler.EndObject();
+        continue;
+      }
+      if (c == ',') {
+        c = Next(input);
+      }
+      // c -- открывающая кавычка ключа, за ключом идёт двоеточие
+      ReadString(input, buffer);
+      handler.Key(buffer);
+      Next(input);
+      c = Next(input);
+    }
+    ParseValue(input, c, handler, open, buffer);
   }
 }
 
 Document Load(istream& input) {
-  return Document{LoadNode(input)};
+  DomBuilder builder;
+  Parse(input, builder);
+  return Document{builder.TakeRoot()};
 }
 
 }
@@ -6,6 +6,9 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
 
 using namespace std;
 
@@ -106,9 +109,118 @@ void TestJsonToXml() {
   }
 }
 
+void TestJsonNode() {
+  using Json::Node;
+
+  // скалярный узел не тащит за собой пустые контейнеры
+  ASSERT(sizeof(Node) <= sizeof(string) + sizeof(void*));
+
+  Node original(map<string, Node>{
+    {"category", Node("food")},
+    {"items", Node(vector<Node>{Node(1), Node(string(100, 'x'))})},
+  });
+  Node copy = original;
+  ASSERT_EQUAL(copy.AsMap().at("category").AsString(), "food");
+  ASSERT_EQUAL(copy.AsMap().at("items").AsArray()[1].AsString(), string(100, 'x'));
+  ASSERT(&copy.AsMap() != &original.AsMap());
+
+  // перемещённый словарь читается и копируется как пустой
+  Node moved = move(copy);
+  ASSERT_EQUAL(moved.AsMap().size(), 2u);
+  ASSERT(copy.AsMap().empty());
+  Node copy_of_moved_from = copy;
+  ASSERT(copy_of_moved_from.AsMap().empty());
+  copy_of_moved_from = original;
+  ASSERT_EQUAL(copy_of_moved_from.AsMap().size(), 2u);
+
+  try {
+    Node(5).AsString();
+    ASSERT(false);
+  } catch (const bad_variant_access&) {
+  }
+}
+
+// Считает события разбора
+class EventCounter : public Json::Handler {
+public:
+  int containers = 0;
+  int keys = 0;
+  int scalars = 0;
+
+  void StartArray() override { ++containers; }
+  void StartObject() override { ++containers; }
+  void Key(string_view) override { ++keys; }
+  void Int(int) override { ++scalars; }
+  void String(string_view) override { ++scalars; }
+};
+
+void TestJsonParse() {
+  const string json = R"([
+    {"amount": 2500, "category": "food"},
+    {"category": "sport", "amount": 12000, "tags": ["a", "b"]}
+  ])";
+
+  istringstream events_input(json);
+  EventCounter counter;
+  Json::Parse(events_input, counter);
+  ASSERT_EQUAL(counter.containers, 4);
+  ASSERT_EQUAL(counter.keys, 5);
+  ASSERT_EQUAL(counter.scalars, 6);
+
+  istringstream load_input(json);
+  const Json::Document doc = Json::Load(load_input);
+  const vector<Json::Node>& items = doc.GetRoot().AsArray();
+  ASSERT_EQUAL(items.size(), 2u);
+  ASSERT_EQUAL(items[0].AsMap().at("category").AsString(), "food");
+  ASSERT_EQUAL(items[1].AsMap().at("amount").AsInt(), 12000);
+  ASSERT_EQUAL(items[1].AsMap().at("tags").AsArray()[1].AsString(), "b");
+
+  // оборванный документ -- ошибка, а не дерево без хвоста
+  for (const char* truncated : {"[1, 2", "[1,", R"({"a": 1,)", R"({"a")", R"({"a)",
+                                R"(["a)", R"([{"amount": 1}, {"amount": 2)"}) {
+    istringstream parse_input(truncated);
+    EventCounter ignored;
+    try {
+      Json::Parse(parse_input, ignored);
+      ASSERT(false);
+    } catch (const invalid_argument&) {
+    }
+    istringstream truncated_load_input(truncated);
+    try {
+      Json::Load(truncated_load_input);
+      ASSERT(false);
+    } catch (const invalid_argument&) {
+    }
+  }
+  istringstream empty_input("");
+  ASSERT_EQUAL(Json::Load(empty_input).GetRoot().AsInt(), 0);
+
+  // разбор не рекурсивный
+  const size_t depth = 1000000;
+  istringstream deep_input(string(depth, '[') + "1" + string(depth, ']'));
+  EventCounter deep;
+  Json::Parse(deep_input, deep);
+  ASSERT_EQUAL(deep.containers, static_cast<int>(depth));
+  ASSERT_EQUAL(deep.scalars, 1);
+
+  // дерево строится, копируется и разрушается тоже без рекурсии. На такой
+  // глубине рекурсивное разрушение переполняло стек даже с -O2
+  const size_t tree_depth = 200000;
+  istringstream deep_load_input(string(tree_depth, '[') + "1" + string(tree_depth, ']'));
+  const Json::Document deep_doc = Json::Load(deep_load_input);
+  const Json::Node deep_copy = deep_doc.GetRoot();
+  const Json::Node* node = &deep_copy;
+  for (size_t i = 0; i < tree_depth; ++i) {
+    node = &node->AsArray().at(0);
+  }
+  ASSERT_EQUAL(node->AsInt(), 1);
+}
+
 int main() {
   TestRunner tr;
   RUN_TEST(tr, TestXmlToJson);
   RUN_TEST(tr, TestJsonToXml);
+  RUN_TEST(tr, TestJsonNode);
+  RUN_TEST(tr, TestJsonParse);
   return 0;
 }
@@ -0,0 +1,335 @@
+#pragma once
+
+#include "order_statistics.h"
+#include "query.h"
+#include "record.h"
+#include "text_index.h"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <map>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class Database {
+public:
+  using Id = std::string;
+
+  bool Put(const Record& record) {
+    if (inDatabase(record.id)) {
+      return false;
+    }
+    else {
+      db[record.id] = {record};
+      Entry& e = db.at(record.id);
+
+      std::list<const Record*>& by_user_list = by_user[record.user];
+      by_user_list.push_back(&e.rec);
+      e.it_by_user = prev(by_user_list.end());
+
+      std::list<const Record*>& by_timestamp_list = by_timestamp[record.timestamp];
+      by_timestamp_list.push_back(&e.rec);
+      e.it_by_timestamp = prev(by_timestamp_list.end());
+
+      std::list<const Record*>& by_karma_list = by_karma[record.karma];
+      by_karma_list.push_back(&e.rec);
+      e.it_by_karma = prev(by_karma_list.end());
+
+      timestamp_stats.Add(record.timestamp);
+      karma_stats.Add(record.karma);
+
+      e.handle = next_handle++;
+      by_handle[e.handle] = &e.rec;
+      by_title.Add(e.handle, record.title);
+
+      return true;
+    }
+
+  }
+  const Record* GetById(const std::string& id) const {
+    if (inDatabase(id)) {
+      return &db.at(id).rec;
+    }
+    else {
+      return nullptr;
+    }
+  }
+
+  bool Erase(const std::string& id) {
+    if (inDatabase(id)) {
+      const Entry& e = db.at(id);
+      by_user[e.rec.user].erase(e.it_by_user);
+      by_timestamp[e.rec.timestamp].erase(e.it_by_timestamp);
+      by_karma[e.rec.karma].erase(e.it_by_karma);
+      timestamp_stats.Remove(e.rec.timestamp);
+      karma_stats.Remove(e.rec.karma);
+      by_title.Remove(e.handle, e.rec.title);
+      by_handle.erase(e.handle);
+      db.erase(id);
+      return true;
+    }
+    else {
+      return false;
+    }
+  }
+
+  template <typename Callback>
+  void RangeByTimestamp(int low, int high, Callback callback) const {
+    if (low > high) return;
+    auto begin = by_timestamp.lower_bound(low);
+    auto end = by_timestamp.upper_bound(high);
+    for (auto it = begin; it != end; ++it) {
+      for (const Record* rec : it->second) {
+        if(!callback(*rec)) return;
+      }
+    }
+  }
+
+  template <typename Callback>
+  void RangeByKarma(int low, int high, Callback callback) const {
+    if (low > high) return;
+    auto begin = by_karma.lower_bound(low);
+    auto end = by_karma.upper_bound(high);
+    for (auto it = begin; it != end; ++it) {
+      for (const Record* rec : it->second) {
+        if (!callback(*rec)) return;
+      }
+    }
+  }
+
+  template <typename Callback>
+  void AllByUser(const std::string& user, Callback callback) const {
+    if (by_user.count(user)) {
+      const std::list<const Record*>& by_user_list = by_user.at(user);
+      for (const Record* rec : by_user_list) {
+        if (!callback(*rec)) return;
+      }
+    }
+  }
+
+  // Записи, в title которых есть все (или хоть одно) из слов query,
+  // в порядке добавления
+  template <typename Callback>
+  void SearchByTitle(std::string_view query, TitleMatch match, Callback callback) const {
+    for (Handle handle : by_title.Find(Tokenize(query), match)) {
+      if (!callback(*by_handle.at(handle))) return;
+    }
+  }
+
+  size_t CountByTimestamp(int low, int high) const {
+    return timestamp_stats.CountInRange(low, high);
+  }
+
+  size_t CountByKarma(int low, int high) const {
+    return karma_stats.CountInRange(low, high);
+  }
+
+  // Не более k записей с timestamp из [low_ts, high_ts] с наибольшей кармой,
+  // по убыванию кармы; при равной карме первой идёт запись с меньшим id
+  std::vector<const Record*> TopKByKarma(int low_ts, int high_ts, size_t k) const {
+    const size_t window = CountByTimestamp(low_ts, high_ts);
+    if (window == 0 || k == 0) {
+      return {};
+    }
+    // Обход по убыванию кармы в среднем просматривает k * size / window
+    // записей, обход окна по timestamp -- ровно window
+    if (k * db.size() < window * window) {
+      return TopKByKarmaScan(low_ts, high_ts, k);
+    } else {
+      return TopKByTimestampScan(low_ts, high_ts, k);
+    }
+  }
+
+  // Выбирает способ выполнения запроса по оценкам числа записей в каждом
+  // подходящем индексе: обход самого избирательного индекса с проверкой
+  // остальных условий, пересечение двух самых избирательных индексов или
+  // полный обход
+  QueryPlan Explain(const Query& query) const {
+    QueryPlan plan;
+    if (query.User()) {
+      auto it = by_user.find(*query.User());
+      plan.estimates.push_back({AccessPath::User, it == by_user.end() ? 0 : it->second.size()});
+    }
+    if (auto range = query.Timestamp()) {
+      plan.estimates.push_back({AccessPath::Timestamp, CountByTimestamp(range->first, range->second)});
+    }
+    if (auto range = query.Karma()) {
+      plan.estimates.push_back({AccessPath::Karma, CountByKarma(range->first, range->second)});
+    }
+    if (!query.TitleWords().empty()) {
+      plan.estimates.push_back({AccessPath::Title, by_title.EstimateAllWords(query.TitleWords())});
+    }
+
+    plan.access = AccessPath::FullScan;
+    plan.cost = db.size() * kRecordCost;
+    for (const IndexEstimate& estimate : plan.estimates) {
+      const size_t cost = estimate.rows * kRecordCost + LookupCost(estimate, query);
+      if (cost < plan.cost) {
+        plan.access = estimate.index;
+        plan.cost = cost;
+      }
+    }
+
+    if (plan.estimates.size() >= 2) {
+      std::vector<IndexEstimate> sorted = plan.estimates;
+      std::sort(sorted.begin(), sorted.end(), [](const IndexEstimate& l, const IndexEstimate& r) {
+        return l.rows < r.rows;
+      });
+      const IndexEstimate& smaller = sorted[0];
+      const IndexEstimate& larger = sorted[1];
+      // Считаем условия независимыми
+      const size_t expected = db.empty() ? 0 : smaller.rows * larger.rows / db.size();
+      const size_t cost = (smaller.rows + larger.rows) * kHandleCost
+                        + LookupCost(smaller, query) + LookupCost(larger, query)
+                        + expected * kRecordCost;
+      if (cost < plan.cost) {
+        plan.access = AccessPath::Intersection;
+        plan.intersected = {smaller.index, larger.index};
+        plan.cost = cost;
+      }
+    }
+    return plan;
+  }
+
+  // Вызывает callback для записей, удовлетворяющих всем условиям query.
+  // Порядок записей определяется выбранным планом, который и возвращается.
+  template <typename Callback>
+  QueryPlan Select(const Query& query, Callback callback) const {
+    QueryPlan plan = Explain(query);
+    if (plan.access == AccessPath::Intersection) {
+      std::unordered_set<const Record*> candidates;
+      ScanIndex(plan.intersected[0], query, [&candidates](const Record& rec) {
+        candidates.insert(&rec);
+        return true;
+      });
+      ScanIndex(plan.intersected[1], query, [&](const Record& rec) {
+        return !candidates.count(&rec) || !query.Matches(rec, plan.intersected) || callback(rec);
+      });
+    } else {
+      const std::vector<AccessPath> satisfied = {plan.access};
+      ScanIndex(plan.access, query, [&](const Record& rec) {
+        return !query.Matches(rec, satisfied) || callback(rec);
+      });
+    }
+    return plan;
+  }
+
+  // Записывает все записи и три вторичных индекса в бинарный файл снимка,
+  // который потом открывается через OpenSnapshot (см. snapshot.h)
+  void SaveSnapshot(const std::string& path) const;
+
+private:
+  struct Entry {
+    Record rec;
+    std::list<const Record*>::iterator it_by_user;
+    std::list<const Record*>::iterator it_by_timestamp;
+    std::list<const Record*>::iterator it_by_karma;
+    Handle handle;
+  };
+
+  std::unordered_map<Id, Entry> db;
+  std::unordered_map<std::string, std::list<const Record*>> by_user;
+  std::map<int, std::list<const Record*>> by_timestamp;
+  std::map<int, std::list<const Record*>> by_karma;
+  OrderStatistics timestamp_stats;
+  OrderStatistics karma_stats;
+  // Идентификаторы выдаются по возрастанию, поэтому списки в by_title
+  // пополняются только с конца
+  Handle next_handle = 0;
+  std::unordered_map<Handle, const Record*> by_handle;
+  TextIndex by_title;
+
+  bool inDatabase(const Id& id) const {
+    return db.count(id);
+  }
+
+  // Условные стоимости для Explain: чтение записи с проверкой условий
+  // заметно дороже операции над множеством указателей
+  static constexpr size_t kRecordCost = 4;
+  static constexpr size_t kHandleCost = 1;
+
+  // Пересечение списков слов обходит каждый список не дальше самого короткого
+  static size_t LookupCost(const IndexEstimate& estimate, const Query& query) {
+    if (estimate.index == AccessPath::Title) {
+      return estimate.rows * query.TitleWords().size() * kHandleCost;
+    }
+    return 0;
+  }
+
+  template <typename Callback>
+  void ScanIndex(AccessPath index, const Query& query, Callback callback) const {
+    switch (index) {
+      case AccessPath::User:
+        AllByUser(*query.User(), callback);
+        break;
+      case AccessPath::Timestamp:
+        RangeByTimestamp(query.Timestamp()->first, query.Timestamp()->second, callback);
+        break;
+      case AccessPath::Karma:
+        RangeByKarma(query.Karma()->first, query.Karma()->second, callback);
+        break;
+      case AccessPath::Title:
+        for (Handle handle : by_title.Find(query.TitleWords(), TitleMatch::AllWords)) {
+          if (!callback(*by_handle.at(handle))) return;
+        }
+        break;
+      default:
+        RangeByTimestamp(std::numeric_limits<int>::min(), std::numeric_limits<int>::max(), callback);
+        break;
+    }
+  }
+
+  static bool HigherKarma(const Record* l, const Record* r) {
+    return std::tie(r->karma, l->id) < std::tie(l->karma, r->id);
+  }
+
+  static std::vector<const Record*> FirstK(std::vector<const Record*> records, size_t k) {
+    std::sort(records.begin(), records.end(), HigherKarma);
+    if (records.size() > k) {
+      records.resize(k);
+    }
+    return records;
+  }
+
+  // Идём от максимальной кармы и останавливаемся, как только набрали k записей
+  // и дочитали текущее значение кармы, среди которого могут быть меньшие id
+  std::vector<const Record*> TopKByKarmaScan(int low_ts, int high_ts, size_t k) const {
+    std::vector<const Record*> result;
+    for (auto it = by_karma.rbegin(); it != by_karma.rend() && result.size() < k; ++it) {
+      for (const Record* rec : it->second) {
+        if (low_ts <= rec->timestamp && rec->timestamp <= high_ts) {
+          result.push_back(rec);
+        }
+      }
+    }
+    return FirstK(std::move(result), k);
+  }
+
+  std::vector<const Record*> TopKByTimestampScan(int low_ts, int high_ts, size_t k) const {
+    // Куча из k лучших записей, на вершине худшая из них
+    std::priority_queue<const Record*, std::vector<const Record*>, decltype(&HigherKarma)>
+      best(HigherKarma);
+    RangeByTimestamp(low_ts, high_ts, [&](const Record& rec) {
+      if (best.size() < k) {
+        best.push(&rec);
+      } else if (HigherKarma(&rec, best.top())) {
+        best.pop();
+        best.push(&rec);
+      }
+      return true;
+    });
+    std::vector<const Record*> result;
+    result.reserve(best.size());
+    for (; !best.empty(); best.pop()) {
+      result.push_back(best.top());
+    }
+    return FirstK(std::move(result), k);
+  }
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "database.h"
+#include "record.h"
+#include "wal.h"
+
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+// Database, изменения которой переживают падение процесса. Put и Erase
+// пишутся в журнал path + ".wal" и возвращают управление только после того,
+// как группа, в которую попала запись, сброшена на диск. Читатели видят
+// изменение только после этого: записи журнала применяются к базе в порядке
+// их номеров, когда они уже на диске. Checkpoint сохраняет
+// снимок в path + ".snapshot" и обрезает журнал. При открытии загружается
+// снимок и поверх него проигрывается журнал.
+class DurableDatabase {
+public:
+  explicit DurableDatabase(const std::string& path, WalOptions options = {});
+
+  bool Put(const Record& record);
+  bool Erase(const std::string& id);
+  void Checkpoint();
+
+  std::optional<Record> GetById(const std::string& id) const {
+    std::shared_lock lock(m);
+    if (const Record* rec = db.GetById(id)) {
+      return *rec;
+    }
+    return std::nullopt;
+  }
+
+  template <typename Callback>
+  void RangeByTimestamp(int low, int high, Callback callback) const {
+    std::shared_lock lock(m);
+    db.RangeByTimestamp(low, high, callback);
+  }
+
+  template <typename Callback>
+  void RangeByKarma(int low, int high, Callback callback) const {
+    std::shared_lock lock(m);
+    db.RangeByKarma(low, high, callback);
+  }
+
+  template <typename Callback>
+  void AllByUser(const std::string& user, Callback callback) const {
+    std::shared_lock lock(m);
+    db.AllByUser(user, callback);
+  }
+
+  uint64_t SyncCount() const {
+    return wal.SyncCount();
+  }
+
+private:
+  const std::string snapshot_path;
+  mutable std::shared_mutex m;
+  Database db;
+  WriteAheadLog wal;
+
+  // Записи, попавшие в журнал, но ещё не применённые к db
+  struct PendingEntry {
+    uint64_t lsn;
+    std::string id;
+    std::string entry;
+  };
+  std::deque<PendingEntry> unapplied;
+  // Для id из unapplied: есть ли запись после последней операции над ней
+  // и номер этой операции
+  struct PendingState {
+    bool exists;
+    uint64_t lsn;
+  };
+  std::unordered_map<std::string, PendingState> in_flight;
+
+  bool Exists(const std::string& id) const;
+  void Log(const std::string& id, bool exists, std::string entry,
+           std::unique_lock<std::shared_mutex>& lock);
+  void ApplyDurable(uint64_t lsn);
+  void Apply(std::string_view entry);
+};
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "record.h"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Многоверсионная Database. Каждый Put и Erase создаёт новую эпоху; запись
+// видна в эпохах [begin, end). Читатель фиксирует эпоху в ReadView и обходит
+// индексы порциями, отпуская блокировку на время вызова колбэка, так что
+// долгие обходы не мешают писателям. Удалённые версии освобождаются, когда
+// не остаётся читателей с эпохой меньше их end.
+class MvccDatabase {
+private:
+  static constexpr uint64_t kInfinity = std::numeric_limits<uint64_t>::max();
+
+  struct Version {
+    Record rec;
+    uint64_t begin;
+    std::atomic<uint64_t> end{kInfinity};
+
+    bool VisibleAt(uint64_t epoch) const {
+      return begin <= epoch && epoch < end.load(std::memory_order_acquire);
+    }
+  };
+
+  // Ключ индекса: значение поля и эпоха создания версии, которая
+  // упорядочивает записи с одинаковым значением по времени добавления
+  template <typename T>
+  using Index = std::map<std::pair<T, uint64_t>, const Version*>;
+
+public:
+  using Id = std::string;
+
+  class ReadView {
+  public:
+    explicit ReadView(const MvccDatabase& db);
+    ReadView(const ReadView&) = delete;
+    ReadView& operator=(const ReadView&) = delete;
+    ~ReadView();
+
+    uint64_t Epoch() const {
+      return epoch;
+    }
+
+    // Указатель действителен, пока жив ReadView
+    const Record* GetById(const Id& id) const;
+
+    template <typename Callback>
+    void RangeByTimestamp(int low, int high, Callback callback) const {
+      Scan(db.by_timestamp, std::pair{low, uint64_t(0)}, std::pair{high, kInfinity}, callback);
+    }
+
+    template <typename Callback>
+    void RangeByKarma(int low, int high, Callback callback) const {
+      Scan(db.by_karma, std::pair{low, uint64_t(0)}, std::pair{high, kInfinity}, callback);
+    }
+
+    template <typename Callback>
+    void AllByUser(const std::string& user, Callback callback) const {
+      Scan(db.by_user, std::pair{user, uint64_t(0)}, std::pair{user, kInfinity}, callback);
+    }
+
+  private:
+    static constexpr size_t kScanBatch = 256;
+
+    const MvccDatabase& db;
+    uint64_t epoch;
+
+    template <typename Key, typename Callback>
+    void Scan(const std::map<Key, const Version*>& index, const Key& low, const Key& high,
+              Callback& callback) const {
+      std::vector<const Version*> batch;
+      Key cursor = low;
+      bool inclusive = true;
+      bool done = false;
+      while (!done) {
+        batch.clear();
+        {
+          std::shared_lock lock(db.index_mutex);
+          auto it = inclusive ? index.lower_bound(cursor) : index.upper_bound(cursor);
+          for (size_t examined = 0; examined < kScanBatch; ++examined, ++it) {
+            if (it == index.end() || high < it->first) {
+              done = true;
+              break;
+            }
+            if (it->second->VisibleAt(epoch)) {
+              batch.push_back(it->second);
+            }
+            cursor = it->first;
+            inclusive = false;
+          }
+        }
+        for (const Version* version : batch) {
+          if (!callback(version->rec)) return;
+        }
+      }
+    }
+  };
+
+  MvccDatabase() = default;
+  MvccDatabase(const MvccDatabase&) = delete;
+  MvccDatabase& operator=(const MvccDatabase&) = delete;
+
+  bool Put(const Record& record);
+  bool Erase(const Id& id);
+
+  ReadView OpenView() const {
+    return ReadView(*this);
+  }
+
+  // Обходы на собственной эпохе, без явного ReadView
+  template <typename Callback>
+  void RangeByTimestamp(int low, int high, Callback callback) const {
+    OpenView().RangeByTimestamp(low, high, callback);
+  }
+
+  template <typename Callback>
+  void RangeByKarma(int low, int high, Callback callback) const {
+    OpenView().RangeByKarma(low, high, callback);
+  }
+
+  template <typename Callback>
+  void AllByUser(const std::string& user, Callback callback) const {
+    OpenView().AllByUser(user, callback);
+  }
+
+  // Освобождает версии, которые не видит ни один открытый ReadView.
+  // Писатели вызывают её сами каждые kCollectEvery удалений.
+  void CollectGarbage();
+
+  size_t VersionCount() const;
+
+private:
+  static constexpr size_t kCollectEvery = 64;
+
+  mutable std::shared_mutex index_mutex;
+  std::unordered_map<Id, std::vector<std::unique_ptr<Version>>> by_id;
+  Index<int> by_timestamp;
+  Index<int> by_karma;
+  Index<std::string> by_user;
+
+  // Писатели выполняются по одному; читатели их не ждут
+  std::mutex writer_mutex;
+  std::atomic<uint64_t> committed_epoch{0};
+  std::deque<const Version*> retired;
+  size_t retired_since_collect = 0;
+
+  mutable std::mutex readers_mutex;
+  mutable std::multiset<uint64_t> active_epochs;
+
+  Version* LatestLive(const Id& id) const;
+  void Collect();
+  void Unlink(const Version* version);
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <utility>
+
+// Мультимножество целых ключей, умеющее за O(log n) считать, сколько ключей
+// попало в отрезок. Реализовано декартовым деревом по ключу, в узлах которого
+// хранится кратность ключа и сумма кратностей поддерева. В отличие от дерева
+// Фенвика над сжатыми координатами, не требует заранее знать все ключи.
+class OrderStatistics {
+public:
+  void Add(int key) {
+    if (Node* node = Find(key)) {
+      AddAlongPath(key, 1);
+      ++node->count;
+      return;
+    }
+    auto [less, rest] = Split(std::move(root), key);
+    auto node = std::make_unique<Node>(key, random());
+    root = Merge(Merge(std::move(less), std::move(node)), std::move(rest));
+  }
+
+  // Ключ должен присутствовать в множестве
+  void Remove(int key) {
+    AddAlongPath(key, -1);
+    Node* node = Find(key);
+    if (--node->count > 0) {
+      return;
+    }
+    std::unique_ptr<Node>* link = &root;
+    while ((*link)->key != key) {
+      link = key < (*link)->key ? &(*link)->left : &(*link)->right;
+    }
+    auto left = std::move((*link)->left);
+    auto right = std::move((*link)->right);
+    *link = Merge(std::move(left), std::move(right));
+  }
+
+  size_t CountInRange(int low, int high) const {
+    if (low > high) {
+      return 0;
+    }
+    return CountNotGreater(high) - CountLess(low);
+  }
+
+  size_t Size() const {
+    return Total(root.get());
+  }
+
+private:
+  struct Node {
+    int key;
+    uint32_t priority;
+    size_t count = 1;
+    size_t total = 1;
+    std::unique_ptr<Node> left;
+    std::unique_ptr<Node> right;
+
+    Node(int key, uint32_t priority) : key(key), priority(priority) {
+    }
+  };
+
+  std::unique_ptr<Node> root;
+  std::minstd_rand random;
+
+  static size_t Total(const Node* node) {
+    return node ? node->total : 0;
+  }
+
+  static void Update(Node* node) {
+    node->total = node->count + Total(node->left.get()) + Total(node->right.get());
+  }
+
+  Node* Find(int key) const {
+    Node* node = root.get();
+    while (node && node->key != key) {
+      node = key < node->key ? node->left.get() : node->right.get();
+    }
+    return node;
+  }
+
+  void AddAlongPath(int key, int delta) {
+    for (Node* node = root.get(); node; ) {
+      node->total += delta;
+      if (node->key == key) {
+        break;
+      }
+      node = key < node->key ? node->left.get() : node->right.get();
+    }
+  }
+
+  // Делит дерево на ключи меньше key и все остальные
+  static std::pair<std::unique_ptr<Node>, std::unique_ptr<Node>>
+  Split(std::unique_ptr<Node> node, int key) {
+    if (!node) {
+      return {nullptr, nullptr};
+    }
+    if (node->key < key) {
+      auto [less, rest] = Split(std::move(node->right), key);
+      node->right = std::move(less);
+      Update(node.get());
+      return {std::move(node), std::move(rest)};
+    } else {
+      auto [less, rest] = Split(std::move(node->left), key);
+      node->left = std::move(rest);
+      Update(node.get());
+      return {std::move(less), std::move(node)};
+    }
+  }
+
+  static std::unique_ptr<Node> Merge(std::unique_ptr<Node> left, std::unique_ptr<Node> right) {
+    if (!left) {
+      return right;
+    }
+    if (!right) {
+      return left;
+    }
+    if (left->priority > right->priority) {
+      left->right = Merge(std::move(left->right), std::move(right));
+      Update(left.get());
+      return left;
+    } else {
+      right->left = Merge(std::move(left), std::move(right->left));
+      Update(right.get());
+      return right;
+    }
+  }
+
+  size_t CountLess(int key) const {
+    size_t result = 0;
+    for (const Node* node = root.get(); node; ) {
+      if (node->key < key) {
+        result += Total(node->left.get()) + node->count;
+        node = node->right.get();
+      } else {
+        node = node->left.get();
+      }
+    }
+    return result;
+  }
+
+  size_t CountNotGreater(int key) const {
+    size_t result = 0;
+    for (const Node* node = root.get(); node; ) {
+      if (node->key <= key) {
+        result += Total(node->left.get()) + node->count;
+        node = node->right.get();
+      } else {
+        node = node->left.get();
+      }
+    }
+    return result;
+  }
+};
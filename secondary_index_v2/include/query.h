@@ -0,0 +1,79 @@
+#pragma once
+
+#include "record.h"
+
+#include <cstddef>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+enum class AccessPath {
+  FullScan,
+  User,
+  Timestamp,
+  Karma,
+  Title,
+  Intersection,
+};
+
+std::ostream& operator<<(std::ostream& output, AccessPath path);
+
+// Конъюнкция условий на запись. Повторное условие на то же поле сужает его.
+class Query {
+public:
+  using Range = std::pair<int, int>;
+
+  Query& ByUser(std::string user);
+  Query& TimestampBetween(int low, int high);
+  Query& KarmaBetween(int low, int high);
+  Query& KarmaAtLeast(int low);
+  // В title должны встретиться все слова из words
+  Query& TitleHasWords(std::string_view words);
+
+  const std::optional<std::string>& User() const {
+    return user;
+  }
+  const std::optional<Range>& Timestamp() const {
+    return timestamp;
+  }
+  const std::optional<Range>& Karma() const {
+    return karma;
+  }
+  const std::vector<std::string>& TitleWords() const {
+    return title_words;
+  }
+  bool Empty() const {
+    return !user && !timestamp && !karma && title_words.empty();
+  }
+
+  // satisfied -- индексы, из которых пришла запись; их условия заведомо выполнены
+  bool Matches(const Record& record, const std::vector<AccessPath>& satisfied = {}) const;
+
+private:
+  std::optional<std::string> user;
+  std::optional<Range> timestamp;
+  std::optional<Range> karma;
+  std::vector<std::string> title_words;
+  // Запрос по двум разным пользователям не совпадает ни с чем
+  bool contradictory = false;
+};
+
+struct IndexEstimate {
+  AccessPath index;
+  size_t rows;
+};
+
+// План выполнения запроса: оценки числа записей по каждому подходящему
+// индексу и выбранный способ доступа. Для Intersection в intersected
+// перечислены индексы, множества записей которых пересекаются.
+struct QueryPlan {
+  AccessPath access = AccessPath::FullScan;
+  std::vector<AccessPath> intersected;
+  std::vector<IndexEstimate> estimates;
+  size_t cost = 0;
+};
+
+std::ostream& operator<<(std::ostream& output, const QueryPlan& plan);
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <tuple>
+
+struct Record {
+  std::string id;
+  std::string title;
+  std::string user;
+  int timestamp;
+  int karma;
+};
+
+struct RecordHasher {
+  size_t operator() (const Record& r) const {
+    std::hash<std::string> str_hash;
+    std::hash<int> int_hash;
+    int coef = 5003081;
+    return
+      coef * coef * coef * coef * str_hash(r.id) +
+             coef * coef * coef * str_hash(r.title) +
+                    coef * coef * str_hash(r.user) +
+                           coef * int_hash(r.timestamp) +
+                                  int_hash(r.karma);
+  }
+};
+
+inline bool operator== (const Record& l, const Record& r) {
+  return
+    l.id == r.id &&
+    l.title == r.title &&
+    l.user == r.user &&
+    l.timestamp == r.timestamp &&
+    l.karma == r.karma;
+}
+
+inline bool operator< (const Record& l, const Record& r) {
+  return
+    std::tie(l.id, l.title, l.user, l.timestamp, l.karma) <
+    std::tie(r.id, r.title, r.user, r.timestamp, r.karma);
+}
+
+// Невладеющее представление записи. Строки указывают либо в Record,
+// либо прямо в отображённый в память файл снимка.
+struct RecordView {
+  std::string_view id;
+  std::string_view title;
+  std::string_view user;
+  int timestamp;
+  int karma;
+
+  RecordView(std::string_view id, std::string_view title, std::string_view user,
+             int timestamp, int karma)
+    : id(id), title(title), user(user), timestamp(timestamp), karma(karma)
+  {
+  }
+
+  RecordView(const Record& r)
+    : RecordView(r.id, r.title, r.user, r.timestamp, r.karma)
+  {
+  }
+
+  Record ToRecord() const {
+    return {std::string(id), std::string(title), std::string(user), timestamp, karma};
+  }
+};
@@ -0,0 +1,254 @@
+#pragma once
+
+#include "database.h"
+#include "record.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Формат файла снимка (версия 2, порядок байт машины, все секции выровнены на 8):
+//
+//   SnapshotHeader
+//   RecordEntry[record_count]     -- записи, отсортированные по id
+//   IndexEntry[record_count]      -- индекс по timestamp: (ключ, номер записи)
+//   IndexEntry[record_count]      -- индекс по karma
+//   UserEntry[user_count]         -- пользователи, отсортированные по имени
+//   uint32_t[record_count]        -- номера записей, сгруппированные по пользователям
+//   uint32_t[record_count]        -- номера записей в порядке их добавления
+//   char[strings_size]            -- пул строк, на который ссылаются StringRef
+//
+// Внутри одного ключа индексы хранят записи в том же порядке, что и Database,
+// поэтому обход снимка выдаёт записи в той же последовательности.
+namespace SnapshotFormat {
+
+constexpr char kMagic[8] = {'S', 'I', 'D', 'X', 'S', 'N', 'A', 'P'};
+constexpr uint32_t kVersion = 2;
+constexpr uint32_t kByteOrderMark = 0x01020304;
+
+struct StringRef {
+  uint64_t offset;
+  uint32_t size;
+  uint32_t reserved;
+};
+
+struct RecordEntry {
+  StringRef id;
+  StringRef title;
+  StringRef user;
+  int32_t timestamp;
+  int32_t karma;
+};
+
+struct IndexEntry {
+  int32_t key;
+  uint32_t record;
+};
+
+struct UserEntry {
+  StringRef name;
+  uint32_t begin;
+  uint32_t end;
+};
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t record_count;
+  uint32_t user_count;
+  uint64_t records_offset;
+  uint64_t by_timestamp_offset;
+  uint64_t by_karma_offset;
+  uint64_t users_offset;
+  uint64_t by_user_offset;
+  uint64_t by_insertion_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+  uint64_t file_size;
+};
+
+}
+
+// Файл, целиком отображённый в память только для чтения
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& path);
+  MappedFile(MappedFile&& other);
+  MappedFile& operator=(MappedFile&& other);
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+
+  const char* Data() const {
+    return data;
+  }
+  size_t Size() const {
+    return size;
+  }
+
+private:
+  const char* data = nullptr;
+  size_t size = 0;
+
+  void Release();
+};
+
+// Снимок базы, который обслуживает запросы прямо из отображения,
+// не десериализуя записи
+class Snapshot {
+public:
+  using IndexEntry = SnapshotFormat::IndexEntry;
+  using IndexRange = std::pair<const IndexEntry*, const IndexEntry*>;
+  using UserRange = std::pair<const uint32_t*, const uint32_t*>;
+
+  explicit Snapshot(MappedFile file);
+
+  size_t RecordCount() const {
+    return header->record_count;
+  }
+
+  RecordView Get(uint32_t index) const;
+  std::optional<uint32_t> Find(std::string_view id) const;
+
+  IndexRange ByTimestamp(int low, int high) const;
+  IndexRange ByKarma(int low, int high) const;
+  UserRange ByUser(std::string_view user) const;
+  // Номера всех записей в том порядке, в каком они добавлялись в Database
+  UserRange ByInsertion() const;
+
+private:
+  MappedFile file;
+  const SnapshotFormat::Header* header;
+  const SnapshotFormat::RecordEntry* records;
+  const IndexEntry* by_timestamp;
+  const IndexEntry* by_karma;
+  const SnapshotFormat::UserEntry* users;
+  const uint32_t* by_user;
+  const uint32_t* by_insertion;
+  const char* strings;
+
+  std::string_view String(const SnapshotFormat::StringRef& ref) const {
+    return {strings + ref.offset, ref.size};
+  }
+  static IndexRange Range(const IndexEntry* begin, const IndexEntry* end, int low, int high);
+  void Verify() const;
+};
+
+// Снимок плюс изменения, сделанные после его открытия. Новые записи живут
+// в обычной Database, удалённые из снимка записи помечаются в битовой маске.
+// Колбэки получают RecordView, так как записи снимка не материализуются.
+class SnapshotDatabase {
+public:
+  explicit SnapshotDatabase(Snapshot base)
+    : base(std::move(base))
+    , erased(this->base.RecordCount(), false)
+  {
+  }
+
+  bool Put(const Record& record) {
+    if (GetById(record.id)) {
+      return false;
+    }
+    return delta.Put(record);
+  }
+
+  std::optional<RecordView> GetById(const std::string& id) const {
+    if (const Record* rec = delta.GetById(id)) {
+      return RecordView(*rec);
+    }
+    if (auto index = FindInBase(id)) {
+      return base.Get(*index);
+    }
+    return std::nullopt;
+  }
+
+  bool Erase(const std::string& id) {
+    if (delta.Erase(id)) {
+      return true;
+    }
+    if (auto index = FindInBase(id)) {
+      erased[*index] = true;
+      return true;
+    }
+    return false;
+  }
+
+  template <typename Callback>
+  void RangeByTimestamp(int low, int high, Callback callback) const {
+    MergeWithDelta(base.ByTimestamp(low, high), &Record::timestamp,
+      [&](auto delta_callback) {
+        delta.RangeByTimestamp(low, high, delta_callback);
+      },
+      callback);
+  }
+
+  template <typename Callback>
+  void RangeByKarma(int low, int high, Callback callback) const {
+    MergeWithDelta(base.ByKarma(low, high), &Record::karma,
+      [&](auto delta_callback) {
+        delta.RangeByKarma(low, high, delta_callback);
+      },
+      callback);
+  }
+
+  template <typename Callback>
+  void AllByUser(const std::string& user, Callback callback) const {
+    auto [begin, end] = base.ByUser(user);
+    for (auto it = begin; it != end; ++it) {
+      if (!erased[*it] && !callback(base.Get(*it))) return;
+    }
+    delta.AllByUser(user, [&callback](const Record& rec) {
+      return callback(RecordView(rec));
+    });
+  }
+
+private:
+  Snapshot base;
+  std::vector<bool> erased;
+  Database delta;
+
+  std::optional<uint32_t> FindInBase(std::string_view id) const {
+    auto index = base.Find(id);
+    if (index && !erased[*index]) {
+      return index;
+    }
+    return std::nullopt;
+  }
+
+  // Сливает диапазон индекса снимка с тем же диапазоном в delta. Записи снимка
+  // добавлены раньше, поэтому при равных ключах идут первыми.
+  template <typename DeltaScan, typename Callback>
+  void MergeWithDelta(Snapshot::IndexRange range, int Record::* key,
+                      DeltaScan delta_scan, Callback& callback) const {
+    auto [it, end] = range;
+    auto emit_base_until = [&](auto fits) {
+      for (; it != end && fits(it->key); ++it) {
+        if (!erased[it->record] && !callback(base.Get(it->record))) {
+          return false;
+        }
+      }
+      return true;
+    };
+
+    bool stopped = false;
+    delta_scan([&](const Record& rec) {
+      stopped = !emit_base_until([&](int k) { return k <= rec.*key; })
+             || !callback(RecordView(rec));
+      return !stopped;
+    });
+    if (!stopped) {
+      emit_base_until([](int) { return true; });
+    }
+  }
+};
+
+SnapshotDatabase OpenSnapshot(const std::string& path);
+
+// Читает снимок целиком в обычную Database. Записи добавляются в исходном
+// порядке, так что порядок внутри всех индексов сохраняется.
+Database LoadSnapshot(const std::string& path);
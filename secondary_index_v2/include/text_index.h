@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using Handle = uint64_t;
+
+// Слова текста в нижнем регистре без повторов. Словом считается
+// последовательность букв и цифр; байты за пределами ASCII (например, UTF-8)
+// считаются частью слова.
+std::vector<std::string> Tokenize(std::string_view text);
+
+// Возрастающий список идентификаторов, сжатый разностями в varint. Список
+// разбит на блоки не более чем по kBlockSize элементов, первые значения блоков
+// хранятся отдельно и позволяют перепрыгивать блоки, не распаковывая их.
+// Удаление перепаковывает только тот блок, где лежало значение.
+class PostingList {
+public:
+  static constexpr size_t kBlockSize = 128;
+
+  class Iterator {
+  public:
+    explicit Iterator(const PostingList& list);
+
+    bool AtEnd() const {
+      return block >= list->blocks.size();
+    }
+    Handle Value() const {
+      return value;
+    }
+    void Next();
+    // Переходит к первому значению, не меньшему target
+    void SkipTo(Handle target);
+
+  private:
+    const PostingList* list;
+    size_t block = 0;
+    size_t position = 0;
+    size_t offset = 0;
+    Handle value = 0;
+
+    void EnterBlock(size_t block);
+  };
+
+  // handle должен быть больше всех уже добавленных
+  void Append(Handle handle);
+  bool Remove(Handle handle);
+
+  size_t Size() const {
+    return size;
+  }
+  size_t ByteSize() const;
+  Iterator Begin() const {
+    return Iterator(*this);
+  }
+
+private:
+  struct Block {
+    Handle first;
+    size_t count;
+    // Разности между соседними значениями, начиная со второго
+    std::vector<uint8_t> deltas;
+  };
+
+  std::vector<Block> blocks;
+  size_t size = 0;
+  Handle last = 0;
+
+  static std::vector<Handle> Decode(const Block& block);
+};
+
+enum class TitleMatch {
+  AllWords,
+  AnyWord,
+};
+
+class TextIndex {
+public:
+  void Add(Handle handle, std::string_view text);
+  void Remove(Handle handle, std::string_view text);
+
+  // Верхняя оценка числа записей, содержащих все слова
+  size_t EstimateAllWords(const std::vector<std::string>& words) const;
+
+  // Идентификаторы по возрастанию
+  std::vector<Handle> Find(const std::vector<std::string>& words, TitleMatch match) const;
+
+private:
+  std::unordered_map<std::string, PostingList> postings;
+
+  static std::vector<Handle> Intersect(std::vector<const PostingList*> lists);
+  static std::vector<Handle> Unite(std::vector<const PostingList*> lists);
+};
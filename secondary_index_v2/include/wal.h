@@ -0,0 +1,61 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+struct WalOptions {
+  // Сколько лидер группы ждёт присоединения других писателей перед fdatasync.
+  // Ноль означает, что группу образуют только те, кто пришёл во время
+  // предыдущего fdatasync.
+  std::chrono::microseconds commit_delay{0};
+  // Группа сбрасывается, не дожидаясь commit_delay, как только накопилось
+  // столько байт
+  size_t max_batch_bytes = 1 << 20;
+};
+
+// Журнал упреждающей записи с групповой фиксацией. Каждая запись хранится
+// как [размер][crc32][данные]; повреждённый хвост при Replay отрезается.
+class WriteAheadLog {
+public:
+  explicit WriteAheadLog(const std::string& path, WalOptions options = {});
+  WriteAheadLog(const WriteAheadLog&) = delete;
+  WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+  ~WriteAheadLog();
+
+  // Вызывает handler для каждой целой записи журнала по порядку
+  void Replay(const std::function<void(std::string_view)>& handler);
+
+  // Добавляет запись в текущую группу и возвращает её номер
+  uint64_t Append(std::string_view payload);
+  // Возвращает управление, когда запись с номером lsn и все предыдущие
+  // оказались на диске
+  void WaitDurable(uint64_t lsn);
+
+  // Отбрасывает содержимое журнала. Вызывается после того, как все его
+  // записи попали в снимок.
+  void Truncate();
+
+  uint64_t SyncCount() const;
+
+private:
+  const std::string path;
+  const WalOptions options;
+  int fd;
+
+  mutable std::mutex m;
+  std::condition_variable durable_cv;
+  std::condition_variable batch_full_cv;
+  std::string pending;
+  uint64_t appended_lsn = 0;
+  uint64_t durable_lsn = 0;
+  uint64_t sync_count = 0;
+  bool flushing = false;
+  bool failed = false;
+
+  void WriteAndSync(const std::string& batch);
+};
@@ -0,0 +1,172 @@
+#include "durable_database.h"
+#include "snapshot.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+const char kPutOp = 'P';
+const char kEraseOp = 'E';
+
+void WriteInt(string& out, int32_t value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteString(string& out, const string& s) {
+  WriteInt(out, s.size());
+  out += s;
+}
+
+class EntryReader {
+public:
+  explicit EntryReader(string_view data) : data(data) {
+  }
+
+  int32_t ReadInt() {
+    int32_t value;
+    memcpy(&value, Take(sizeof(value)).data(), sizeof(value));
+    return value;
+  }
+
+  string ReadString() {
+    return string(Take(ReadInt()));
+  }
+
+  char ReadOp() {
+    return Take(1)[0];
+  }
+
+private:
+  string_view data;
+
+  string_view Take(size_t size) {
+    if (size > data.size()) {
+      throw runtime_error("Malformed log entry");
+    }
+    string_view result = data.substr(0, size);
+    data.remove_prefix(size);
+    return result;
+  }
+};
+
+string EncodePut(const Record& record) {
+  string entry(1, kPutOp);
+  WriteString(entry, record.id);
+  WriteString(entry, record.title);
+  WriteString(entry, record.user);
+  WriteInt(entry, record.timestamp);
+  WriteInt(entry, record.karma);
+  return entry;
+}
+
+string EncodeErase(const string& id) {
+  string entry(1, kEraseOp);
+  WriteString(entry, id);
+  return entry;
+}
+
+}
+
+DurableDatabase::DurableDatabase(const string& path, WalOptions options)
+  : snapshot_path(path + ".snapshot")
+  , db(access(snapshot_path.c_str(), F_OK) == 0 ? LoadSnapshot(snapshot_path) : Database())
+  , wal(path + ".wal", options)
+{
+  // В журнал попадают только успешные операции, поэтому повторное
+  // проигрывание записей, уже вошедших в снимок, приводит к тому же состоянию
+  wal.Replay([this](string_view entry) {
+    Apply(entry);
+  });
+}
+
+bool DurableDatabase::Put(const Record& record) {
+  unique_lock lock(m);
+  if (Exists(record.id)) {
+    return false;
+  }
+  Log(record.id, true, EncodePut(record), lock);
+  return true;
+}
+
+bool DurableDatabase::Erase(const string& id) {
+  unique_lock lock(m);
+  if (!Exists(id)) {
+    return false;
+  }
+  Log(id, false, EncodeErase(id), lock);
+  return true;
+}
+
+void DurableDatabase::Checkpoint() {
+  unique_lock lock(m);
+  // Журнал будет обрезан, поэтому всё, что в нём есть, должно попасть в снимок
+  if (!unapplied.empty()) {
+    const uint64_t lsn = unapplied.back().lsn;
+    wal.WaitDurable(lsn);
+    ApplyDurable(lsn);
+  }
+  db.SaveSnapshot(snapshot_path);
+  wal.Truncate();
+}
+
+// Учитывает операции, которые уже в журнале, но ещё не применены
+bool DurableDatabase::Exists(const string& id) const {
+  auto it = in_flight.find(id);
+  if (it != in_flight.end()) {
+    return it->second.exists;
+  }
+  return db.GetById(id) != nullptr;
+}
+
+// Номера в журнале выдаются под m, поэтому unapplied упорядочен по ним.
+// fdatasync ждём без блокировки, чтобы другие писатели попали в ту же группу.
+// Если запись на диск не удалась, WaitDurable бросает исключение
+// и операция так и не становится видна читателям.
+void DurableDatabase::Log(const string& id, bool exists, string entry,
+                          unique_lock<shared_mutex>& lock) {
+  const uint64_t lsn = wal.Append(entry);
+  unapplied.push_back({lsn, id, move(entry)});
+  in_flight[id] = {exists, lsn};
+
+  lock.unlock();
+  wal.WaitDurable(lsn);
+  lock.lock();
+  ApplyDurable(lsn);
+}
+
+// Применяет в порядке журнала все записи с номером не больше lsn;
+// их мог уже применить другой писатель из той же группы
+void DurableDatabase::ApplyDurable(uint64_t lsn) {
+  while (!unapplied.empty() && unapplied.front().lsn <= lsn) {
+    const PendingEntry& pending = unapplied.front();
+    Apply(pending.entry);
+    auto it = in_flight.find(pending.id);
+    if (it->second.lsn == pending.lsn) {
+      in_flight.erase(it);
+    }
+    unapplied.pop_front();
+  }
+}
+
+void DurableDatabase::Apply(string_view entry) {
+  EntryReader reader(entry);
+  const char op = reader.ReadOp();
+  if (op == kPutOp) {
+    Record record;
+    record.id = reader.ReadString();
+    record.title = reader.ReadString();
+    record.user = reader.ReadString();
+    record.timestamp = reader.ReadInt();
+    record.karma = reader.ReadInt();
+    db.Put(record);
+  } else if (op == kEraseOp) {
+    db.Erase(reader.ReadString());
+  } else {
+    throw runtime_error("Unknown log entry type");
+  }
+}
@@ -1,194 +1,748 @@
+#include "database.h"
+#include "durable_database.h"
+#include "mvcc_database.h"
+#include "snapshot.h"
 #include "test_runner.h"
 
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
-#include <map>
+#include <limits>
+#include <random>
+#include <sstream>
 #include <string>
-#include <list>
-#include <unordered_map>
-#include <unordered_set>
+#include <thread>
+#include <vector>
 
 using namespace std;
 
-struct Record {
-  string id;
-  string title;
-  string user;
-  int timestamp;
-  int karma;
-};
-
-struct RecordHasher {
-  size_t operator() (const Record& r) const {
-    hash<string> str_hash;
-    hash<int> int_hash;
-    int coef = 5003081;
-    return
-      coef * coef * coef * coef * str_hash(r.id) +
-             coef * coef * coef * str_hash(r.title) +
-                    coef * coef * str_hash(r.user) +
-                           coef * int_hash(r.timestamp) +
-                                  int_hash(r.karma);
-  }
-};
-
-bool operator== (const Record& l, const Record& r) {
-  return
-    l.id == r.id &&
-    l.title == r.title &&
-    l.user == r.user &&
-    l.timestamp == r.timestamp &&
-    l.karma == r.karma;
-}
-
-bool operator< (const Record& l, const Record& r) {
-  return
-    tie(l.id, l.title, l.user, l.timestamp, l.karma) <
-    tie(r.id, r.title, r.user, r.timestamp, r.karma);
-}
-
-// Реализуйте этот класс
-class Database {
-public:
-  using Id = string;
-
-  bool Put(const Record& record) {
-    if (inDatabase(record.id)) {
-      return false;
-    }
-    else {
-      db[record.id] = {record};
-      Entry& e = db.at(record.id);
+void TestRangeBoundaries() {
+  const int good_karma = 1000;
+  const int bad_karma = -10;
 
-      list<const Record*>& by_user_list = by_user[record.user];
-      by_user_list.push_back(&e.rec);
-      e.it_by_user = prev(by_user_list.end());
+  Database db;
+  db.Put({"id1", "Hello there", "master", 1536107260, good_karma});
+  db.Put({"id2", "O>>-<", "general2", 1536107260, bad_karma});
 
-      list<const Record*>& by_timestamp_list = by_timestamp[record.timestamp];
-      by_timestamp_list.push_back(&e.rec);
-      e.it_by_timestamp = prev(by_timestamp_list.end());
+  int count = 0;
+  db.RangeByKarma(bad_karma, good_karma, [&count](const Record&) {
+    ++count;
+    return true;
+  });
 
-      list<const Record*>& by_karma_list = by_karma[record.karma];
-      by_karma_list.push_back(&e.rec);
-      e.it_by_karma = prev(by_karma_list.end());
+  ASSERT_EQUAL(2, count);
+}
 
-      return true;
-    }
+void TestSameUser() {
+  Database db;
+  db.Put({"id1", "Don't sell", "master", 1536107260, 1000});
+  db.Put({"id2", "Rethink life", "master", 1536107260, 2000});
+
+  int count = 0;
+  db.AllByUser("master", [&count](const Record&) {
+    ++count;
+    return true;
+  });
+
+  ASSERT_EQUAL(2, count);
+}
 
+void TestReplacement() {
+  const string final_body = "Feeling sad";
+
+  Database db;
+  db.Put({"id", "Have a hand", "not-master", 1536107260, 10});
+  db.Erase("id");
+  db.Put({"id", final_body, "not-master", 1536107260, -10});
+
+  auto record = db.GetById("id");
+  ASSERT(record != nullptr);
+  ASSERT_EQUAL(final_body, record->title);
+}
+
+const string kSnapshotPath = "secondary_index_test.snapshot";
+
+Database MakeSnapshotSource() {
+  Database db;
+  db.Put({"id3", "Third", "master", 20, 5});
+  db.Put({"id1", "First", "master", 10, 7});
+  db.Put({"id2", "Second", "general", 10, 5});
+  db.Put({"id4", "Fourth", "general", 30, -1});
+  db.Put({"id5", "Fifth", "master", 20, 100});
+  db.Erase("id4");
+  return db;
+}
+
+template <typename Db>
+vector<string> IdsByTimestamp(const Db& db, int low, int high) {
+  vector<string> ids;
+  db.RangeByTimestamp(low, high, [&ids](const auto& rec) {
+    ids.push_back(string(rec.id));
+    return true;
+  });
+  return ids;
+}
+
+template <typename Db>
+vector<string> IdsByKarma(const Db& db, int low, int high) {
+  vector<string> ids;
+  db.RangeByKarma(low, high, [&ids](const auto& rec) {
+    ids.push_back(string(rec.id));
+    return true;
+  });
+  return ids;
+}
+
+template <typename Db>
+vector<string> IdsByUser(const Db& db, const string& user) {
+  vector<string> ids;
+  db.AllByUser(user, [&ids](const auto& rec) {
+    ids.push_back(string(rec.id));
+    return true;
+  });
+  return ids;
+}
+
+void TestSnapshotMatchesDatabase() {
+  const Database db = MakeSnapshotSource();
+  db.SaveSnapshot(kSnapshotPath);
+  const SnapshotDatabase snapshot = OpenSnapshot(kSnapshotPath);
+
+  ASSERT_EQUAL(IdsByTimestamp(snapshot, 0, 100), IdsByTimestamp(db, 0, 100));
+  ASSERT_EQUAL(IdsByTimestamp(snapshot, 15, 20), IdsByTimestamp(db, 15, 20));
+  ASSERT_EQUAL(IdsByKarma(snapshot, -10, 10), IdsByKarma(db, -10, 10));
+  ASSERT_EQUAL(IdsByUser(snapshot, "master"), IdsByUser(db, "master"));
+  ASSERT_EQUAL(IdsByUser(snapshot, "general"), IdsByUser(db, "general"));
+  ASSERT_EQUAL(IdsByUser(snapshot, "nobody").size(), 0u);
+
+  auto record = snapshot.GetById("id5");
+  ASSERT(record.has_value());
+  ASSERT(record->ToRecord() == *db.GetById("id5"));
+  ASSERT(!snapshot.GetById("id4"));
+
+  remove(kSnapshotPath.c_str());
+}
+
+void TestSnapshotDelta() {
+  MakeSnapshotSource().SaveSnapshot(kSnapshotPath);
+  SnapshotDatabase db = OpenSnapshot(kSnapshotPath);
+
+  ASSERT(!db.Put({"id1", "Duplicate", "master", 10, 7}));
+  ASSERT(db.Put({"id6", "Sixth", "master", 10, 5}));
+  ASSERT(db.Erase("id3"));
+  ASSERT(!db.Erase("id3"));
+  ASSERT(db.Put({"id3", "Third again", "general", 40, 1}));
+
+  ASSERT_EQUAL(IdsByTimestamp(db, 0, 100),
+               (vector<string>{"id1", "id2", "id6", "id5", "id3"}));
+  ASSERT_EQUAL(IdsByKarma(db, 5, 5), (vector<string>{"id2", "id6"}));
+  ASSERT_EQUAL(IdsByUser(db, "master"), (vector<string>{"id1", "id5", "id6"}));
+  ASSERT_EQUAL(string(db.GetById("id3")->title), "Third again");
+
+  int count = 0;
+  db.RangeByTimestamp(0, 100, [&count](const RecordView&) {
+    return ++count < 2;
+  });
+  ASSERT_EQUAL(count, 2);
+
+  remove(kSnapshotPath.c_str());
+}
+
+void TestLoadSnapshotKeepsOrder() {
+  const Database db = MakeSnapshotSource();
+  db.SaveSnapshot(kSnapshotPath);
+  const Database loaded = LoadSnapshot(kSnapshotPath);
+
+  ASSERT_EQUAL(IdsByTimestamp(loaded, 0, 100), IdsByTimestamp(db, 0, 100));
+  ASSERT_EQUAL(IdsByKarma(loaded, -10, 10), IdsByKarma(db, -10, 10));
+  ASSERT_EQUAL(IdsByUser(loaded, "master"), (vector<string>{"id3", "id1", "id5"}));
+  ASSERT_EQUAL(IdsByUser(loaded, "general"), IdsByUser(db, "general"));
+
+  remove(kSnapshotPath.c_str());
+}
+
+// Портит поле по смещению offset внутри сохранённого снимка
+template <typename T>
+void PatchSnapshot(uint64_t offset, T value) {
+  fstream file(kSnapshotPath, ios::binary | ios::in | ios::out);
+  file.seekp(offset);
+  file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+bool SnapshotOpens() {
+  try {
+    OpenSnapshot(kSnapshotPath);
+    return true;
+  } catch (const runtime_error&) {
+    return false;
+  }
+}
+
+void TestSnapshotRejectsBadReferences() {
+  using namespace SnapshotFormat;
+  const Database db = MakeSnapshotSource();
+  db.SaveSnapshot(kSnapshotPath);
+  ASSERT(SnapshotOpens());
+
+  SnapshotFormat::Header header;
+  {
+    ifstream file(kSnapshotPath, ios::binary);
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+  }
+
+  PatchSnapshot<uint32_t>(header.records_offset + offsetof(RecordEntry, title) + offsetof(StringRef, size),
+                          header.strings_size + 1);
+  ASSERT(!SnapshotOpens());
+
+  db.SaveSnapshot(kSnapshotPath);
+  PatchSnapshot<uint32_t>(header.by_karma_offset + offsetof(IndexEntry, record), header.record_count);
+  ASSERT(!SnapshotOpens());
+
+  db.SaveSnapshot(kSnapshotPath);
+  PatchSnapshot<uint32_t>(header.users_offset + offsetof(UserEntry, end), header.record_count + 1);
+  ASSERT(!SnapshotOpens());
+
+  remove(kSnapshotPath.c_str());
+}
+
+const string kDurablePath = "secondary_index_test";
+
+void RemoveDurableFiles() {
+  remove((kDurablePath + ".wal").c_str());
+  remove((kDurablePath + ".snapshot").c_str());
+}
+
+size_t FileSize(const string& path) {
+  ifstream input(path, ios::binary | ios::ate);
+  return input ? static_cast<size_t>(input.tellg()) : 0;
+}
+
+void TestWalReplay() {
+  RemoveDurableFiles();
+  {
+    DurableDatabase db(kDurablePath);
+    ASSERT(db.Put({"id1", "First", "master", 10, 1}));
+    ASSERT(db.Put({"id2", "Second", "master", 20, 2}));
+    ASSERT(!db.Put({"id2", "Duplicate", "master", 20, 2}));
+    ASSERT(db.Erase("id1"));
+    ASSERT(db.Put({"id1", "First again", "general", 30, 3}));
+  }
+  {
+    DurableDatabase db(kDurablePath);
+    ASSERT_EQUAL(db.GetById("id1")->title, "First again");
+    ASSERT_EQUAL(db.GetById("id2")->title, "Second");
+    ASSERT_EQUAL(IdsByTimestamp(db, 0, 100), (vector<string>{"id2", "id1"}));
+  }
+  RemoveDurableFiles();
+}
+
+void TestWalTornTail() {
+  RemoveDurableFiles();
+  {
+    DurableDatabase db(kDurablePath);
+    db.Put({"id1", "First", "master", 10, 1});
+    db.Put({"id2", "Second", "master", 20, 2});
+  }
+  const size_t good_size = FileSize(kDurablePath + ".wal");
+  {
+    ofstream log(kDurablePath + ".wal", ios::binary | ios::app);
+    log << "\x20\x00\x00\x00garbage";
   }
-  const Record* GetById(const string& id) const {
-    if (inDatabase(id)) {
-      return &db.at(id).rec;
+  {
+    DurableDatabase db(kDurablePath);
+    ASSERT_EQUAL(FileSize(kDurablePath + ".wal"), good_size);
+    ASSERT(db.Put({"id3", "Third", "master", 30, 3}));
+  }
+  {
+    DurableDatabase db(kDurablePath);
+    ASSERT_EQUAL(IdsByUser(db, "master"), (vector<string>{"id1", "id2", "id3"}));
+  }
+  RemoveDurableFiles();
+}
+
+void TestCheckpoint() {
+  RemoveDurableFiles();
+  {
+    DurableDatabase db(kDurablePath);
+    db.Put({"id1", "First", "master", 10, 1});
+    db.Put({"id2", "Second", "general", 20, 2});
+    db.Checkpoint();
+    ASSERT_EQUAL(FileSize(kDurablePath + ".wal"), 0u);
+    db.Erase("id1");
+    db.Put({"id3", "Third", "master", 5, 3});
+  }
+  {
+    DurableDatabase db(kDurablePath);
+    ASSERT(!db.GetById("id1"));
+    ASSERT_EQUAL(IdsByTimestamp(db, 0, 100), (vector<string>{"id3", "id2"}));
+    ASSERT_EQUAL(IdsByKarma(db, 0, 100), (vector<string>{"id2", "id3"}));
+  }
+  RemoveDurableFiles();
+}
+
+void TestGroupCommit() {
+  RemoveDurableFiles();
+  const int threads = 8;
+  const int puts_per_thread = 50;
+  {
+    DurableDatabase db(kDurablePath, WalOptions{chrono::microseconds(500)});
+    vector<thread> writers;
+    for (int t = 0; t < threads; ++t) {
+      writers.emplace_back([&db, t] {
+        for (int i = 0; i < puts_per_thread; ++i) {
+          const string id = to_string(t) + "-" + to_string(i);
+          db.Put({id, "title", "user" + to_string(t), i, t});
+        }
+      });
     }
-    else {
-      return nullptr;
+    for (thread& w : writers) {
+      w.join();
     }
+    ASSERT(db.SyncCount() < static_cast<uint64_t>(threads * puts_per_thread));
   }
-
-  bool Erase(const string& id) {
-    if (inDatabase(id)) {
-      const Entry& e = db.at(id);
-      by_user[e.rec.user].erase(e.it_by_user);
-      by_timestamp[e.rec.timestamp].erase(e.it_by_timestamp);
-      by_karma[e.rec.karma].erase(e.it_by_karma);
-      db.erase(id);
+  {
+    DurableDatabase db(kDurablePath);
+    int count = 0;
+    db.RangeByKarma(0, threads, [&count](const Record&) {
+      ++count;
       return true;
+    });
+    ASSERT_EQUAL(count, threads * puts_per_thread);
+  }
+  RemoveDurableFiles();
+}
+
+// Писатели меняют одни и те же id, поэтому состояние после перезапуска
+// совпадает с видимым, только если изменения применялись в порядке журнала
+void TestConcurrentWritesMatchReplay() {
+  RemoveDurableFiles();
+  const int threads = 4;
+  vector<string> live_by_timestamp;
+  vector<string> live_by_user;
+  {
+    DurableDatabase db(kDurablePath, WalOptions{chrono::microseconds(200)});
+    vector<thread> writers;
+    for (int t = 0; t < threads; ++t) {
+      writers.emplace_back([&db, t] {
+        for (int i = 0; i < 200; ++i) {
+          const string id = "id" + to_string(i % 10);
+          if (!db.Put({id, "title", "user", i % 3, t})) {
+            db.Erase(id);
+          }
+        }
+      });
     }
-    else {
-      return false;
+    for (thread& w : writers) {
+      w.join();
     }
+    live_by_timestamp = IdsByTimestamp(db, 0, 100);
+    live_by_user = IdsByUser(db, "user");
+  }
+  {
+    DurableDatabase db(kDurablePath);
+    ASSERT_EQUAL(IdsByTimestamp(db, 0, 100), live_by_timestamp);
+    ASSERT_EQUAL(IdsByUser(db, "user"), live_by_user);
   }
+  RemoveDurableFiles();
+}
 
-  template <typename Callback>
-  void RangeByTimestamp(int low, int high, Callback callback) const {
-    auto begin = by_timestamp.lower_bound(low);
-    auto end = by_timestamp.upper_bound(high);
-    for (auto it = begin; it != end; ++it) {
-      for (const Record* rec : it->second) {
-        if(!callback(*rec)) return;
-      }
-    }
+void TestMvccSnapshotIsolation() {
+  MvccDatabase db;
+  db.Put({"id1", "First", "master", 10, 1});
+  db.Put({"id2", "Second", "master", 20, 2});
+
+  auto view = db.OpenView();
+  db.Erase("id1");
+  db.Put({"id3", "Third", "master", 15, 3});
+  db.Erase("id2");
+  db.Put({"id2", "Second again", "general", 5, 4});
+
+  ASSERT_EQUAL(IdsByTimestamp(view, 0, 100), (vector<string>{"id1", "id2"}));
+  ASSERT_EQUAL(IdsByUser(view, "master"), (vector<string>{"id1", "id2"}));
+  ASSERT_EQUAL(view.GetById("id2")->title, "Second");
+  ASSERT(view.GetById("id3") == nullptr);
+
+  ASSERT_EQUAL(IdsByTimestamp(db, 0, 100), (vector<string>{"id2", "id3"}));
+  ASSERT_EQUAL(IdsByKarma(db, 0, 100), (vector<string>{"id3", "id2"}));
+  ASSERT_EQUAL(db.OpenView().GetById("id2")->title, "Second again");
+}
+
+void TestMvccWritesDuringScan() {
+  MvccDatabase db;
+  for (int i = 0; i < 1000; ++i) {
+    db.Put({to_string(i), "title", "user", i, i});
   }
 
-  template <typename Callback>
-  void RangeByKarma(int low, int high, Callback callback) const {
-    auto begin = by_karma.lower_bound(low);
-    auto end = by_karma.upper_bound(high);
-    for (auto it = begin; it != end; ++it) {
-      for (const Record* rec : it->second) {
-        if (!callback(*rec)) return;
-      }
-    }
+  // Колбэк пишет в ту же базу: с одной общей блокировкой это была бы
+  // взаимоблокировка, а обход видит состояние на момент своей эпохи
+  int count = 0;
+  db.RangeByTimestamp(0, 2000, [&](const Record& rec) {
+    ++count;
+    db.Erase(rec.id);
+    db.Put({rec.id + "-moved", "title", "user", rec.timestamp + 1000, rec.karma});
+    return true;
+  });
+  ASSERT_EQUAL(count, 1000);
+  ASSERT_EQUAL(IdsByTimestamp(db, 0, 999).size(), 0u);
+  ASSERT_EQUAL(IdsByTimestamp(db, 1000, 1999).size(), 1000u);
+}
+
+void TestMvccGarbageCollection() {
+  MvccDatabase db;
+  db.Put({"id1", "First", "master", 10, 1});
+  {
+    auto view = db.OpenView();
+    db.Erase("id1");
+    db.Put({"id1", "First again", "master", 10, 1});
+    db.CollectGarbage();
+    ASSERT_EQUAL(db.VersionCount(), 2u);
+    ASSERT_EQUAL(view.GetById("id1")->title, "First");
+  }
+  db.CollectGarbage();
+  ASSERT_EQUAL(db.VersionCount(), 1u);
+  ASSERT_EQUAL(db.OpenView().GetById("id1")->title, "First again");
+}
+
+void TestMvccConcurrentReaders() {
+  const size_t records = 200;
+  MvccDatabase db;
+  for (size_t i = 0; i < records; ++i) {
+    db.Put({to_string(i) + "-0", "title", "user", static_cast<int>(i), 0});
   }
 
-  template <typename Callback>
-  void AllByUser(const string& user, Callback callback) const {
-    if (by_user.count(user)) {
-      const list<const Record*>& by_user_list = by_user.at(user);
-      for (const Record* rec : by_user_list) {
-        if (!callback(*rec)) return;
+  atomic<bool> stop = false;
+  atomic<int> inconsistencies = 0;
+  vector<thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&] {
+      while (!stop) {
+        auto view = db.OpenView();
+        const vector<string> by_karma = IdsByKarma(view, 0, 0);
+        vector<string> by_timestamp = IdsByTimestamp(view, 0, 1000000);
+        vector<string> by_user = IdsByUser(view, "user");
+        const bool same_size = by_karma.size() == records || by_karma.size() == records + 1;
+        sort(by_timestamp.begin(), by_timestamp.end());
+        sort(by_user.begin(), by_user.end());
+        if (!same_size || by_karma != IdsByKarma(view, 0, 0) || by_timestamp != by_user) {
+          ++inconsistencies;
+        }
+        if (adjacent_find(by_timestamp.begin(), by_timestamp.end()) != by_timestamp.end()) {
+          ++inconsistencies;
+        }
       }
+    });
+  }
+
+  // Каждая запись переезжает под новый id и timestamp: сначала Put, потом
+  // Erase, так что в любой эпохе живых записей records или records + 1
+  for (size_t round = 1; round <= 20; ++round) {
+    for (size_t i = 0; i < records; ++i) {
+      db.Put({to_string(i) + "-" + to_string(round), "title", "user",
+              static_cast<int>(round * records + i), 0});
+      db.Erase(to_string(i) + "-" + to_string(round - 1));
     }
   }
-private:
-  struct Entry {
-    Record rec;
-    list<const Record*>::iterator it_by_user;
-    list<const Record*>::iterator it_by_timestamp;
-    list<const Record*>::iterator it_by_karma;
-  };
+  stop = true;
+  for (thread& r : readers) {
+    r.join();
+  }
+  ASSERT_EQUAL(inconsistencies.load(), 0);
+  db.CollectGarbage();
+  ASSERT_EQUAL(db.VersionCount(), records);
+}
+
+void TestCountRanges() {
+  Database db;
+  db.Put({"id1", "", "master", 10, -5});
+  db.Put({"id2", "", "master", 10, 0});
+  db.Put({"id3", "", "master", 20, 0});
+  db.Put({"id4", "", "master", 30, 7});
 
-  unordered_map<Id, Entry> db;
-  unordered_map<string, list<const Record*>> by_user;
-  map<int, list<const Record*>> by_timestamp;
-  map<int, list<const Record*>> by_karma;
+  ASSERT_EQUAL(db.CountByTimestamp(10, 10), 2u);
+  ASSERT_EQUAL(db.CountByTimestamp(11, 30), 2u);
+  ASSERT_EQUAL(db.CountByTimestamp(31, 100), 0u);
+  ASSERT_EQUAL(db.CountByTimestamp(30, 10), 0u);
+  ASSERT_EQUAL(db.CountByKarma(-5, 0), 3u);
+  ASSERT_EQUAL(db.CountByKarma(numeric_limits<int>::min(), numeric_limits<int>::max()), 4u);
 
-  bool inDatabase(const Id& id) const {
-    return db.count(id);
+  db.Erase("id2");
+  db.Erase("id1");
+  ASSERT_EQUAL(db.CountByTimestamp(10, 10), 0u);
+  ASSERT_EQUAL(db.CountByKarma(-5, 0), 1u);
+  db.Put({"id1", "", "master", 10, 0});
+  ASSERT_EQUAL(db.CountByKarma(0, 0), 2u);
+}
+
+void TestCountMatchesRange() {
+  mt19937 gen(42);
+  uniform_int_distribution<int> value(-50, 50);
+  Database db;
+  for (int i = 0; i < 2000; ++i) {
+    db.Put({to_string(value(gen) + 50), "", "user", value(gen), value(gen)});
+    db.Erase(to_string(value(gen) + 50));
   }
-};
+  for (int low = -60; low <= 60; low += 7) {
+    for (int high = low - 10; high <= 60; high += 11) {
+      ASSERT_EQUAL(db.CountByKarma(low, high), IdsByKarma(db, low, high).size());
+      ASSERT_EQUAL(db.CountByTimestamp(low, high), IdsByTimestamp(db, low, high).size());
+    }
+  }
+}
 
-void TestRangeBoundaries() {
-  const int good_karma = 1000;
-  const int bad_karma = -10;
+vector<string> TopKByKarmaBruteForce(const Database& db, int low_ts, int high_ts, size_t k) {
+  vector<const Record*> records;
+  db.RangeByTimestamp(low_ts, high_ts, [&records](const Record& rec) {
+    records.push_back(&rec);
+    return true;
+  });
+  sort(records.begin(), records.end(), [](const Record* l, const Record* r) {
+    return l->karma != r->karma ? l->karma > r->karma : l->id < r->id;
+  });
+  vector<string> ids;
+  for (size_t i = 0; i < min(k, records.size()); ++i) {
+    ids.push_back(records[i]->id);
+  }
+  return ids;
+}
 
+void TestTopKByKarma() {
   Database db;
-  db.Put({"id1", "Hello there", "master", 1536107260, good_karma});
-  db.Put({"id2", "O>>-<", "general2", 1536107260, bad_karma});
+  db.Put({"b", "", "master", 10, 5});
+  db.Put({"a", "", "master", 20, 5});
+  db.Put({"c", "", "master", 30, 9});
+  db.Put({"d", "", "master", 40, 100});
 
-  int count = 0;
-  db.RangeByKarma(bad_karma, good_karma, [&count](const Record&) {
-    ++count;
+  auto ids = [](const vector<const Record*>& records) {
+    vector<string> result;
+    for (const Record* rec : records) {
+      result.push_back(rec->id);
+    }
+    return result;
+  };
+  ASSERT_EQUAL(ids(db.TopKByKarma(10, 30, 2)), (vector<string>{"c", "a"}));
+  ASSERT_EQUAL(ids(db.TopKByKarma(0, 100, 10)), (vector<string>{"d", "c", "a", "b"}));
+  ASSERT_EQUAL(ids(db.TopKByKarma(50, 100, 3)), vector<string>{});
+  ASSERT_EQUAL(ids(db.TopKByKarma(0, 100, 0)), vector<string>{});
+
+  mt19937 gen(7);
+  uniform_int_distribution<int> value(0, 1000);
+  Database big;
+  for (int i = 0; i < 3000; ++i) {
+    big.Put({to_string(i), "", "user", value(gen), value(gen) % 50});
+  }
+  for (auto [low, high] : {pair{0, 1000}, pair{100, 200}, pair{500, 505}, pair{999, 1000}}) {
+    for (size_t k : {1u, 10u, 100u}) {
+      ASSERT_EQUAL(ids(big.TopKByKarma(low, high, k)), TopKByKarmaBruteForce(big, low, high, k));
+    }
+  }
+}
+
+template <typename Db>
+vector<string> IdsByTitle(const Db& db, const string& query, TitleMatch match) {
+  vector<string> ids;
+  db.SearchByTitle(query, match, [&ids](const Record& rec) {
+    ids.push_back(rec.id);
     return true;
   });
+  return ids;
+}
 
-  ASSERT_EQUAL(2, count);
+void TestTokenize() {
+  ASSERT_EQUAL(Tokenize("Hello, hello WORLD! 42x"), (vector<string>{"42x", "hello", "world"}));
+  ASSERT_EQUAL(Tokenize("  ...  "), vector<string>{});
 }
 
-void TestSameUser() {
+void TestPostingList() {
+  PostingList list;
+  vector<Handle> expected;
+  for (Handle h = 3; h < 100000; h += 7) {
+    list.Append(h);
+    expected.push_back(h);
+  }
+  ASSERT(list.ByteSize() < expected.size() * sizeof(Handle) / 4);
+
+  vector<Handle> decoded;
+  for (auto it = list.Begin(); !it.AtEnd(); it.Next()) {
+    decoded.push_back(it.Value());
+  }
+  ASSERT_EQUAL(decoded, expected);
+
+  for (Handle target : {Handle(0), Handle(3), Handle(4), Handle(900), Handle(50001), Handle(99999)}) {
+    auto it = list.Begin();
+    it.SkipTo(target);
+    auto bound = lower_bound(expected.begin(), expected.end(), target);
+    ASSERT_EQUAL(it.AtEnd(), bound == expected.end());
+    if (!it.AtEnd()) {
+      ASSERT_EQUAL(it.Value(), *bound);
+    }
+  }
+
+  ASSERT(list.Remove(10));
+  ASSERT(!list.Remove(11));
+  expected.erase(expected.begin() + 1);
+  // Целый блок из середины и хвост списка
+  for (size_t i = 0; i < PostingList::kBlockSize; ++i) {
+    ASSERT(list.Remove(expected[1000]));
+    expected.erase(expected.begin() + 1000);
+  }
+  ASSERT(list.Remove(expected.back()));
+  expected.pop_back();
+  list.Append(expected.back() + 1);
+  expected.push_back(expected.back() + 1);
+  ASSERT_EQUAL(list.Size(), expected.size());
+
+  decoded.clear();
+  for (auto it = list.Begin(); !it.AtEnd(); it.Next()) {
+    decoded.push_back(it.Value());
+  }
+  ASSERT_EQUAL(decoded, expected);
+
+  for (Handle target : {Handle(7000), Handle(8000), Handle(50001), expected.back()}) {
+    auto it = list.Begin();
+    it.SkipTo(target);
+    ASSERT_EQUAL(it.Value(), *lower_bound(expected.begin(), expected.end(), target));
+  }
+}
+
+void TestSearchByTitle() {
   Database db;
-  db.Put({"id1", "Don't sell", "master", 1536107260, 1000});
-  db.Put({"id2", "Rethink life", "master", 1536107260, 2000});
+  db.Put({"id1", "Buy cheap goods", "master", 1, 1});
+  db.Put({"id2", "Goods and services", "master", 2, 2});
+  db.Put({"id3", "Cheap flights", "general", 3, 3});
+  db.Put({"id4", "Nothing to see", "general", 4, 4});
 
-  int count = 0;
-  db.AllByUser("master", [&count](const Record&) {
-    ++count;
+  ASSERT_EQUAL(IdsByTitle(db, "goods", TitleMatch::AllWords), (vector<string>{"id1", "id2"}));
+  ASSERT_EQUAL(IdsByTitle(db, "cheap GOODS", TitleMatch::AllWords), (vector<string>{"id1"}));
+  ASSERT_EQUAL(IdsByTitle(db, "cheap missing", TitleMatch::AllWords), vector<string>{});
+  ASSERT_EQUAL(IdsByTitle(db, "cheap missing", TitleMatch::AnyWord), (vector<string>{"id1", "id3"}));
+  ASSERT_EQUAL(IdsByTitle(db, "services flights", TitleMatch::AnyWord), (vector<string>{"id2", "id3"}));
+
+  db.Erase("id1");
+  db.Put({"id1", "Cheap goods again", "master", 5, 5});
+  ASSERT_EQUAL(IdsByTitle(db, "cheap", TitleMatch::AllWords), (vector<string>{"id3", "id1"}));
+  ASSERT_EQUAL(IdsByTitle(db, "buy", TitleMatch::AnyWord), vector<string>{});
+}
+
+void TestSearchByTitleIntersection() {
+  Database db;
+  for (int i = 0; i < 5000; ++i) {
+    string title = "common";
+    if (i % 3 == 0) title += " three";
+    if (i % 5 == 0) title += " five";
+    if (i % 1000 == 7) title += " rare";
+    db.Put({to_string(i), title, "user", i, i});
+  }
+
+  auto numbers = [](const vector<string>& ids) {
+    vector<int> result;
+    for (const string& id : ids) {
+      result.push_back(stoi(id));
+    }
+    return result;
+  };
+  vector<int> expected;
+  for (int i = 0; i < 5000; i += 15) {
+    expected.push_back(i);
+  }
+  ASSERT_EQUAL(numbers(IdsByTitle(db, "three five common", TitleMatch::AllWords)), expected);
+  ASSERT_EQUAL(numbers(IdsByTitle(db, "rare common", TitleMatch::AllWords)),
+               (vector<int>{7, 1007, 2007, 3007, 4007}));
+  ASSERT_EQUAL(IdsByTitle(db, "three five", TitleMatch::AnyWord).size(), 5000u / 3 + 1 + 5000u / 5 - expected.size());
+}
+
+vector<string> SelectIds(const Database& db, const Query& query, QueryPlan* plan = nullptr) {
+  vector<string> ids;
+  QueryPlan executed = db.Select(query, [&ids](const Record& rec) {
+    ids.push_back(rec.id);
     return true;
   });
+  if (plan) {
+    *plan = executed;
+  }
+  sort(ids.begin(), ids.end());
+  return ids;
+}
 
-  ASSERT_EQUAL(2, count);
+vector<string> SelectIdsBruteForce(const Database& db, const Query& query) {
+  vector<string> ids;
+  db.RangeByTimestamp(numeric_limits<int>::min(), numeric_limits<int>::max(),
+    [&](const Record& rec) {
+      if (query.Matches(rec)) {
+        ids.push_back(rec.id);
+      }
+      return true;
+    });
+  sort(ids.begin(), ids.end());
+  return ids;
 }
 
-void TestReplacement() {
-  const string final_body = "Feeling sad";
+void TestQueryChoosesSelectiveIndex() {
+  Database db;
+  for (int i = 0; i < 1000; ++i) {
+    db.Put({to_string(i), i % 2 ? "odd post" : "even post", "user" + to_string(i % 100), i, i % 10});
+  }
+
+  QueryPlan plan;
+  const Query by_user = Query().ByUser("user7").TimestampBetween(0, 999).KarmaAtLeast(5);
+  ASSERT_EQUAL(SelectIds(db, by_user, &plan), SelectIdsBruteForce(db, by_user));
+  ASSERT(plan.access == AccessPath::User);
+  ASSERT_EQUAL(plan.estimates.size(), 3u);
+  ASSERT_EQUAL(plan.estimates[0].rows, 10u);
+  ASSERT_EQUAL(plan.estimates[1].rows, 1000u);
+  ASSERT_EQUAL(plan.estimates[2].rows, 500u);
+
+  const Query by_time = Query().ByUser("user7").TimestampBetween(500, 501);
+  ASSERT_EQUAL(SelectIds(db, by_time, &plan), SelectIdsBruteForce(db, by_time));
+  ASSERT(plan.access == AccessPath::Timestamp);
+
+  const Query wide = Query().TimestampBetween(0, 2000);
+  ASSERT_EQUAL(SelectIds(db, wide, &plan).size(), 1000u);
+  ASSERT(plan.access == AccessPath::Timestamp || plan.access == AccessPath::FullScan);
+
+  ASSERT_EQUAL(SelectIds(db, Query().KarmaAtLeast(100), &plan), vector<string>{});
+  ASSERT(plan.access == AccessPath::Karma);
+  ASSERT_EQUAL(plan.cost, 0u);
+}
 
+void TestQueryIntersection() {
   Database db;
-  db.Put({"id", "Have a hand", "not-master", 1536107260, 10});
-  db.Erase("id");
-  db.Put({"id", final_body, "not-master", 1536107260, -10});
+  for (int i = 0; i < 1000; ++i) {
+    db.Put({to_string(i), "post", "user" + to_string(i % 4), i, i % 5});
+  }
 
-  auto record = db.GetById("id");
-  ASSERT(record != nullptr);
-  ASSERT_EQUAL(final_body, record->title);
+  QueryPlan plan;
+  const Query query = Query().ByUser("user1").KarmaBetween(2, 2);
+  ASSERT_EQUAL(SelectIds(db, query, &plan), SelectIdsBruteForce(db, query));
+  ASSERT(plan.access == AccessPath::Intersection);
+  ASSERT(plan.intersected == (vector<AccessPath>{AccessPath::Karma, AccessPath::User}));
+
+  ostringstream explained;
+  explained << plan;
+  ASSERT_EQUAL(explained.str(), "Intersection(Karma, User) cost=650 User=250 Karma=200");
+}
+
+void TestQueryMatchesBruteForce() {
+  mt19937 gen(3);
+  uniform_int_distribution<int> value(0, 99);
+  const vector<string> words = {"alpha", "beta", "gamma", "delta"};
+  Database db;
+  for (int i = 0; i < 3000; ++i) {
+    db.Put({to_string(i), words[value(gen) % 4] + " " + words[value(gen) % 4],
+            "user" + to_string(value(gen) % 20), value(gen), value(gen)});
+  }
+  for (int i = 0; i < 300; ++i) {
+    Query query;
+    if (value(gen) % 2) query.ByUser("user" + to_string(value(gen) % 20));
+    if (value(gen) % 2) query.TimestampBetween(value(gen), value(gen));
+    if (value(gen) % 2) query.KarmaAtLeast(value(gen));
+    if (value(gen) % 3 == 0) query.TitleHasWords(words[value(gen) % 4]);
+    if (value(gen) % 5 == 0) query.TitleHasWords(words[value(gen) % 4] + " " + words[value(gen) % 4]);
+    ASSERT_EQUAL(SelectIds(db, query), SelectIdsBruteForce(db, query));
+  }
+  ASSERT_EQUAL(SelectIds(db, Query().ByUser("user1").ByUser("user2")), vector<string>{});
 }
 
 int main() {
@@ -196,5 +750,28 @@ int main() {
   RUN_TEST(tr, TestRangeBoundaries);
   RUN_TEST(tr, TestSameUser);
   RUN_TEST(tr, TestReplacement);
+  RUN_TEST(tr, TestSnapshotMatchesDatabase);
+  RUN_TEST(tr, TestSnapshotDelta);
+  RUN_TEST(tr, TestLoadSnapshotKeepsOrder);
+  RUN_TEST(tr, TestSnapshotRejectsBadReferences);
+  RUN_TEST(tr, TestWalReplay);
+  RUN_TEST(tr, TestWalTornTail);
+  RUN_TEST(tr, TestCheckpoint);
+  RUN_TEST(tr, TestGroupCommit);
+  RUN_TEST(tr, TestConcurrentWritesMatchReplay);
+  RUN_TEST(tr, TestMvccSnapshotIsolation);
+  RUN_TEST(tr, TestMvccWritesDuringScan);
+  RUN_TEST(tr, TestMvccGarbageCollection);
+  RUN_TEST(tr, TestMvccConcurrentReaders);
+  RUN_TEST(tr, TestCountRanges);
+  RUN_TEST(tr, TestCountMatchesRange);
+  RUN_TEST(tr, TestTopKByKarma);
+  RUN_TEST(tr, TestTokenize);
+  RUN_TEST(tr, TestPostingList);
+  RUN_TEST(tr, TestSearchByTitle);
+  RUN_TEST(tr, TestSearchByTitleIntersection);
+  RUN_TEST(tr, TestQueryChoosesSelectiveIndex);
+  RUN_TEST(tr, TestQueryIntersection);
+  RUN_TEST(tr, TestQueryMatchesBruteForce);
   return 0;
 }
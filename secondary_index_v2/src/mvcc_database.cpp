@@ -0,0 +1,129 @@
+#include "mvcc_database.h"
+
+#include <algorithm>
+
+using namespace std;
+
+MvccDatabase::ReadView::ReadView(const MvccDatabase& db) : db(db) {
+  // Эпоха читается под той же блокировкой, под которой сборщик ищет
+  // минимальную активную эпоху, иначе он мог бы освободить версию,
+  // которую этот читатель ещё должен увидеть
+  lock_guard<mutex> g(db.readers_mutex);
+  epoch = db.committed_epoch.load(memory_order_acquire);
+  db.active_epochs.insert(epoch);
+}
+
+MvccDatabase::ReadView::~ReadView() {
+  lock_guard<mutex> g(db.readers_mutex);
+  db.active_epochs.erase(db.active_epochs.find(epoch));
+}
+
+const Record* MvccDatabase::ReadView::GetById(const Id& id) const {
+  shared_lock lock(db.index_mutex);
+  auto it = db.by_id.find(id);
+  if (it == db.by_id.end()) {
+    return nullptr;
+  }
+  for (auto version = it->second.rbegin(); version != it->second.rend(); ++version) {
+    if ((*version)->VisibleAt(epoch)) {
+      return &(*version)->rec;
+    }
+  }
+  return nullptr;
+}
+
+bool MvccDatabase::Put(const Record& record) {
+  lock_guard<mutex> writer(writer_mutex);
+  if (LatestLive(record.id)) {
+    return false;
+  }
+
+  const uint64_t epoch = committed_epoch.load(memory_order_relaxed) + 1;
+  auto version = make_unique<Version>();
+  version->rec = record;
+  version->begin = epoch;
+  const Version* v = version.get();
+  {
+    unique_lock lock(index_mutex);
+    by_id[record.id].push_back(move(version));
+    by_timestamp.emplace(pair{record.timestamp, epoch}, v);
+    by_karma.emplace(pair{record.karma, epoch}, v);
+    by_user.emplace(pair{record.user, epoch}, v);
+  }
+  committed_epoch.store(epoch, memory_order_release);
+  return true;
+}
+
+bool MvccDatabase::Erase(const Id& id) {
+  lock_guard<mutex> writer(writer_mutex);
+  Version* version = LatestLive(id);
+  if (!version) {
+    return false;
+  }
+
+  // Версия остаётся в индексах: читатели с более ранней эпохой её ещё видят
+  const uint64_t epoch = committed_epoch.load(memory_order_relaxed) + 1;
+  version->end.store(epoch, memory_order_release);
+  committed_epoch.store(epoch, memory_order_release);
+
+  retired.push_back(version);
+  if (++retired_since_collect >= kCollectEvery) {
+    Collect();
+  }
+  return true;
+}
+
+void MvccDatabase::CollectGarbage() {
+  lock_guard<mutex> writer(writer_mutex);
+  Collect();
+}
+
+size_t MvccDatabase::VersionCount() const {
+  shared_lock lock(index_mutex);
+  return by_timestamp.size();
+}
+
+MvccDatabase::Version* MvccDatabase::LatestLive(const Id& id) const {
+  // by_id меняют только писатели, а они уже сериализованы writer_mutex
+  auto it = by_id.find(id);
+  if (it == by_id.end() || it->second.empty()) {
+    return nullptr;
+  }
+  Version* latest = it->second.back().get();
+  return latest->end.load(memory_order_relaxed) == kInfinity ? latest : nullptr;
+}
+
+void MvccDatabase::Collect() {
+  retired_since_collect = 0;
+  uint64_t oldest_epoch;
+  {
+    lock_guard<mutex> g(readers_mutex);
+    oldest_epoch = active_epochs.empty()
+      ? committed_epoch.load(memory_order_relaxed)
+      : *active_epochs.begin();
+  }
+
+  // Эпохи удаления выдаются по возрастанию, поэтому retired упорядочен по end
+  unique_lock lock(index_mutex);
+  while (!retired.empty() && retired.front()->end.load(memory_order_relaxed) <= oldest_epoch) {
+    Unlink(retired.front());
+    retired.pop_front();
+  }
+}
+
+void MvccDatabase::Unlink(const Version* version) {
+  const Record& rec = version->rec;
+  by_timestamp.erase({rec.timestamp, version->begin});
+  by_karma.erase({rec.karma, version->begin});
+  by_user.erase({rec.user, version->begin});
+
+  auto it = by_id.find(rec.id);
+  auto& versions = it->second;
+  versions.erase(find_if(versions.begin(), versions.end(),
+    [version](const unique_ptr<Version>& v) {
+      return v.get() == version;
+    }));
+  if (versions.empty()) {
+    by_id.erase(it);
+  }
+}
@@ -0,0 +1,109 @@
+#include "query.h"
+#include "text_index.h"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+
+using namespace std;
+
+namespace {
+
+Query::Range Narrow(const optional<Query::Range>& current, Query::Range range) {
+  if (!current) {
+    return range;
+  }
+  return {max(current->first, range.first), min(current->second, range.second)};
+}
+
+bool InRange(int value, const optional<Query::Range>& range) {
+  return !range || (range->first <= value && value <= range->second);
+}
+
+}
+
+Query& Query::ByUser(string a_user) {
+  if (user && *user != a_user) {
+    contradictory = true;
+  }
+  user = move(a_user);
+  return *this;
+}
+
+Query& Query::TimestampBetween(int low, int high) {
+  timestamp = Narrow(timestamp, {low, high});
+  return *this;
+}
+
+Query& Query::KarmaBetween(int low, int high) {
+  karma = Narrow(karma, {low, high});
+  return *this;
+}
+
+Query& Query::KarmaAtLeast(int low) {
+  return KarmaBetween(low, numeric_limits<int>::max());
+}
+
+Query& Query::TitleHasWords(string_view words) {
+  vector<string> merged;
+  vector<string> added = Tokenize(words);
+  set_union(title_words.begin(), title_words.end(), added.begin(), added.end(),
+            back_inserter(merged));
+  title_words = move(merged);
+  return *this;
+}
+
+bool Query::Matches(const Record& record, const vector<AccessPath>& satisfied) const {
+  auto is_satisfied = [&satisfied](AccessPath path) {
+    return find(satisfied.begin(), satisfied.end(), path) != satisfied.end();
+  };
+  if (contradictory || (user && record.user != *user)) {
+    return false;
+  }
+  if (!InRange(record.timestamp, timestamp) || !InRange(record.karma, karma)) {
+    return false;
+  }
+  // Проверка слов требует разбить title на слова, поэтому пропускаем её,
+  // если запись и так пришла из индекса по title
+  if (!title_words.empty() && !is_satisfied(AccessPath::Title)) {
+    const vector<string> words = Tokenize(record.title);
+    return includes(words.begin(), words.end(), title_words.begin(), title_words.end());
+  }
+  return true;
+}
+
+ostream& operator<<(ostream& output, AccessPath path) {
+  switch (path) {
+    case AccessPath::FullScan:
+      return output << "FullScan";
+    case AccessPath::User:
+      return output << "User";
+    case AccessPath::Timestamp:
+      return output << "Timestamp";
+    case AccessPath::Karma:
+      return output << "Karma";
+    case AccessPath::Title:
+      return output << "Title";
+    case AccessPath::Intersection:
+      return output << "Intersection";
+  }
+  return output;
+}
+
+ostream& operator<<(ostream& output, const QueryPlan& plan) {
+  output << plan.access;
+  if (!plan.intersected.empty()) {
+    output << '(';
+    bool first = true;
+    for (AccessPath index : plan.intersected) {
+      output << (first ? "" : ", ") << index;
+      first = false;
+    }
+    output << ')';
+  }
+  output << " cost=" << plan.cost;
+  for (const IndexEstimate& estimate : plan.estimates) {
+    output << ' ' << estimate.index << '=' << estimate.rows;
+  }
+  return output;
+}
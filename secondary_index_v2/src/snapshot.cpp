@@ -0,0 +1,377 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace SnapshotFormat;
+
+namespace {
+
+uint64_t AlignUp(uint64_t value) {
+  return (value + 7) & ~uint64_t(7);
+}
+
+class StringPool {
+public:
+  StringRef Add(const string& s) {
+    StringRef ref{data.size(), static_cast<uint32_t>(s.size()), 0};
+    data += s;
+    return ref;
+  }
+
+  const string& Data() const {
+    return data;
+  }
+
+private:
+  string data;
+};
+
+template <typename T>
+void WriteSection(ofstream& out, const vector<T>& items) {
+  out.write(reinterpret_cast<const char*>(items.data()), items.size() * sizeof(T));
+}
+
+void PadTo(ofstream& out, uint64_t offset) {
+  static const char zeros[8] = {};
+  uint64_t pos = static_cast<uint64_t>(out.tellp());
+  out.write(zeros, offset - pos);
+}
+
+vector<IndexEntry> BuildIndex(
+    const map<int, list<const Record*>>& index,
+    const unordered_map<const Record*, uint32_t>& numbers) {
+  vector<IndexEntry> result;
+  for (const auto& [key, records] : index) {
+    for (const Record* rec : records) {
+      result.push_back({key, numbers.at(rec)});
+    }
+  }
+  return result;
+}
+
+// Снимок служит контрольной точкой для журнала, поэтому должен быть на диске
+// до того, как журнал будет обрезан
+void SyncFile(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw runtime_error("Cannot open " + path);
+  }
+  int result = fsync(fd);
+  close(fd);
+  if (result != 0) {
+    throw runtime_error("Cannot sync " + path);
+  }
+}
+
+string ParentDirectory(const string& path) {
+  size_t slash = path.rfind('/');
+  if (slash == string::npos) {
+    return ".";
+  }
+  return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+}
+
+void Database::SaveSnapshot(const string& path) const {
+  vector<const Record*> sorted;
+  sorted.reserve(db.size());
+  for (const auto& [id, entry] : db) {
+    sorted.push_back(&entry.rec);
+  }
+  sort(begin(sorted), end(sorted), [](const Record* l, const Record* r) {
+    return l->id < r->id;
+  });
+
+  vector<pair<Handle, const Record*>> handles(begin(by_handle), end(by_handle));
+  sort(begin(handles), end(handles));
+
+  StringPool pool;
+  vector<RecordEntry> records;
+  records.reserve(sorted.size());
+  unordered_map<const Record*, uint32_t> numbers;
+  for (const Record* rec : sorted) {
+    numbers[rec] = records.size();
+    records.push_back({pool.Add(rec->id), pool.Add(rec->title), pool.Add(rec->user),
+                       rec->timestamp, rec->karma});
+  }
+
+  vector<pair<const string*, const list<const Record*>*>> user_lists;
+  for (const auto& [user, user_records] : by_user) {
+    if (!user_records.empty()) {
+      user_lists.push_back({&user, &user_records});
+    }
+  }
+  sort(begin(user_lists), end(user_lists), [](const auto& l, const auto& r) {
+    return *l.first < *r.first;
+  });
+  vector<UserEntry> users;
+  vector<uint32_t> user_records;
+  user_records.reserve(records.size());
+  for (const auto& [user, list] : user_lists) {
+    UserEntry entry{pool.Add(*user), static_cast<uint32_t>(user_records.size()), 0};
+    for (const Record* rec : *list) {
+      user_records.push_back(numbers.at(rec));
+    }
+    entry.end = user_records.size();
+    users.push_back(entry);
+  }
+
+  const vector<IndexEntry> timestamps = BuildIndex(by_timestamp, numbers);
+  const vector<IndexEntry> karmas = BuildIndex(by_karma, numbers);
+
+  vector<uint32_t> insertion_order;
+  insertion_order.reserve(records.size());
+  for (const auto& [handle, rec] : handles) {
+    insertion_order.push_back(numbers.at(rec));
+  }
+
+  Header header = {};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.byte_order = kByteOrderMark;
+  header.record_count = records.size();
+  header.user_count = users.size();
+  header.records_offset = AlignUp(sizeof(Header));
+  header.by_timestamp_offset = AlignUp(header.records_offset + records.size() * sizeof(RecordEntry));
+  header.by_karma_offset = AlignUp(header.by_timestamp_offset + timestamps.size() * sizeof(IndexEntry));
+  header.users_offset = AlignUp(header.by_karma_offset + karmas.size() * sizeof(IndexEntry));
+  header.by_user_offset = AlignUp(header.users_offset + users.size() * sizeof(UserEntry));
+  header.by_insertion_offset = AlignUp(header.by_user_offset + user_records.size() * sizeof(uint32_t));
+  header.strings_offset = AlignUp(header.by_insertion_offset + insertion_order.size() * sizeof(uint32_t));
+  header.strings_size = pool.Data().size();
+  header.file_size = header.strings_offset + header.strings_size;
+
+  // Пишем во временный файл и переименовываем, чтобы не испортить
+  // предыдущий снимок, если запись прервётся
+  const string tmp_path = path + ".tmp";
+  {
+    ofstream out(tmp_path, ios::binary | ios::trunc);
+    if (!out) {
+      throw runtime_error("Cannot create snapshot " + tmp_path);
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    PadTo(out, header.records_offset);
+    WriteSection(out, records);
+    PadTo(out, header.by_timestamp_offset);
+    WriteSection(out, timestamps);
+    PadTo(out, header.by_karma_offset);
+    WriteSection(out, karmas);
+    PadTo(out, header.users_offset);
+    WriteSection(out, users);
+    PadTo(out, header.by_user_offset);
+    WriteSection(out, user_records);
+    PadTo(out, header.by_insertion_offset);
+    WriteSection(out, insertion_order);
+    PadTo(out, header.strings_offset);
+    out.write(pool.Data().data(), pool.Data().size());
+    if (!out.flush()) {
+      throw runtime_error("Cannot write snapshot " + tmp_path);
+    }
+  }
+  SyncFile(tmp_path);
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    throw runtime_error("Cannot rename snapshot to " + path);
+  }
+  SyncFile(ParentDirectory(path));
+}
+
+MappedFile::MappedFile(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw runtime_error("Cannot open " + path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw runtime_error("Cannot stat " + path);
+  }
+  size = st.st_size;
+  if (size > 0) {
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      close(fd);
+      throw runtime_error("Cannot mmap " + path);
+    }
+    data = static_cast<const char*>(addr);
+  }
+  close(fd);
+}
+
+MappedFile::MappedFile(MappedFile&& other)
+  : data(other.data)
+  , size(other.size)
+{
+  other.data = nullptr;
+  other.size = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) {
+  if (this != &other) {
+    Release();
+    swap(data, other.data);
+    swap(size, other.size);
+  }
+  return *this;
+}
+
+MappedFile::~MappedFile() {
+  Release();
+}
+
+void MappedFile::Release() {
+  if (data) {
+    munmap(const_cast<char*>(data), size);
+    data = nullptr;
+    size = 0;
+  }
+}
+
+Snapshot::Snapshot(MappedFile mapped) : file(move(mapped)) {
+  if (file.Size() < sizeof(Header)) {
+    throw runtime_error("Snapshot is too short");
+  }
+  header = reinterpret_cast<const Header*>(file.Data());
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0) {
+    throw runtime_error("Not a snapshot file");
+  }
+  if (header->version != kVersion) {
+    throw runtime_error("Unsupported snapshot version " + to_string(header->version));
+  }
+  if (header->byte_order != kByteOrderMark) {
+    throw runtime_error("Snapshot was written with a different byte order");
+  }
+  if (header->file_size != file.Size()) {
+    throw runtime_error("Snapshot is truncated");
+  }
+
+  const uint64_t n = header->record_count;
+  auto section = [this](uint64_t offset, uint64_t bytes) {
+    if (offset % 8 != 0 || offset > file.Size() || bytes > file.Size() - offset) {
+      throw runtime_error("Snapshot section is out of bounds");
+    }
+    return file.Data() + offset;
+  };
+  records = reinterpret_cast<const RecordEntry*>(
+    section(header->records_offset, n * sizeof(RecordEntry)));
+  by_timestamp = reinterpret_cast<const IndexEntry*>(
+    section(header->by_timestamp_offset, n * sizeof(IndexEntry)));
+  by_karma = reinterpret_cast<const IndexEntry*>(
+    section(header->by_karma_offset, n * sizeof(IndexEntry)));
+  users = reinterpret_cast<const UserEntry*>(
+    section(header->users_offset, header->user_count * sizeof(UserEntry)));
+  by_user = reinterpret_cast<const uint32_t*>(
+    section(header->by_user_offset, n * sizeof(uint32_t)));
+  by_insertion = reinterpret_cast<const uint32_t*>(
+    section(header->by_insertion_offset, n * sizeof(uint32_t)));
+  strings = section(header->strings_offset, header->strings_size);
+  Verify();
+}
+
+// Запросы доверяют ссылкам внутри снимка, поэтому проверяем их все один раз
+// при открытии, а не при каждом обращении
+void Snapshot::Verify() const {
+  const uint32_t n = header->record_count;
+  auto check_string = [this](const StringRef& ref) {
+    if (ref.offset > header->strings_size || ref.size > header->strings_size - ref.offset) {
+      throw runtime_error("Snapshot string is out of bounds");
+    }
+  };
+  auto check_record = [n](uint32_t record) {
+    if (record >= n) {
+      throw runtime_error("Snapshot record number is out of range");
+    }
+  };
+  for (uint32_t i = 0; i < n; ++i) {
+    check_string(records[i].id);
+    check_string(records[i].title);
+    check_string(records[i].user);
+    check_record(by_timestamp[i].record);
+    check_record(by_karma[i].record);
+    check_record(by_user[i]);
+    check_record(by_insertion[i]);
+  }
+  for (uint32_t i = 0; i < header->user_count; ++i) {
+    check_string(users[i].name);
+    if (users[i].begin > users[i].end || users[i].end > n) {
+      throw runtime_error("Snapshot user range is out of bounds");
+    }
+  }
+}
+
+RecordView Snapshot::Get(uint32_t index) const {
+  const RecordEntry& e = records[index];
+  return {String(e.id), String(e.title), String(e.user), e.timestamp, e.karma};
+}
+
+optional<uint32_t> Snapshot::Find(string_view id) const {
+  const RecordEntry* end = records + header->record_count;
+  const RecordEntry* it = lower_bound(records, end, id,
+    [this](const RecordEntry& e, string_view value) {
+      return String(e.id) < value;
+    });
+  if (it != end && String(it->id) == id) {
+    return it - records;
+  }
+  return nullopt;
+}
+
+Snapshot::IndexRange Snapshot::Range(const IndexEntry* begin, const IndexEntry* end,
+                                     int low, int high) {
+  auto first = lower_bound(begin, end, low, [](const IndexEntry& e, int key) {
+    return e.key < key;
+  });
+  auto last = upper_bound(first, end, high, [](int key, const IndexEntry& e) {
+    return key < e.key;
+  });
+  return {first, max(first, last)};
+}
+
+Snapshot::IndexRange Snapshot::ByTimestamp(int low, int high) const {
+  return Range(by_timestamp, by_timestamp + header->record_count, low, high);
+}
+
+Snapshot::IndexRange Snapshot::ByKarma(int low, int high) const {
+  return Range(by_karma, by_karma + header->record_count, low, high);
+}
+
+Snapshot::UserRange Snapshot::ByUser(string_view user) const {
+  const UserEntry* end = users + header->user_count;
+  const UserEntry* it = lower_bound(users, end, user,
+    [this](const UserEntry& e, string_view value) {
+      return String(e.name) < value;
+    });
+  if (it != end && String(it->name) == user) {
+    return {by_user + it->begin, by_user + it->end};
+  }
+  return {by_user, by_user};
+}
+
+Snapshot::UserRange Snapshot::ByInsertion() const {
+  return {by_insertion, by_insertion + header->record_count};
+}
+
+SnapshotDatabase OpenSnapshot(const string& path) {
+  return SnapshotDatabase(Snapshot(MappedFile(path)));
+}
+
+Database LoadSnapshot(const string& path) {
+  const Snapshot snapshot{MappedFile(path)};
+  Database db;
+  auto [begin, end] = snapshot.ByInsertion();
+  for (auto it = begin; it != end; ++it) {
+    db.Put(snapshot.Get(*it).ToRecord());
+  }
+  return db;
+}
@@ -0,0 +1,279 @@
+#include "text_index.h"
+
+#include <algorithm>
+#include <cctype>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <utility>
+
+using namespace std;
+
+namespace {
+
+bool IsWordChar(char c) {
+  return isalnum(static_cast<unsigned char>(c)) || static_cast<unsigned char>(c) >= 0x80;
+}
+
+void WriteVarint(vector<uint8_t>& out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<uint8_t>(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+uint64_t ReadVarint(const vector<uint8_t>& in, size_t& offset) {
+  uint64_t value = 0;
+  for (int shift = 0; ; shift += 7) {
+    const uint8_t byte = in[offset++];
+    value |= uint64_t(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+}
+
+}
+
+vector<string> Tokenize(string_view text) {
+  vector<string> words;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    while (pos < text.size() && !IsWordChar(text[pos])) {
+      ++pos;
+    }
+    size_t end = pos;
+    while (end < text.size() && IsWordChar(text[end])) {
+      ++end;
+    }
+    if (end > pos) {
+      string word(text.substr(pos, end - pos));
+      for (char& c : word) {
+        c = tolower(static_cast<unsigned char>(c));
+      }
+      words.push_back(move(word));
+    }
+    pos = end;
+  }
+  sort(words.begin(), words.end());
+  words.erase(unique(words.begin(), words.end()), words.end());
+  return words;
+}
+
+PostingList::Iterator::Iterator(const PostingList& list) : list(&list) {
+  EnterBlock(0);
+}
+
+void PostingList::Iterator::EnterBlock(size_t next) {
+  block = next;
+  position = 0;
+  offset = 0;
+  if (!AtEnd()) {
+    value = list->blocks[block].first;
+  }
+}
+
+void PostingList::Iterator::Next() {
+  if (AtEnd()) {
+    return;
+  }
+  const Block& current = list->blocks[block];
+  if (++position == current.count) {
+    EnterBlock(block + 1);
+  } else {
+    value += ReadVarint(current.deltas, offset);
+  }
+}
+
+void PostingList::Iterator::SkipTo(Handle target) {
+  if (AtEnd() || value >= target) {
+    return;
+  }
+  // Галопом по первым значениям блоков ищем последний блок, начинающийся
+  // не позже target, затем досматриваем его последовательно
+  const auto& blocks = list->blocks;
+  const size_t current = block;
+  size_t step = 1;
+  while (current + step < blocks.size() && blocks[current + step].first <= target) {
+    step *= 2;
+  }
+  auto first = blocks.begin() + current + step / 2;
+  auto last = blocks.begin() + min(current + step, blocks.size());
+  auto next = upper_bound(first, last, target, [](Handle t, const Block& b) {
+    return t < b.first;
+  });
+  const size_t found = (next - blocks.begin()) - 1;
+  if (found > current) {
+    EnterBlock(found);
+  }
+  while (!AtEnd() && value < target) {
+    Next();
+  }
+}
+
+size_t PostingList::ByteSize() const {
+  size_t result = blocks.size() * sizeof(Block);
+  for (const Block& block : blocks) {
+    result += block.deltas.size();
+  }
+  return result;
+}
+
+void PostingList::Append(Handle handle) {
+  if (blocks.empty() || blocks.back().count == kBlockSize) {
+    blocks.push_back({handle, 1, {}});
+  } else {
+    WriteVarint(blocks.back().deltas, handle - last);
+    ++blocks.back().count;
+  }
+  last = handle;
+  ++size;
+}
+
+vector<Handle> PostingList::Decode(const Block& block) {
+  vector<Handle> values;
+  values.reserve(block.count);
+  values.push_back(block.first);
+  size_t offset = 0;
+  while (values.size() < block.count) {
+    values.push_back(values.back() + ReadVarint(block.deltas, offset));
+  }
+  return values;
+}
+
+// Блоки после удаления могут стать короче kBlockSize; пустой блок выбрасываем
+bool PostingList::Remove(Handle handle) {
+  auto next = upper_bound(blocks.begin(), blocks.end(), handle, [](Handle h, const Block& b) {
+    return h < b.first;
+  });
+  if (next == blocks.begin()) {
+    return false;
+  }
+  const size_t index = (next - blocks.begin()) - 1;
+  vector<Handle> values = Decode(blocks[index]);
+  auto it = lower_bound(values.begin(), values.end(), handle);
+  if (it == values.end() || *it != handle) {
+    return false;
+  }
+  values.erase(it);
+  --size;
+
+  if (values.empty()) {
+    blocks.erase(blocks.begin() + index);
+    if (index == blocks.size()) {
+      last = blocks.empty() ? 0 : Decode(blocks.back()).back();
+    }
+  } else {
+    Block& block = blocks[index];
+    block.first = values.front();
+    block.count = values.size();
+    block.deltas.clear();
+    for (size_t i = 1; i < values.size(); ++i) {
+      WriteVarint(block.deltas, values[i] - values[i - 1]);
+    }
+    if (index + 1 == blocks.size()) {
+      last = values.back();
+    }
+  }
+  return true;
+}
+
+void TextIndex::Add(Handle handle, string_view text) {
+  for (string& word : Tokenize(text)) {
+    postings[move(word)].Append(handle);
+  }
+}
+
+void TextIndex::Remove(Handle handle, string_view text) {
+  for (const string& word : Tokenize(text)) {
+    auto it = postings.find(word);
+    if (it != postings.end() && it->second.Remove(handle) && it->second.Size() == 0) {
+      postings.erase(it);
+    }
+  }
+}
+
+size_t TextIndex::EstimateAllWords(const vector<string>& words) const {
+  size_t result = numeric_limits<size_t>::max();
+  for (const string& word : words) {
+    auto it = postings.find(word);
+    result = min(result, it == postings.end() ? 0 : it->second.Size());
+  }
+  return words.empty() ? 0 : result;
+}
+
+vector<Handle> TextIndex::Find(const vector<string>& words, TitleMatch match) const {
+  vector<const PostingList*> lists;
+  for (const string& word : words) {
+    auto it = postings.find(word);
+    if (it != postings.end()) {
+      lists.push_back(&it->second);
+    } else if (match == TitleMatch::AllWords) {
+      return {};
+    }
+  }
+  if (lists.empty()) {
+    return {};
+  }
+  return match == TitleMatch::AllWords ? Intersect(move(lists)) : Unite(move(lists));
+}
+
+vector<Handle> TextIndex::Intersect(vector<const PostingList*> lists) {
+  // Кандидатов берём из самого короткого списка, остальные догоняют его
+  // через SkipTo
+  sort(lists.begin(), lists.end(), [](const PostingList* l, const PostingList* r) {
+    return l->Size() < r->Size();
+  });
+  vector<PostingList::Iterator> its;
+  for (const PostingList* list : lists) {
+    its.push_back(list->Begin());
+  }
+  vector<Handle> result;
+  auto& driver = its.front();
+  while (!driver.AtEnd()) {
+    const Handle candidate = driver.Value();
+    Handle next = candidate;
+    for (size_t i = 1; i < its.size(); ++i) {
+      its[i].SkipTo(candidate);
+      if (its[i].AtEnd()) {
+        return result;
+      }
+      next = max(next, its[i].Value());
+    }
+    if (next == candidate) {
+      result.push_back(candidate);
+      driver.Next();
+    } else {
+      driver.SkipTo(next);
+    }
+  }
+  return result;
+}
+
+vector<Handle> TextIndex::Unite(vector<const PostingList*> sources) {
+  vector<PostingList::Iterator> lists;
+  for (const PostingList* list : sources) {
+    lists.push_back(list->Begin());
+  }
+  using Item = pair<Handle, size_t>;
+  priority_queue<Item, vector<Item>, greater<Item>> heads;
+  for (size_t i = 0; i < lists.size(); ++i) {
+    if (!lists[i].AtEnd()) {
+      heads.push({lists[i].Value(), i});
+    }
+  }
+  vector<Handle> result;
+  while (!heads.empty()) {
+    auto [handle, i] = heads.top();
+    heads.pop();
+    if (result.empty() || result.back() != handle) {
+      result.push_back(handle);
+    }
+    lists[i].Next();
+    if (!lists[i].AtEnd()) {
+      heads.push({lists[i].Value(), i});
+    }
+  }
+  return result;
+}
@@ -0,0 +1,54 @@
+#include "durable_database.h"
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+// Замер числа надёжных Put в секунду при разном числе пишущих потоков.
+// Запуск: secondary_index_wal_benchmark [puts_per_thread] [commit_delay_us]
+void BenchmarkDurablePuts(int threads, int puts_per_thread, microseconds commit_delay) {
+  const string path = "wal_benchmark";
+  remove((path + ".wal").c_str());
+  remove((path + ".snapshot").c_str());
+
+  DurableDatabase db(path, WalOptions{commit_delay});
+  const auto start = steady_clock::now();
+
+  vector<thread> writers;
+  for (int t = 0; t < threads; ++t) {
+    writers.emplace_back([&db, t, puts_per_thread] {
+      for (int i = 0; i < puts_per_thread; ++i) {
+        const string id = to_string(t) + "-" + to_string(i);
+        db.Put({id, "Benchmark title " + id, "user" + to_string(t), i, i % 100});
+      }
+    });
+  }
+  for (thread& w : writers) {
+    w.join();
+  }
+
+  const double seconds = duration<double>(steady_clock::now() - start).count();
+  const int total = threads * puts_per_thread;
+  cout << "threads=" << threads
+       << " commit_delay=" << commit_delay.count() << "us"
+       << " puts=" << total
+       << " fdatasync=" << db.SyncCount()
+       << " puts/s=" << static_cast<int64_t>(total / seconds) << endl;
+
+  remove((path + ".wal").c_str());
+}
+
+int main(int argc, char* argv[]) {
+  const int puts_per_thread = argc > 1 ? stoi(argv[1]) : 2000;
+  const microseconds commit_delay(argc > 2 ? stoi(argv[2]) : 0);
+  for (int threads : {1, 4, 16, 64}) {
+    BenchmarkDurablePuts(threads, puts_per_thread, commit_delay);
+  }
+  return 0;
+}
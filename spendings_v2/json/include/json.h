@@ -1,12 +1,18 @@
 #pragma once
 
 #include <istream>
+#include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <map>
+#include <variant>
 using namespace std;
 
+// Узел хранит ровно одно значение. Короткие строки string держит прямо
+// в себе, а словарь, который занял бы 48 байт, вынесен в кучу, так что
+// узел не больше строки с номером альтернативы
 class Node {
 public:
   explicit Node(vector<Node> array);
@@ -14,16 +20,46 @@ public:
   explicit Node(int value);
   explicit Node(string value);
 
+  // Копирование и разрушение не рекурсивны: глубину документа ограничивает
+  // память, а не стек вызовов
+  Node(const Node& other);
+  Node(Node&&) noexcept = default;
+  Node& operator=(const Node& other);
+  Node& operator=(Node&&) noexcept = default;
+  ~Node();
+
+  // Бросают bad_variant_access, если в узле значение другого типа
   const vector<Node>& AsArray() const;
   const map<string, Node>& AsMap() const;
   int AsInt() const;
   const string& AsString() const;
 
 private:
-  vector<Node> as_array;
-  map<string, Node> as_map;
-  int as_int;
-  string as_string;
+  // Словарь в куче, копируется вместе с содержимым. После перемещения
+  // пуст: указатель уходит вместе со словарём
+  class MapBox {
+  public:
+    explicit MapBox(map<string, Node> map);
+    MapBox(const MapBox& other);
+    MapBox(MapBox&&) noexcept = default;
+    MapBox& operator=(const MapBox& other);
+    MapBox& operator=(MapBox&&) noexcept = default;
+    ~MapBox();
+
+    const map<string, Node>& Get() const;
+
+  private:
+    friend class Node;
+
+    unique_ptr<map<string, Node>> items;
+  };
+
+  variant<int, string, vector<Node>, MapBox> value;
+
+  // Копия узла с пустыми массивом или словарём вместо исходных
+  static Node CopyWithoutChildren(const Node& node);
+  // Переносит детей узла в out, оставляя его контейнер пустым
+  void TakeChildren(vector<Node>& out);
 };
 
 class Document {
@@ -36,5 +72,26 @@ private:
   Node root;
 };
 
-Document Load(istream& input);
+// Получатель событий потокового разбора. Строки, переданные в Key
+// и String, действительны только во время вызова
+class Handler {
+public:
+  virtual ~Handler() = default;
+
+  virtual void StartArray() {}
+  virtual void EndArray() {}
+  virtual void StartObject() {}
+  virtual void Key(string_view) {}
+  virtual void EndObject() {}
+  virtual void Int(int) {}
+  virtual void String(string_view) {}
+};
+
+// Разбирает документ без построения дерева, сообщая handler о каждом
+// значении. Разбор не рекурсивный: память ограничена глубиной вложенности
+// и длиной самой длинной строки, а не размером документа. Оборванный
+// документ -- invalid_argument; пустой поток -- документ без событий
+void Parse(istream& input, Handler& handler);
 
+// Строит дерево документа поверх Parse
+Document Load(istream& input);
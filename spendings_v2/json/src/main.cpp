@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 #include <vector>
 using namespace std;
 
@@ -41,7 +42,79 @@ string MostExpensiveCategory(
     compare_by_amount)->category;
 }
 
+// Собирает траты прямо из событий разбора, не строя дерево: кроме
+// результата, в памяти только текущая трата. Трата без amount или category
+// -- ошибка, как и при загрузке через дерево
+class SpendingsHandler : public Handler {
+public:
+  explicit SpendingsHandler(vector<Spending>& result) : result(result) {
+  }
+
+  void StartArray() override {
+    ++depth;
+  }
+
+  void EndArray() override {
+    --depth;
+  }
+
+  void StartObject() override {
+    if (++depth == kSpendingDepth) {
+      current = {};
+      has_amount = has_category = false;
+    }
+  }
+
+  void Key(string_view key) override {
+    if (depth == kSpendingDepth) {
+      field = key;
+    }
+  }
+
+  void EndObject() override {
+    if (depth-- == kSpendingDepth) {
+      if (!has_amount || !has_category) {
+        throw invalid_argument("Spending without amount or category");
+      }
+      result.push_back(move(current));
+    }
+  }
+
+  void Int(int value) override {
+    if (depth == kSpendingDepth && field == "amount") {
+      current.amount = value;
+      has_amount = true;
+    }
+  }
+
+  void String(string_view value) override {
+    if (depth == kSpendingDepth && field == "category") {
+      current.category = value;
+      has_category = true;
+    }
+  }
+
+private:
+  // траты -- словари внутри корневого массива
+  static const int kSpendingDepth = 2;
+
+  vector<Spending>& result;
+  int depth = 0;
+  string field;
+  Spending current;
+  bool has_amount = false;
+  bool has_category = false;
+};
+
 vector<Spending> LoadFromJson(istream& input) {
+  vector<Spending> result;
+  SpendingsHandler handler(result);
+  Parse(input, handler);
+  return result;
+}
+
+// Загрузка через дерево документа, для сравнения в тестах
+vector<Spending> LoadFromJsonDom(istream& input) {
   Document doc = Load(input);
   vector<Spending> result;
   for (const Node& n : doc.GetRoot().AsArray()) {
@@ -49,7 +122,6 @@ vector<Spending> LoadFromJson(istream& input) {
     result.push_back({m.at("category").AsString(), m.at("amount").AsInt()});
   }
   return result;
-  // Реализуйте эту функцию с помощью библиотеки json.h
 }
 
 void TestLoadFromJson() {
@@ -73,6 +145,17 @@ void TestLoadFromJson() {
     {"sport", 12000}
   };
   ASSERT_EQUAL(spendings, expected);
+
+  for (const char* bad : {R"([{"amount": 2500}])", R"([{"category": "food"}])",
+                           R"([{"amount": 2500, "category": 5}])",
+                           R"([{"amount": 2500, "category": "food"}, {"amount": 1150)"}) {
+    istringstream bad_input(bad);
+    try {
+      LoadFromJson(bad_input);
+      ASSERT(false);
+    } catch (const invalid_argument&) {
+    }
+  }
 }
 
 void TestJsonLibrary() {
@@ -101,8 +184,127 @@ void TestJsonLibrary() {
   ASSERT_EQUAL(array_node.AsArray().size(), 1u);
 }
 
+void TestJsonNode() {
+  // скалярный узел не тащит за собой пустые контейнеры
+  ASSERT(sizeof(Node) <= sizeof(string) + sizeof(void*));
+
+  Node original(map<string, Node>{
+    {"category", Node("food")},
+    {"items", Node(vector<Node>{Node(1), Node(string(100, 'x'))})},
+  });
+  Node copy = original;
+  ASSERT_EQUAL(copy.AsMap().at("category").AsString(), "food");
+  ASSERT_EQUAL(copy.AsMap().at("items").AsArray()[1].AsString(), string(100, 'x'));
+  ASSERT(&copy.AsMap() != &original.AsMap());
+
+  // перемещённый словарь читается и копируется как пустой
+  Node moved = move(copy);
+  ASSERT_EQUAL(moved.AsMap().size(), 2u);
+  ASSERT(copy.AsMap().empty());
+  Node copy_of_moved_from = copy;
+  ASSERT(copy_of_moved_from.AsMap().empty());
+  copy_of_moved_from = original;
+  ASSERT_EQUAL(copy_of_moved_from.AsMap().size(), 2u);
+
+  try {
+    Node(5).AsString();
+    ASSERT(false);
+  } catch (const bad_variant_access&) {
+  }
+}
+
+// Записывает события разбора в строку
+class EventLog : public Handler {
+public:
+  string log;
+
+  void StartArray() override { log += "["; }
+  void EndArray() override { log += "]"; }
+  void StartObject() override { log += "{"; }
+  void Key(string_view key) override { log += string(key) + ":"; }
+  void EndObject() override { log += "}"; }
+  void Int(int value) override { log += to_string(value) + ","; }
+  void String(string_view value) override { log += "'" + string(value) + "',"; }
+};
+
+void TestParseEvents() {
+  istringstream input(R"([1, "a", {"k": [2, {}], "m": "v"}, [], [[3]]])");
+  EventLog events;
+  Parse(input, events);
+  ASSERT_EQUAL(events.log, "[1,'a',{k:[2,{}]m:'v',}[][[3,]]]");
+
+  // оборванный документ -- ошибка; раньше {"a": 1, давал повторный ключ a
+  for (const char* truncated : {"[1, 2", "[1,", R"({"a": 1,)", R"({"a")", R"({"a)", R"(["a)"}) {
+    istringstream truncated_input(truncated);
+    EventLog ignored;
+    try {
+      Parse(truncated_input, ignored);
+      ASSERT(false);
+    } catch (const invalid_argument&) {
+    }
+  }
+  istringstream empty("");
+  EventLog empty_events;
+  Parse(empty, empty_events);
+  ASSERT_EQUAL(empty_events.log, "");
+
+  // глубина вложенности не ограничена стеком вызовов
+  const size_t depth = 1000000;
+  istringstream deep(string(depth, '[') + "7" + string(depth, ']'));
+  EventLog deep_events;
+  Parse(deep, deep_events);
+  ASSERT_EQUAL(deep_events.log.size(), 2 * depth + 2);
+
+  // дерево строится, копируется и разрушается тоже без рекурсии. На такой
+  // глубине рекурсивное разрушение переполняло стек даже с -O2
+  const size_t tree_depth = 200000;
+  istringstream nested(string(tree_depth, '[') + "7" + string(tree_depth, ']'));
+  const Document doc = Load(nested);
+  const Node array_copy = doc.GetRoot();
+  const Node* node = &array_copy;
+  for (size_t i = 0; i < tree_depth; ++i) {
+    node = &node->AsArray().at(0);
+  }
+  ASSERT_EQUAL(node->AsInt(), 7);
+
+  // вложенные словари строятся дольше, а стек переполняли и на меньшей
+  // глубине
+  const size_t object_depth = 50000;
+  string objects;
+  for (size_t i = 0; i < object_depth; ++i) {
+    objects += R"({"k": )";
+  }
+  objects += "7" + string(object_depth, '}');
+  istringstream nested_objects(objects);
+  const Document objects_doc = Load(nested_objects);
+  const Node objects_copy = objects_doc.GetRoot();
+  node = &objects_copy;
+  for (size_t i = 0; i < object_depth; ++i) {
+    node = &node->AsMap().at("k");
+  }
+  ASSERT_EQUAL(node->AsInt(), 7);
+}
+
+void TestLoadFromJsonStreaming() {
+  ostringstream json;
+  json << "[";
+  for (int i = 0; i < 100000; ++i) {
+    json << (i ? ", " : "") << R"({"amount": )" << i << R"(, "category": "c)" << i % 17
+         << R"(", "tags": [{"amount": 1}]})";
+  }
+  json << "]";
+  istringstream streaming_input(json.str());
+  istringstream dom_input(json.str());
+  const vector<Spending> spendings = LoadFromJson(streaming_input);
+  ASSERT_EQUAL(spendings.size(), 100000u);
+  ASSERT_EQUAL(spendings, LoadFromJsonDom(dom_input));
+}
+
 int main() {
   TestRunner tr;
   RUN_TEST(tr, TestJsonLibrary);
+  RUN_TEST(tr, TestJsonNode);
+  RUN_TEST(tr, TestParseEvents);
+  RUN_TEST(tr, TestLoadFromJsonStreaming);
   RUN_TEST(tr, TestLoadFromJson);
 }